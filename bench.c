@@ -0,0 +1,461 @@
+// End-to-end benchmark suite for Binary Merklization using BLAKE3
+//
+// Sweeps over leaf counts, work-group sizes & kernel variants, timing each
+// configuration with warmup runs, so that min/ median/ p99 of each phase ( see
+// `enum bench_phase` in include/bench.h ) can be reported in machine readable
+// form ( CSV/ JSON ), for tracking regressions across driver/ library versions
+//
+// Usage:
+//
+//  ./bench [--iters N] [--warmup N] [--min-log N] [--max-log N]
+//          [--wg N[,N...]] [--format csv|json] [--out FILE]
+//          [--trace FILE] [--arena 0|1] [--metrics FILE]
+//
+// When --trace is passed, one extra ( untimed ) run of each configuration is
+// recorded & exported as Chrome trace JSON, while per-level summary of it is
+// written to stderr
+//
+// When --arena 1 is passed, all runs reuse pinned host staging & device
+// buffers of one arena ( see include/arena.h ), which is trimmed after each
+// configuration
+//
+// When --metrics is passed, resource usage & data movement of all runs ( see
+// include/metrics.h ) is summed up, dumped to given file once every second &
+// once more, after all configurations are done
+
+#include "bench.h"
+
+#define show_message_and_exit(status, msg)                                     \
+  if (status != CL_SUCCESS) {                                                  \
+    printf(msg);                                                               \
+    return EXIT_FAILURE;                                                       \
+  }
+
+// Compile time preprocessed variants of kernel.cl, exposing `merklize` kernel
+typedef struct
+{
+  const char* name;  // as reported in output
+  const char* flags; // online compilation flags
+} kernel_variant_t;
+
+const kernel_variant_t variants[] = {
+  { "merklize", ocl_kernel_flag_2 },
+  { "merklize/scalar", "-w -DSCALAR_ROUND" },
+};
+const size_t variant_cnt = sizeof(variants) / sizeof(kernel_variant_t);
+
+// Upper bound on how many work-group sizes can be swept over
+#define MAX_WG_SIZES 16
+
+typedef struct
+{
+  size_t iters;
+  size_t warmup;
+  size_t min_log;
+  size_t max_log;
+  size_t wg_sizes[MAX_WG_SIZES]; // when wg_cnt == 0, decided in runtime
+  size_t wg_cnt;
+  int json; // 0 => CSV, 1 => JSON
+  const char* out;
+  const char* trace;
+  int arena; // reuse buffers across runs ?
+  const char* metrics;
+} bench_args_t;
+
+// Parses comma separated list of work-group sizes
+int
+parse_wg_sizes(const char* arg, bench_args_t* const args)
+{
+  char* dup = strdup(arg);
+  char* save = NULL;
+
+  args->wg_cnt = 0;
+  for (char* tok = strtok_r(dup, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (args->wg_cnt == MAX_WG_SIZES) {
+      break;
+    }
+
+    const size_t wg = strtoull(tok, NULL, 10);
+    if (wg == 0 || (wg & (wg - 1)) != 0) {
+      fprintf(stderr, "work-group size %zu is not power of 2 !\n", wg);
+      free(dup);
+      return 1;
+    }
+
+    args->wg_sizes[args->wg_cnt++] = wg;
+  }
+
+  free(dup);
+  return 0;
+}
+
+int
+parse_args(int argc, char** argv, bench_args_t* const args)
+{
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (val == NULL) {
+      fprintf(stderr, "missing value for %s !\n", arg);
+      return 1;
+    }
+
+    if (strcmp(arg, "--iters") == 0) {
+      args->iters = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--warmup") == 0) {
+      args->warmup = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--min-log") == 0) {
+      args->min_log = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--max-log") == 0) {
+      args->max_log = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--wg") == 0) {
+      if (parse_wg_sizes(val, args) != 0) {
+        return 1;
+      }
+    } else if (strcmp(arg, "--format") == 0) {
+      if (strcmp(val, "csv") == 0) {
+        args->json = 0;
+      } else if (strcmp(val, "json") == 0) {
+        args->json = 1;
+      } else {
+        fprintf(stderr, "unknown output format %s !\n", val);
+        return 1;
+      }
+    } else if (strcmp(arg, "--out") == 0) {
+      args->out = val;
+    } else if (strcmp(arg, "--trace") == 0) {
+      args->trace = val;
+    } else if (strcmp(arg, "--arena") == 0) {
+      args->arena = strcmp(val, "0") != 0;
+    } else if (strcmp(arg, "--metrics") == 0) {
+      args->metrics = val;
+    } else {
+      fprintf(stderr, "unknown argument %s !\n", arg);
+      return 1;
+    }
+
+    i++;
+  }
+
+  if (args->iters == 0 || args->min_log < 20 || args->min_log > args->max_log) {
+    fprintf(stderr, "invalid iteration count/ leaf count range !\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// When no work-group sizes are requested, sweep over powers of 2, starting
+// from preferred work-group size multiple, till maximum work-group size
+// supported for this kernel
+void
+default_wg_sizes(cl_kernel krnl, cl_device_id dev_id, bench_args_t* const args)
+{
+  size_t pref = 0;
+  size_t max = 0;
+
+  preferred_work_group_size_multiple(krnl, dev_id, &pref);
+  clGetKernelWorkGroupInfo(
+    krnl, dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max, NULL);
+
+  // preferred multiple is not guaranteed to be power of 2
+  size_t wg = 1;
+  while (wg < pref) {
+    wg <<= 1;
+  }
+
+  args->wg_cnt = 0;
+  for (; wg <= max && args->wg_cnt < MAX_WG_SIZES; wg <<= 1) {
+    args->wg_sizes[args->wg_cnt++] = wg;
+  }
+
+  if (args->wg_cnt == 0) {
+    args->wg_sizes[args->wg_cnt++] = 1;
+  }
+}
+
+// Writes one record per timed phase of some benchmarked configuration
+void
+emit_records(FILE* fd,
+             const bench_args_t* args,
+             const char* dev_name,
+             const char* drv_version,
+             const char* variant,
+             size_t leaf_count,
+             size_t wg_size,
+             cl_ulong* const samples, // PHASE_COUNT x iters, phase major
+             int* const first)
+{
+  const size_t bytes = leaf_count << 5;
+
+  for (size_t p = 0; p < PHASE_COUNT; p++) {
+    bench_stats_t st;
+    bench_stats(samples + p * args->iters, args->iters, &st);
+
+    const double gbps = bench_gbps(bytes, st.median);
+
+    // device name & driver version are reported by runtime, so they're
+    // escaped, while rest of the fields are known to be safe
+    if (args->json) {
+      fprintf(fd, "%s\n    { \"device\": ", *first ? "" : ",");
+      bench_write_string(fd, dev_name, 1);
+      fprintf(fd, ", \"driver\": ");
+      bench_write_string(fd, drv_version, 1);
+      fprintf(fd,
+              ", \"variant\": \"%s\", \"leaf_count\": %zu, \"wg_size\": %zu, "
+              "\"iters\": %zu, \"phase\": \"%s\", \"min_ns\": %.0lf, "
+              "\"median_ns\": %.1lf, \"p99_ns\": %.0lf, \"mean_ns\": %.1lf, "
+              "\"median_gbps\": %.4lf }",
+              variant,
+              leaf_count,
+              wg_size,
+              args->iters,
+              bench_phase_names[p],
+              st.min,
+              st.median,
+              st.p99,
+              st.mean,
+              gbps);
+    } else {
+      bench_write_string(fd, dev_name, 0);
+      fputc(',', fd);
+      bench_write_string(fd, drv_version, 0);
+      fprintf(fd,
+              ",%s,%zu,%zu,%zu,%s,%.0lf,%.1lf,%.0lf,%.1lf,%.4lf\n",
+              variant,
+              leaf_count,
+              wg_size,
+              args->iters,
+              bench_phase_names[p],
+              st.min,
+              st.median,
+              st.p99,
+              st.mean,
+              gbps);
+    }
+
+    *first = 0;
+  }
+
+  fflush(fd);
+}
+
+int
+main(int argc, char** argv)
+{
+  bench_args_t args = { .iters = 16,
+                        .warmup = 2,
+                        .min_log = 20,
+                        .max_log = 25,
+                        .wg_cnt = 0,
+                        .json = 0,
+                        .out = NULL,
+                        .trace = NULL,
+                        .arena = 0,
+                        .metrics = NULL };
+  if (parse_args(argc, argv, &args) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  cl_int status;
+
+  cl_device_id dev_id;
+  status = find_device(&dev_id);
+  show_message_and_exit(status, "failed to find device !\n");
+
+  char* dev_name = device_info_string(dev_id, CL_DEVICE_NAME);
+  char* drv_version = device_info_string(dev_id, CL_DRIVER_VERSION);
+
+  fprintf(stderr, "running on %s ( driver %s )\n", dev_name, drv_version);
+
+  cl_context ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &status);
+  show_message_and_exit(status, "failed to create context !\n");
+
+  // see main.c, for why these queue properties are required
+  cl_queue_properties props[] = { CL_QUEUE_PROPERTIES,
+                                  CL_QUEUE_PROFILING_ENABLE |
+                                    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                  0 };
+  cl_command_queue c_queue =
+    clCreateCommandQueueWithProperties(ctx, dev_id, props, &status);
+  show_message_and_exit(status, "failed to create command queue !\n");
+
+  FILE* fd = args.out != NULL ? fopen(args.out, "w") : stdout;
+  if (fd == NULL) {
+    fprintf(stderr, "failed to open %s !\n", args.out);
+    return EXIT_FAILURE;
+  }
+
+  if (args.json) {
+    fprintf(fd, "[");
+  } else {
+    fprintf(fd,
+            "device,driver,variant,leaf_count,wg_size,iters,phase,min_ns,"
+            "median_ns,p99_ns,mean_ns,median_gbps\n");
+  }
+
+  int first = 1;
+  const int user_wg = args.wg_cnt > 0;
+
+  trace_t trace;
+  trace_init(&trace);
+
+  // pooled buffers are kept idle only upto size of largest tree's buffers
+  arena_t arena;
+  arena_init(&arena, ctx, c_queue, ((size_t)1 << (args.max_log + 5)) << 2);
+
+  FILE* m_fd = NULL;
+  if (args.metrics != NULL) {
+    m_fd = fopen(args.metrics, "w");
+    if (m_fd == NULL) {
+      fprintf(stderr, "failed to open %s !\n", args.metrics);
+      return EXIT_FAILURE;
+    }
+  }
+
+  metrics_t metrics;
+  metrics_init(&metrics, m_fd, 1000000000ul);
+
+  const merklize_opts_t opts = { .arena = args.arena ? &arena : NULL,
+                                 .metrics = m_fd != NULL ? &metrics : NULL };
+  const merklize_opts_t trace_opts = { .trace = &trace,
+                                       .arena = opts.arena,
+                                       .metrics = opts.metrics };
+
+  cl_ulong* samples =
+    (cl_ulong*)malloc(sizeof(cl_ulong) * PHASE_COUNT * args.iters);
+  check_mem_alloc(samples);
+
+  for (size_t v = 0; v < variant_cnt; v++) {
+    cl_program prgm;
+    status = build_kernel_from_source(
+      ctx, dev_id, "kernel.cl", variants[v].flags, &prgm);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "failed to compile kernel !\n");
+
+      show_build_log(dev_id, prgm);
+      return EXIT_FAILURE;
+    }
+
+    cl_kernel krnl = clCreateKernel(prgm, "merklize", &status);
+    show_message_and_exit(status, "failed to create `merklize` kernel !\n");
+
+    if (!user_wg) {
+      default_wg_sizes(krnl, dev_id, &args);
+    }
+
+    for (size_t i = args.min_log; i <= args.max_log; i++) {
+      const size_t leaf_count = (size_t)1 << i;
+
+      for (size_t w = 0; w < args.wg_cnt; w++) {
+        const size_t wg_size = args.wg_sizes[w];
+
+        if ((leaf_count >> 1) < wg_size) {
+          continue;
+        }
+
+        cl_ulong phases[PHASE_COUNT];
+
+        // warmup runs, so that JIT/ driver allocation/ page fault costs
+        // don't show up in reported samples
+        for (size_t j = 0; j < args.warmup; j++) {
+          status = bench_merklize_e2e(
+            ctx, c_queue, krnl, leaf_count, wg_size, phases, &opts);
+          show_message_and_exit(status, "failed to merklize !\n");
+        }
+
+        for (size_t j = 0; j < args.iters; j++) {
+          status = bench_merklize_e2e(
+            ctx, c_queue, krnl, leaf_count, wg_size, phases, &opts);
+          show_message_and_exit(status, "failed to merklize !\n");
+
+          for (size_t p = 0; p < PHASE_COUNT; p++) {
+            *(samples + p * args.iters + j) = phases[p];
+          }
+        }
+
+        if (args.trace != NULL) {
+          const size_t from = trace.count;
+
+          status = bench_merklize_e2e(
+            ctx, c_queue, krnl, leaf_count, wg_size, phases, &trace_opts);
+          show_message_and_exit(status, "failed to merklize !\n");
+
+          // summary of only this configuration's tree build
+          const trace_t last = { .cmds = trace.cmds + from,
+                                 .count = trace.count - from,
+                                 .cap = trace.count - from,
+                                 .trees = 1 };
+
+          fprintf(stderr,
+                  "\n%s: 2 ^ %zu leaves, wg size %zu\n",
+                  variants[v].name,
+                  i,
+                  wg_size);
+          trace_level_summary(&last, stderr);
+        }
+
+        arena_trim(&arena);
+
+        emit_records(fd,
+                     &args,
+                     dev_name,
+                     drv_version,
+                     variants[v].name,
+                     leaf_count,
+                     wg_size,
+                     samples,
+                     &first);
+
+        fprintf(stderr,
+                "%s: 2 ^ %2zu leaves, wg size %4zu done\n",
+                variants[v].name,
+                i,
+                wg_size);
+      }
+    }
+
+    clReleaseKernel(krnl);
+    clReleaseProgram(prgm);
+  }
+
+  if (args.json) {
+    fprintf(fd, "\n]\n");
+  }
+
+  if (fd != stdout) {
+    fclose(fd);
+  }
+
+  if (args.trace != NULL) {
+    FILE* t_fd = fopen(args.trace, "w");
+    if (t_fd == NULL) {
+      fprintf(stderr, "failed to open %s !\n", args.trace);
+      return EXIT_FAILURE;
+    }
+
+    trace_export_chrome(&trace, t_fd);
+    fclose(t_fd);
+  }
+
+  if (m_fd != NULL) {
+    metrics_print(&metrics.total, m_fd);
+    fclose(m_fd);
+  }
+
+  trace_free(&trace);
+  arena_free(&arena);
+  metrics_free(&metrics);
+
+  clReleaseCommandQueue(c_queue);
+  clReleaseContext(ctx);
+  clReleaseDevice(dev_id);
+
+  free(samples);
+  free(dev_name);
+  free(drv_version);
+
+  return EXIT_SUCCESS;
+}
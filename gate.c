@@ -0,0 +1,726 @@
+// Differential correctness & performance regression gate, for Binary
+// Merklization using BLAKE3
+//
+// On every accessible CPU/ GPU device, for every kernel variant & every way
+// of building tree on device ( see `enum gate_backend` ), and also on host,
+// trees of 2 ^ min-log .. 2 ^ max-log leaves are built from `--seeds` -many
+// seeded random inputs & compared node by node against a scalar host
+// reference, which hashes one pair of nodes at a time
+//
+// Then end-to-end throughput of `merklize( ... )` ( median of `--iters` runs )
+// of each device, kernel variant & tree size, which is large enough for it,
+// is compared against baseline file, failing when it's lower than baseline by
+// more than `--tolerance` fraction. Baseline file holds one record per line,
+// as tab separated device name, kernel variant, log2( leaf count ) & GB/s; so
+// one file can keep baselines of many devices. Passing `--update 1` writes
+// measured throughput back to baseline file, instead of comparing against it.
+//
+// Usage:
+//
+//  ./gate [--min-log N] [--max-log N] [--seeds N] [--iters N]
+//         [--baseline FILE] [--tolerance F] [--update 0|1]
+//
+// Exits with non-zero status on any mismatching node or throughput regression
+
+#include "bench.h"
+#include "blocked.h"
+#include "host_merklize.h"
+#include <errno.h>
+
+#define show_message_and_exit(status, msg)                                     \
+  if (status != CL_SUCCESS) {                                                  \
+    fprintf(stderr, msg);                                                      \
+    return EXIT_FAILURE;                                                       \
+  }
+
+// Compile time preprocessed variants of kernel.cl, exposing both `merklize` &
+// `merklize_blocked` kernels
+//
+// Note, GLOBAL_MSG variant isn't gated, because it permutes message words
+// right where they live, overwriting tree levels it reads ( see kernel.cl )
+typedef struct
+{
+  const char* name;  // as reported in output & baseline file
+  const char* flags; // online compilation flags
+} kernel_variant_t;
+
+const kernel_variant_t variants[] = {
+  { "vec4", ocl_kernel_flag_2 },
+  { "scalar", "-w -DSCALAR_ROUND" },
+};
+const size_t variant_cnt = sizeof(variants) / sizeof(kernel_variant_t);
+
+// Ways of building tree on device, all producing intermediate nodes in
+// `merklize( ... )` output layout, after conversion ( if required )
+enum gate_backend
+{
+  GATE_MERKLIZE,     // `merklize( ... )`
+  GATE_ARENA,        // `merklize( ... )`, staging through buffer arena
+  GATE_IOV,          // `merklize_iov( ... )`, leaves gathered from 3 segments
+  GATE_STREAM,       // `merklize( ... )`, levels read back in groups of 3
+  GATE_STREAM_ARENA, // same, staging through buffer arena
+  GATE_INPLACE,      // `merklize_inplace( ... )`
+  GATE_BLOCKED,      // `merklize_blocked( ... )`, converted back to heap layout
+  GATE_BACKENDS
+};
+
+const char* gate_backend_names[GATE_BACKENDS] = {
+  "merklize", "merklize/arena", "merklize_iov", "merklize/stream",
+  "merklize/stream+arena", "merklize_inplace", "merklize_blocked"
+};
+
+// Smallest tree `merklize( ... )` accepts
+#define GATE_MIN_LARGE_LOG 20
+
+typedef struct
+{
+  size_t min_log;
+  size_t max_log;
+  size_t seeds;
+  size_t iters;
+  const char* baseline;
+  double tolerance; // allowed fraction of throughput drop
+  int update;       // write baseline, instead of comparing against it ?
+} gate_args_t;
+
+typedef struct
+{
+  char device[256];
+  char variant[32];
+  size_t log;
+  double gbps;
+} baseline_t;
+
+// Everything required for building trees on one device, using one kernel
+// variant
+typedef struct
+{
+  cl_context ctx;
+  cl_command_queue cq;
+  cl_kernel krnl;
+  cl_kernel blocked_krnl;
+  size_t wg_size;
+  arena_t* arena;
+} gate_device_t;
+
+int
+parse_args(int argc, char** argv, gate_args_t* const args)
+{
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (val == NULL) {
+      fprintf(stderr, "missing value for %s !\n", arg);
+      return 1;
+    }
+
+    if (strcmp(arg, "--min-log") == 0) {
+      args->min_log = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--max-log") == 0) {
+      args->max_log = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--seeds") == 0) {
+      args->seeds = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--iters") == 0) {
+      args->iters = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--baseline") == 0) {
+      args->baseline = val;
+    } else if (strcmp(arg, "--tolerance") == 0) {
+      args->tolerance = strtod(val, NULL);
+    } else if (strcmp(arg, "--update") == 0) {
+      args->update = strcmp(val, "0") != 0;
+    } else {
+      fprintf(stderr, "unknown argument %s !\n", arg);
+      return 1;
+    }
+
+    i++;
+  }
+
+  if (args->min_log < 1 || args->min_log > args->max_log ||
+      args->max_log > 30 || args->seeds == 0 || args->iters == 0 ||
+      args->tolerance < 0. || args->tolerance >= 1.) {
+    fprintf(stderr, "invalid leaf count range/ seed/ iteration count !\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Loads all records of baseline file, a missing file having none; `*entries`
+// must be freed by caller
+//
+// Returns 0 on success, otherwise -1, with `errno` set
+int
+baseline_load(const char* path, baseline_t** entries, size_t* const count)
+{
+  *entries = NULL;
+  *count = 0;
+
+  FILE* fd = fopen(path, "r");
+  if (fd == NULL) {
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  char line[512];
+  size_t cap = 0;
+
+  while (fgets(line, sizeof(line), fd) != NULL) {
+    char* save = NULL;
+    const char* device = strtok_r(line, "\t", &save);
+    const char* variant = strtok_r(NULL, "\t", &save);
+    const char* log = strtok_r(NULL, "\t", &save);
+    const char* gbps = strtok_r(NULL, "\t\n", &save);
+
+    // blank/ malformed lines are skipped
+    if (device == NULL || variant == NULL || log == NULL || gbps == NULL) {
+      continue;
+    }
+
+    if (*count == cap) {
+      cap = cap == 0 ? 16 : cap << 1;
+      *entries = (baseline_t*)realloc(*entries, sizeof(baseline_t) * cap);
+      check_mem_alloc(*entries);
+    }
+
+    baseline_t* const e = *entries + (*count)++;
+    snprintf(e->device, sizeof(e->device), "%s", device);
+    snprintf(e->variant, sizeof(e->variant), "%s", variant);
+    e->log = strtoull(log, NULL, 10);
+    e->gbps = strtod(gbps, NULL);
+  }
+
+  fclose(fd);
+  return 0;
+}
+
+// Record of given device, kernel variant & tree size, if any
+baseline_t*
+baseline_find(baseline_t* const entries,
+              size_t count,
+              const char* device,
+              const char* variant,
+              size_t log)
+{
+  for (size_t i = 0; i < count; i++) {
+    baseline_t* const e = entries + i;
+
+    if (strcmp(e->device, device) == 0 && strcmp(e->variant, variant) == 0 &&
+        e->log == log) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+// Sets record of given device, kernel variant & tree size, appending it, if
+// not already present
+void
+baseline_set(baseline_t** entries,
+             size_t* const count,
+             const char* device,
+             const char* variant,
+             size_t log,
+             double gbps)
+{
+  baseline_t* e = baseline_find(*entries, *count, device, variant, log);
+
+  if (e == NULL) {
+    *entries =
+      (baseline_t*)realloc(*entries, sizeof(baseline_t) * (*count + 1));
+    check_mem_alloc(*entries);
+
+    e = *entries + (*count)++;
+    snprintf(e->device, sizeof(e->device), "%s", device);
+    snprintf(e->variant, sizeof(e->variant), "%s", variant);
+    e->log = log;
+  }
+
+  e->gbps = gbps;
+}
+
+// Returns 0 on success, otherwise -1, with `errno` set
+int
+baseline_store(const char* path, const baseline_t* entries, size_t count)
+{
+  FILE* fd = fopen(path, "w");
+  if (fd == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const baseline_t* e = entries + i;
+    fprintf(fd, "%s\t%s\t%zu\t%.4lf\n", e->device, e->variant, e->log, e->gbps);
+  }
+
+  return fclose(fd);
+}
+
+// Fills input with random leaves, reproducibly derived from tree size & seed
+void
+seeded_input(cl_uchar* const in, size_t size, size_t log, size_t seed)
+{
+  srand((unsigned int)(seed * 1000003u + log));
+  random_input(in, size);
+}
+
+// Scalar reference, computing all intermediate nodes of tree of 2N nodes,
+// whose leaves are already at [N, 2N), bottom-up, one pair at a time
+void
+reference_tree(cl_uchar* const tree, size_t leaf_count)
+{
+  for (size_t i = leaf_count - 1; i > 0; i--) {
+    blake3_hash_pair_host(tree + (i << 6), tree + (i << 5));
+  }
+}
+
+// Index of first intermediate node ( in [1, N) ) differing from reference,
+// 0 when all of them match
+size_t
+first_mismatch(const cl_uchar* reference,
+               const cl_uchar* out,
+               size_t leaf_count)
+{
+  for (size_t i = 1; i < leaf_count; i++) {
+    if (memcmp(reference + (i << 5), out + (i << 5), 32) != 0) {
+      return i;
+    }
+  }
+
+  return 0;
+}
+
+// Whether given backend can build tree of 2 ^ log leaves
+int
+gate_supported(enum gate_backend backend, size_t log)
+{
+  return backend >= GATE_INPLACE || log >= GATE_MIN_LARGE_LOG;
+}
+
+// Builds tree of N leaves, on device, using given backend, writing N
+// intermediate nodes ( node slot 0 included ) to `out`
+cl_int
+gate_build(const gate_device_t* dev,
+           enum gate_backend backend,
+           const cl_uchar* in,
+           size_t leaf_count,
+           size_t block_log,
+           cl_uchar* const out)
+{
+  const size_t size = leaf_count << 5;
+
+  cl_int status = CL_SUCCESS;
+  cl_ulong ts[3];
+
+  switch (backend) {
+    case GATE_MERKLIZE:
+    case GATE_ARENA:
+    case GATE_STREAM:
+    case GATE_STREAM_ARENA: {
+      // uneven # -of levels per group, so that topmost group is partial
+      const merklize_opts_t opts = {
+        .arena = backend == GATE_ARENA || backend == GATE_STREAM_ARENA
+                   ? dev->arena
+                   : NULL,
+        .stream_levels =
+          backend == GATE_STREAM || backend == GATE_STREAM_ARENA ? 3 : 0
+      };
+      status = merklize(dev->ctx,
+                        dev->cq,
+                        dev->krnl,
+                        in,
+                        size,
+                        leaf_count,
+                        out,
+                        size,
+                        dev->wg_size,
+                        ts,
+                        &opts);
+      break;
+    }
+    case GATE_IOV: {
+      // unevenly sized segments, so that writes land at unaligned offsets
+      const size_t first = leaf_count / 3;
+      const merklize_iov_t iov[] = {
+        { .ptr = in, .leaf_count = first },
+        { .ptr = in + (first << 5), .leaf_count = 1 },
+        { .ptr = in + ((first + 1) << 5),
+          .leaf_count = leaf_count - first - 1 },
+      };
+      status = merklize_iov(dev->ctx,
+                            dev->cq,
+                            dev->krnl,
+                            iov,
+                            3,
+                            leaf_count,
+                            out,
+                            size,
+                            dev->wg_size,
+                            ts,
+                            NULL);
+      break;
+    }
+    case GATE_INPLACE: {
+      cl_uchar* tree = (cl_uchar*)malloc(size << 1);
+      check_mem_alloc(tree);
+
+      memcpy(tree + size, in, size);
+      status = merklize_inplace(dev->ctx,
+                                dev->cq,
+                                dev->krnl,
+                                tree,
+                                size << 1,
+                                leaf_count,
+                                dev->wg_size,
+                                ts,
+                                NULL);
+      memcpy(out, tree, size);
+
+      free(tree);
+      break;
+    }
+    case GATE_BLOCKED: {
+      const size_t height = blocked_height(leaf_count);
+      const size_t t_size = blocked_slots(height, block_log) << 5;
+
+      cl_uchar* tree = (cl_uchar*)calloc(t_size, 1);
+      check_mem_alloc(tree);
+
+      blocked_set_leaves(tree, in, leaf_count, block_log);
+      status = merklize_blocked(dev->ctx,
+                                dev->cq,
+                                dev->blocked_krnl,
+                                tree,
+                                t_size,
+                                leaf_count,
+                                block_log,
+                                dev->wg_size,
+                                ts,
+                                NULL);
+
+      for (size_t i = 1; i < leaf_count; i++) {
+        memcpy(out + (i << 5),
+               tree + (blocked_index(i, height, block_log) << 5),
+               32);
+      }
+
+      free(tree);
+      break;
+    }
+    default:
+      status = CL_INVALID_VALUE;
+  }
+
+  return status;
+}
+
+// Median end-to-end throughput of `merklize( ... )`, in GB/s
+cl_int
+gate_throughput(const gate_device_t* dev,
+                size_t leaf_count,
+                size_t iters,
+                double* const gbps)
+{
+  const size_t size = leaf_count << 5;
+
+  cl_uchar* in = (cl_uchar*)malloc(size);
+  check_mem_alloc(in);
+  cl_uchar* out = (cl_uchar*)malloc(size);
+  check_mem_alloc(out);
+  cl_ulong* samples = (cl_ulong*)malloc(sizeof(cl_ulong) * iters);
+  check_mem_alloc(samples);
+
+  random_input(in, size);
+
+  cl_int status = CL_SUCCESS;
+  cl_ulong ts[3];
+
+  // first run pays for JIT/ driver allocation, so it's discarded
+  for (size_t i = 0; i <= iters && status == CL_SUCCESS; i++) {
+    const cl_ulong t0 = bench_now_ns();
+    status = merklize(dev->ctx,
+                      dev->cq,
+                      dev->krnl,
+                      in,
+                      size,
+                      leaf_count,
+                      out,
+                      size,
+                      dev->wg_size,
+                      ts,
+                      NULL);
+    const cl_ulong t1 = bench_now_ns();
+
+    if (i > 0) {
+      *(samples + i - 1) = t1 - t0;
+    }
+  }
+
+  if (status == CL_SUCCESS) {
+    bench_stats_t st;
+    bench_stats(samples, iters, &st);
+
+    *gbps = bench_gbps(size, st.median);
+  }
+
+  free(in);
+  free(out);
+  free(samples);
+
+  return status;
+}
+
+int
+main(int argc, char** argv)
+{
+  gate_args_t args = { .min_log = 4,
+                       .max_log = 22,
+                       .seeds = 4,
+                       .iters = 8,
+                       .baseline = NULL,
+                       .tolerance = 0.1,
+                       .update = 0 };
+  if (parse_args(argc, argv, &args) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  baseline_t* baseline = NULL;
+  size_t baseline_cnt = 0;
+  if (args.baseline != NULL &&
+      baseline_load(args.baseline, &baseline, &baseline_cnt) != 0) {
+    perror("failed to read baseline");
+    return EXIT_FAILURE;
+  }
+
+  cl_int status;
+
+  cl_device_id* devices;
+  cl_uint dev_cnt;
+  status = find_devices(&devices, &dev_cnt);
+  show_message_and_exit(status, "failed to find any device !\n");
+
+  size_t compared = 0;
+  size_t mismatches = 0;
+  size_t regressions = 0;
+
+  // host backends don't depend on device, so they're gated once
+  for (size_t log = args.min_log; log <= args.max_log; log++) {
+    const size_t leaf_count = (size_t)1 << log;
+    const size_t size = leaf_count << 5;
+
+    cl_uchar* ref = (cl_uchar*)malloc(size << 1);
+    check_mem_alloc(ref);
+    cl_uchar* out = (cl_uchar*)malloc(size);
+    check_mem_alloc(out);
+
+    for (size_t seed = 0; seed < args.seeds; seed++) {
+      seeded_input(ref + size, size, log, seed);
+      reference_tree(ref, leaf_count);
+
+      const size_t block_log = 3 + seed % 5;
+      const size_t height = blocked_height(leaf_count);
+      const size_t t_size = blocked_slots(height, block_log) << 5;
+
+      for (size_t b = 0; b < 3; b++) {
+        const char* names[] = { "host/1", "host/all", "blocked_host" };
+
+        if (b < 2) {
+          merklize_host(ref + size, size, leaf_count, out, size, 1 - b);
+        } else {
+          cl_uchar* tree = (cl_uchar*)calloc(t_size, 1);
+          check_mem_alloc(tree);
+
+          blocked_set_leaves(tree, ref + size, leaf_count, block_log);
+          merklize_blocked_host(tree, leaf_count, block_log);
+
+          for (size_t i = 1; i < leaf_count; i++) {
+            memcpy(out + (i << 5),
+                   tree + (blocked_index(i, height, block_log) << 5),
+                   32);
+          }
+
+          free(tree);
+        }
+
+        const size_t node = first_mismatch(ref, out, leaf_count);
+        compared++;
+
+        if (node != 0) {
+          mismatches++;
+          printf("MISMATCH host %s: 2 ^ %zu leaves, seed %zu, node %zu\n",
+                 names[b],
+                 log,
+                 seed,
+                 node);
+        }
+      }
+    }
+
+    free(ref);
+    free(out);
+  }
+
+  for (cl_uint d = 0; d < dev_cnt; d++) {
+    const cl_device_id dev_id = *(devices + d);
+    char* dev_name = device_info_string(dev_id, CL_DEVICE_NAME);
+
+    fprintf(stderr, "gating %s\n", dev_name);
+
+    cl_context ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &status);
+    show_message_and_exit(status, "failed to create context !\n");
+
+    // see main.c, for why these queue properties are required
+    cl_queue_properties props[] = { CL_QUEUE_PROPERTIES,
+                                    CL_QUEUE_PROFILING_ENABLE |
+                                      CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                    0 };
+    cl_command_queue c_queue =
+      clCreateCommandQueueWithProperties(ctx, dev_id, props, &status);
+    show_message_and_exit(status, "failed to create command queue !\n");
+
+    arena_t arena;
+    arena_init(&arena, ctx, c_queue, ((size_t)1 << (args.max_log + 5)) << 2);
+
+    for (size_t v = 0; v < variant_cnt; v++) {
+      cl_program prgm;
+      status = build_kernel_from_source(
+        ctx, dev_id, "kernel.cl", variants[v].flags, &prgm);
+      if (status != CL_SUCCESS) {
+        fprintf(stderr, "failed to compile kernel !\n");
+
+        show_build_log(dev_id, prgm);
+        return EXIT_FAILURE;
+      }
+
+      gate_device_t dev = { .ctx = ctx, .cq = c_queue, .arena = &arena };
+
+      dev.krnl = clCreateKernel(prgm, "merklize", &status);
+      show_message_and_exit(status, "failed to create `merklize` kernel !\n");
+
+      dev.blocked_krnl = clCreateKernel(prgm, "merklize_blocked", &status);
+      show_message_and_exit(status,
+                            "failed to create `merklize_blocked` kernel !\n");
+
+      // preferred multiple is not guaranteed to be power of 2
+      size_t pref = 0;
+      preferred_work_group_size_multiple(dev.krnl, dev_id, &pref);
+
+      dev.wg_size = 1;
+      while (dev.wg_size < pref) {
+        dev.wg_size <<= 1;
+      }
+
+      for (size_t log = args.min_log; log <= args.max_log; log++) {
+        const size_t leaf_count = (size_t)1 << log;
+        const size_t size = leaf_count << 5;
+
+        cl_uchar* ref = (cl_uchar*)malloc(size << 1);
+        check_mem_alloc(ref);
+        cl_uchar* out = (cl_uchar*)malloc(size);
+        check_mem_alloc(out);
+
+        for (size_t seed = 0; seed < args.seeds; seed++) {
+          seeded_input(ref + size, size, log, seed);
+          reference_tree(ref, leaf_count);
+
+          for (size_t b = 0; b < GATE_BACKENDS; b++) {
+            if (!gate_supported((enum gate_backend)b, log)) {
+              continue;
+            }
+
+            memset(out, 0, size);
+            status = gate_build(&dev,
+                                (enum gate_backend)b,
+                                ref + size,
+                                leaf_count,
+                                3 + seed % 5,
+                                out);
+
+            const size_t node =
+              status == CL_SUCCESS ? first_mismatch(ref, out, leaf_count) : 1;
+            compared++;
+
+            if (node != 0) {
+              mismatches++;
+              printf("MISMATCH %s %s %s: 2 ^ %zu leaves, seed %zu, node %zu "
+                     "( status %d )\n",
+                     dev_name,
+                     variants[v].name,
+                     gate_backend_names[b],
+                     log,
+                     seed,
+                     node,
+                     status);
+            }
+          }
+
+          arena_trim(&arena);
+        }
+
+        free(ref);
+        free(out);
+
+        if (log < GATE_MIN_LARGE_LOG) {
+          continue;
+        }
+
+        double gbps = 0.;
+        status = gate_throughput(&dev, leaf_count, args.iters, &gbps);
+        show_message_and_exit(status, "failed to measure throughput !\n");
+
+        if (args.baseline != NULL && args.update) {
+          baseline_set(&baseline,
+                       &baseline_cnt,
+                       dev_name,
+                       variants[v].name,
+                       log,
+                       gbps);
+          continue;
+        }
+
+        const baseline_t* base = baseline_find(
+          baseline, baseline_cnt, dev_name, variants[v].name, log);
+        const int regressed =
+          base != NULL && gbps < base->gbps * (1. - args.tolerance);
+        regressions += regressed;
+
+        printf("%s %s %s: 2 ^ %zu leaves, %.4lf GB/s, baseline %.4lf GB/s\n",
+               regressed ? "REGRESSION" : "throughput",
+               dev_name,
+               variants[v].name,
+               log,
+               gbps,
+               base != NULL ? base->gbps : 0.);
+      }
+
+      clReleaseKernel(dev.krnl);
+      clReleaseKernel(dev.blocked_krnl);
+      clReleaseProgram(prgm);
+    }
+
+    arena_free(&arena);
+
+    clReleaseCommandQueue(c_queue);
+    clReleaseContext(ctx);
+    clReleaseDevice(dev_id);
+
+    free(dev_name);
+  }
+
+  if (args.baseline != NULL && args.update &&
+      baseline_store(args.baseline, baseline, baseline_cnt) != 0) {
+    perror("failed to write baseline");
+    return EXIT_FAILURE;
+  }
+
+  printf("\ncompared %zu trees, %zu mismatching, %zu throughput regressions\n",
+         compared,
+         mismatches,
+         regressions);
+
+  free(baseline);
+  free(devices);
+
+  return mismatches == 0 && regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
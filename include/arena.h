@@ -0,0 +1,279 @@
+#pragma once
+#include "utils.h"
+#include <pthread.h>
+
+// Arena of host staging & device buffers, which are kept around between
+// tree builds, so that repeated builds of similarly sized trees reuse warm
+// memory, instead of paying for fresh driver allocations & page faults, on
+// every call
+//
+// Buffers are bucketed into power of 2 size classes; acquiring a buffer takes
+// an idle one of same class & kind, if any, else creates a new one. Host
+// staging buffers are created with CL_MEM_ALLOC_HOST_PTR & kept mapped, as
+// long as they live, so that their host pointers are page-locked ( on most
+// runtimes ) & transfers from/ to them don't go through driver's own bounce
+// buffers.
+//
+// Memory kept idle is bounded in two ways
+//
+// - it never goes beyond `max_idle` -bytes
+// - `arena_trim( ... )` drops idle buffers not required for serving peak
+// demand ( high-water mark ) seen since last trim
+
+#define ARENA_MIN_CLASS 12 // 4 KB
+#define ARENA_CLASSES 48
+
+enum arena_kind
+{
+  ARENA_DEVICE = 0, // device buffer, read/ write
+  ARENA_HOST = 1    // host staging buffer, mapped
+};
+
+typedef struct arena_buf_s
+{
+  cl_mem mem;
+  void* host; // mapped pointer, NULL for device buffers
+  size_t size;
+  enum arena_kind kind;
+  struct arena_buf_s* next; // next idle buffer of same class & kind
+} arena_buf_t;
+
+typedef struct
+{
+  cl_context ctx;
+  cl_command_queue cq; // used for mapping/ unmapping host staging buffers
+  arena_buf_t* idle[2][ARENA_CLASSES];
+  size_t max_idle;   // in bytes
+  size_t idle_bytes; // kept around, not acquired by anyone
+  size_t used_bytes; // acquired, not yet released
+  size_t high_water; // peak of `used_bytes`, since last trim
+  size_t hits;
+  size_t misses;
+  size_t trimmed; // # -of idle buffers dropped
+  pthread_mutex_t lock;
+} arena_t;
+
+void
+arena_init(arena_t* const arena,
+           cl_context ctx,
+           cl_command_queue cq,
+           size_t max_idle)
+{
+  memset(arena, 0, sizeof(arena_t));
+
+  arena->ctx = ctx;
+  arena->cq = cq;
+  arena->max_idle = max_idle;
+  pthread_mutex_init(&arena->lock, NULL);
+}
+
+// Sets size class of buffer, which can hold `size` -bytes, failing when it's
+// larger than largest class
+cl_int
+arena_class_of(size_t size, size_t* const c)
+{
+  size_t c_ = ARENA_MIN_CLASS;
+  while (c_ < ARENA_CLASSES && ((size_t)1 << c_) < size) {
+    c_++;
+  }
+
+  if (c_ == ARENA_CLASSES) {
+    return CL_INVALID_BUFFER_SIZE;
+  }
+
+  *c = c_;
+  return CL_SUCCESS;
+}
+
+// Unmaps ( if required ) & releases buffer, which must not be in use anymore
+void
+arena_destroy_buf(arena_t* const arena, arena_buf_t* const buf)
+{
+  if (buf->host != NULL) {
+    cl_event evt;
+    cl_int status = clEnqueueUnmapMemObject(
+      arena->cq, buf->mem, buf->host, 0, NULL, &evt);
+    if (status == CL_SUCCESS) {
+      clWaitForEvents(1, &evt);
+      clReleaseEvent(evt);
+    }
+  }
+
+  clReleaseMemObject(buf->mem);
+  free(buf);
+}
+
+// Detaches idle buffers, largest ones first, till idle memory fits in `limit`
+// -bytes, returning them as a list ( linked using `next` ); expects arena to
+// be locked, while detached buffers are destroyed after unlocking it, using
+// `arena_destroy_bufs( ... )`, as unmapping them waits on device
+arena_buf_t*
+arena_drop_idle(arena_t* const arena, size_t limit)
+{
+  arena_buf_t* dropped = NULL;
+
+  for (size_t c = ARENA_CLASSES; c > 0 && arena->idle_bytes > limit; c--) {
+    for (size_t k = 0; k < 2; k++) {
+      while (arena->idle[k][c - 1] != NULL && arena->idle_bytes > limit) {
+        arena_buf_t* const buf = arena->idle[k][c - 1];
+        arena->idle[k][c - 1] = buf->next;
+        arena->idle_bytes -= buf->size;
+        arena->trimmed++;
+
+        buf->next = dropped;
+        dropped = buf;
+      }
+    }
+  }
+
+  return dropped;
+}
+
+// Destroys list of buffers detached by `arena_drop_idle( ... )`
+void
+arena_destroy_bufs(arena_t* const arena, arena_buf_t* bufs)
+{
+  while (bufs != NULL) {
+    arena_buf_t* const next = bufs->next;
+    arena_destroy_buf(arena, bufs);
+    bufs = next;
+  }
+}
+
+// Acquires buffer of given kind, which can hold at least `size` -bytes; it's
+// handed back to arena using `arena_release( ... )`
+//
+// Host staging buffer's mapped pointer is `(*buf)->host`, which is valid till
+// buffer is dropped by arena
+cl_int
+arena_acquire(arena_t* const arena,
+              enum arena_kind kind,
+              size_t size,
+              arena_buf_t** const buf)
+{
+  size_t c;
+  cl_int status = arena_class_of(size, &c);
+  check_for_error_and_return(status);
+
+  const size_t c_size = (size_t)1 << c;
+
+  pthread_mutex_lock(&arena->lock);
+
+  arena_buf_t* b = arena->idle[kind][c];
+  if (b != NULL) {
+    arena->idle[kind][c] = b->next;
+    arena->idle_bytes -= c_size;
+    arena->hits++;
+  } else {
+    arena->misses++;
+  }
+
+  arena->used_bytes += c_size;
+  if (arena->used_bytes > arena->high_water) {
+    arena->high_water = arena->used_bytes;
+  }
+
+  pthread_mutex_unlock(&arena->lock);
+
+  if (b == NULL) {
+    b = (arena_buf_t*)calloc(1, sizeof(arena_buf_t));
+    check_mem_alloc(b);
+
+    b->size = c_size;
+    b->kind = kind;
+
+    const cl_mem_flags flags =
+      kind == ARENA_HOST ? CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR
+                         : CL_MEM_READ_WRITE;
+    b->mem = clCreateBuffer(arena->ctx, flags, c_size, NULL, &status);
+
+    if (status == CL_SUCCESS && kind == ARENA_HOST) {
+      // staying mapped, for whole lifetime of buffer
+      b->host = clEnqueueMapBuffer(arena->cq,
+                                   b->mem,
+                                   CL_TRUE,
+                                   CL_MAP_READ | CL_MAP_WRITE,
+                                   0,
+                                   c_size,
+                                   0,
+                                   NULL,
+                                   NULL,
+                                   &status);
+      if (status != CL_SUCCESS) {
+        clReleaseMemObject(b->mem);
+      }
+    }
+
+    if (status != CL_SUCCESS) {
+      free(b);
+
+      pthread_mutex_lock(&arena->lock);
+      arena->used_bytes -= c_size;
+      pthread_mutex_unlock(&arena->lock);
+
+      return status;
+    }
+  }
+
+  b->next = NULL;
+  *buf = b;
+
+  return CL_SUCCESS;
+}
+
+// Hands buffer back to arena, so that it can be reused by later builds; all
+// commands using it must have completed
+void
+arena_release(arena_t* const arena, arena_buf_t* const buf)
+{
+  // size of acquired buffer is always of some class
+  size_t c;
+  arena_class_of(buf->size, &c);
+
+  pthread_mutex_lock(&arena->lock);
+
+  arena->used_bytes -= buf->size;
+
+  buf->next = arena->idle[buf->kind][c];
+  arena->idle[buf->kind][c] = buf;
+  arena->idle_bytes += buf->size;
+
+  arena_buf_t* const dropped = arena_drop_idle(arena, arena->max_idle);
+
+  pthread_mutex_unlock(&arena->lock);
+
+  arena_destroy_bufs(arena, dropped);
+}
+
+// Drops idle buffers which weren't required for serving peak demand seen
+// since last trim, and starts a new window; call it periodically ( say after
+// each batch of builds ), so that arena shrinks after a burst of large trees
+void
+arena_trim(arena_t* const arena)
+{
+  pthread_mutex_lock(&arena->lock);
+
+  const size_t keep = arena->high_water > arena->used_bytes
+                        ? arena->high_water - arena->used_bytes
+                        : 0;
+  arena_buf_t* const dropped = arena_drop_idle(arena, keep);
+  arena->high_water = arena->used_bytes;
+
+  pthread_mutex_unlock(&arena->lock);
+
+  arena_destroy_bufs(arena, dropped);
+}
+
+// Releases all idle buffers, all acquired ones must have been released
+void
+arena_free(arena_t* const arena)
+{
+  pthread_mutex_lock(&arena->lock);
+  assert(arena->used_bytes == 0);
+  arena_buf_t* const dropped = arena_drop_idle(arena, 0);
+  pthread_mutex_unlock(&arena->lock);
+
+  arena_destroy_bufs(arena, dropped);
+
+  pthread_mutex_destroy(&arena->lock);
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "merklize.h"
+#include <time.h>
 
 // Benchmarks execution of `merklize` kernel on accelerator, with given input
 // size & work-group size for ndrange kernel dispatch
@@ -42,8 +43,17 @@ bench_merklize(cl_context ctx,
   random_input(in, leaf_count << 5);
 
   // merklize leaf nodes
-  status = merklize(
-    ctx, cq, merklize_krnl, in, i_size, leaf_count, out, o_size, wg_size, ts);
+  status = merklize(ctx,
+                    cq,
+                    merklize_krnl,
+                    in,
+                    i_size,
+                    leaf_count,
+                    out,
+                    o_size,
+                    wg_size,
+                    ts,
+                    NULL);
 
   // deallocate memory
   free(in);
@@ -51,3 +61,209 @@ bench_merklize(cl_context ctx,
 
   return status;
 }
+
+// Phases of one end-to-end merklization run, which are separately timed by
+// `bench_merklize_e2e( ... )`, using host wall-clock
+//
+// Note, PHASE_MERKLIZE covers whole `merklize( ... )` call i.e. it includes
+// host side byte <-> word conversion, device buffer allocation & all
+// enqueued commands, while PHASE_{KERNEL, H2D, D2H} are obtained from OpenCL
+// event profiling ( on device clock ) & may overlap with each other
+enum bench_phase
+{
+  PHASE_ALLOC = 0, // host input/ output allocation
+  PHASE_INPUT,     // random leaf generation
+  PHASE_MERKLIZE,  // wall-clock time spent inside `merklize( ... )`
+  PHASE_KERNEL,    // sum of kernel execution times
+  PHASE_H2D,       // sum of host to device tx times
+  PHASE_D2H,       // sum of device to host tx times
+  PHASE_FREE,      // host input/ output deallocation
+  PHASE_TOTAL,     // wall-clock time of all above host phases
+  PHASE_COUNT
+};
+
+const char* bench_phase_names[PHASE_COUNT] = { "alloc", "input",  "merklize",
+                                               "kernel", "h2d",   "d2h",
+                                               "free",  "total" };
+
+// Monotonic host wall-clock time, in nanosecond level granularity
+cl_ulong
+bench_now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return (cl_ulong)t.tv_sec * 1000000000ul + (cl_ulong)t.tv_nsec;
+}
+
+// Same as `bench_merklize( ... )`, but all host side phases are also timed,
+// using wall-clock, so that what's reported is end-to-end cost of producing
+// merkle tree, not only what device spends on it
+//
+// Ensure that `phases` points to memory which has enough space to store
+// PHASE_COUNT -many `cl_ulong`s, each of them is set in nanoseconds
+//
+// `opts` is passed as is to `merklize( ... )`, can be NULL
+cl_int
+bench_merklize_e2e(cl_context ctx,
+                   cl_command_queue cq,
+                   cl_kernel merklize_krnl,
+                   size_t leaf_count,
+                   size_t wg_size,
+                   cl_ulong* const phases,
+                   const merklize_opts_t* opts)
+{
+  assert(leaf_count >= 1 << 20);
+
+  cl_int status;
+
+  const size_t i_size = leaf_count << 5;
+  const size_t o_size = leaf_count << 5;
+
+  cl_ulong ts[3] = { 0 };
+
+  const cl_ulong t0 = bench_now_ns();
+
+  cl_uchar* in = (cl_uchar*)malloc(i_size);
+  check_mem_alloc(in);
+  cl_uchar* out = (cl_uchar*)malloc(o_size);
+  check_mem_alloc(out);
+
+  const cl_ulong t1 = bench_now_ns();
+
+  random_input(in, i_size);
+
+  const cl_ulong t2 = bench_now_ns();
+
+  status = merklize(ctx,
+                    cq,
+                    merklize_krnl,
+                    in,
+                    i_size,
+                    leaf_count,
+                    out,
+                    o_size,
+                    wg_size,
+                    ts,
+                    opts);
+
+  const cl_ulong t3 = bench_now_ns();
+
+  free(in);
+  free(out);
+
+  const cl_ulong t4 = bench_now_ns();
+
+  *(phases + PHASE_ALLOC) = t1 - t0;
+  *(phases + PHASE_INPUT) = t2 - t1;
+  *(phases + PHASE_MERKLIZE) = t3 - t2;
+  *(phases + PHASE_KERNEL) = ts[0];
+  *(phases + PHASE_H2D) = ts[1];
+  *(phases + PHASE_D2H) = ts[2];
+  *(phases + PHASE_FREE) = t4 - t3;
+  *(phases + PHASE_TOTAL) = t4 - t0;
+
+  return status;
+}
+
+// Summary of N -many samples of some timed phase, all in nanoseconds
+typedef struct
+{
+  double min;
+  double median;
+  double p99;
+  double mean;
+} bench_stats_t;
+
+int
+cmp_cl_ulong(const void* a, const void* b)
+{
+  const cl_ulong a_ = *(const cl_ulong*)a;
+  const cl_ulong b_ = *(const cl_ulong*)b;
+
+  return (a_ > b_) - (a_ < b_);
+}
+
+// Computes min/ median/ p99/ mean of given samples, note samples are sorted
+// in-place
+void
+bench_stats(cl_ulong* const samples, size_t count, bench_stats_t* const stats)
+{
+  assert(count > 0);
+
+  qsort(samples, count, sizeof(cl_ulong), cmp_cl_ulong);
+
+  double sum = 0.;
+  for (size_t i = 0; i < count; i++) {
+    sum += (double)*(samples + i);
+  }
+
+  // nearest-rank percentile, so that p99 is always one of observed samples
+  size_t p99_rank = (size_t)ceil(0.99 * (double)count);
+  p99_rank = p99_rank == 0 ? 1 : p99_rank;
+
+  const size_t mid = count >> 1;
+
+  stats->min = (double)*(samples + 0);
+  stats->median = count & 1 ? (double)*(samples + mid)
+                            : ((double)*(samples + mid - 1) +
+                               (double)*(samples + mid)) /
+                                2.;
+  stats->p99 = (double)*(samples + p99_rank - 1);
+  stats->mean = sum / (double)count;
+}
+
+// Reads some string property of device, which must be released by caller
+char*
+device_info_string(cl_device_id dev_id, cl_device_info param)
+{
+  size_t size = 0;
+  if (clGetDeviceInfo(dev_id, param, 0, NULL, &size) != CL_SUCCESS) {
+    return strdup("unknown");
+  }
+
+  char* val = (char*)malloc(size);
+  check_mem_alloc(val);
+
+  if (clGetDeviceInfo(dev_id, param, size, val, NULL) != CL_SUCCESS) {
+    free(val);
+    return strdup("unknown");
+  }
+
+  return val;
+}
+
+// Writes `str` as double quoted field of CSV ( when `json` is 0 ) or JSON
+// string, escaping it as that format requires
+void
+bench_write_string(FILE* const fd, const char* str, int json)
+{
+  fputc('"', fd);
+
+  for (const unsigned char* c = (const unsigned char*)str; *c != '\0'; c++) {
+    if (!json) {
+      // CSV escapes double quote by doubling it
+      if (*c == '"') {
+        fputc('"', fd);
+      }
+      fputc(*c, fd);
+    } else if (*c == '"' || *c == '\\') {
+      fputc('\\', fd);
+      fputc(*c, fd);
+    } else if (*c < 0x20) {
+      fprintf(fd, "\\u%04x", *c);
+    } else {
+      fputc(*c, fd);
+    }
+  }
+
+  fputc('"', fd);
+}
+
+// Throughput in GB/s, when `bytes` -many leaf bytes are processed in `ns`
+// nanoseconds
+double
+bench_gbps(size_t bytes, double ns)
+{
+  return ns > 0. ? (double)bytes / ns : 0.;
+}
@@ -0,0 +1,355 @@
+#pragma once
+#include "host_blake3.h"
+#include "merklize.h"
+
+// Subtree-blocked ( van Emde Boas like ) node layout, for proof/ update heavy
+// workloads, where a leaf's ancestors should share as few cache lines/ pages
+// as possible
+//
+// In heap layout, each level lives in its own contiguous range, so every
+// ancestor of a leaf, in lower ~15 levels, lives on a different page. Here
+// levels are instead grouped in bands of b levels, from root. Each band is a
+// sequence of blocks, one per node at top level of band ( left to right ),
+// where each block is subtree of height b ( b - 1 at last band, if it's
+// shorter ), stored in 2 ^ b slots, in its own heap order ( local root at
+// slot 1, slot 0 unused ). Bands are stored one after another, root's first.
+//
+// So, path from leaf to root crosses only ceil((log2(N) + 1) / b) blocks, e.g.
+// with b = 4, block is 512 -bytes ( 8 cache lines ), while with b = 7, it's
+// 4 KB ( one page ). Leaves are bottom level of blocks of last band, so they
+// are stored in runs of 2 ^ (h - 1) leaves, where h is height of those blocks.
+//
+// With b = 0 ( or b > log2(N) ), it's same as heap layout of
+// `merklize_inplace( ... )`, i.e. 2N slots.
+
+// Height of tree i.e. log2(N)
+size_t
+blocked_height(size_t leaf_count)
+{
+  size_t height = 0;
+  while (((size_t)1 << height) < leaf_count) {
+    height++;
+  }
+  return height;
+}
+
+// Block height actually used for tree of given height, heap layout is one
+// band of height + 1 levels
+size_t
+blocked_band_height(size_t height, size_t block_log)
+{
+  return block_log == 0 || block_log > height ? height + 1 : block_log;
+}
+
+// # -of slots ( each 32 -bytes ) required for tree of given height
+size_t
+blocked_slots(size_t height, size_t block_log)
+{
+  const size_t b = blocked_band_height(height, block_log);
+
+  // band starting at depth s has 2 ^ s blocks of 2 ^ b slots, while last one,
+  // which ends at leaves, always takes 2 ^ (height + 1) slots
+  size_t slots = 0;
+  size_t s = 0;
+  for (; s + b <= height; s += b) {
+    slots += (size_t)1 << (s + b);
+  }
+
+  return slots + ((size_t)1 << (height + 1));
+}
+
+// Slot of node, given by its heap index ( root at 1, children of node i at 2i
+// & 2i + 1 ), of tree of given height; see `blocked_index( ... )` in
+// kernel.cl, which must stay in sync
+size_t
+blocked_index(size_t node, size_t height, size_t block_log)
+{
+  const size_t b = blocked_band_height(height, block_log);
+  const size_t depth = 63 - (size_t)__builtin_clzll(node);
+
+  const size_t band = depth / b;
+  const size_t start = band * b;
+  const size_t h = b < height + 1 - start ? b : height + 1 - start;
+
+  size_t offset = 0;
+  for (size_t j = 1; j <= band; j++) {
+    offset += (size_t)1 << (j * b);
+  }
+
+  const size_t shift = depth - start;
+  const size_t block = (node >> shift) - ((size_t)1 << start);
+  const size_t mask = ((size_t)1 << shift) - 1;
+  const size_t local = ((size_t)1 << shift) | (node & mask);
+
+  return offset + (block << h) + local;
+}
+
+// Writes N leaves ( contiguous, 32 -bytes each ) at their slots, run by run
+void
+blocked_set_leaves(cl_uchar* const tree,
+                   const cl_uchar* leaves,
+                   size_t leaf_count,
+                   size_t block_log)
+{
+  const size_t height = blocked_height(leaf_count);
+  const size_t b = blocked_band_height(height, block_log);
+
+  // leaves per block of last band
+  const size_t h = (height + 1) % b == 0 ? b : (height + 1) % b;
+  const size_t run = (size_t)1 << (h - 1);
+
+  for (size_t i = 0; i < leaf_count; i += run) {
+    memcpy(tree + (blocked_index(leaf_count + i, height, block_log) << 5),
+           leaves + (i << 5),
+           run << 5);
+  }
+}
+
+// Converts tree in heap layout ( 2N nodes, see `merklize_inplace( ... )` ) to
+// blocked layout
+void
+blocked_from_heap(const cl_uchar* heap,
+                  size_t leaf_count,
+                  size_t block_log,
+                  cl_uchar* const tree)
+{
+  const size_t height = blocked_height(leaf_count);
+
+  for (size_t i = 1; i < leaf_count << 1; i++) {
+    memcpy(tree + (blocked_index(i, height, block_log) << 5),
+           heap + (i << 5),
+           32);
+  }
+}
+
+// Merklizes tree in blocked layout, whose leaves are already set, on host,
+// bottom-up
+void
+merklize_blocked_host(cl_uchar* const tree,
+                      size_t leaf_count,
+                      size_t block_log)
+{
+  const size_t height = blocked_height(leaf_count);
+
+  cl_uchar msg[64];
+
+  for (size_t i = leaf_count - 1; i > 0; i--) {
+    memcpy(msg, tree + (blocked_index(i << 1, height, block_log) << 5), 32);
+    memcpy(msg + 32,
+           tree + (blocked_index((i << 1) | 1, height, block_log) << 5),
+           32);
+
+    blake3_hash_pair_host(msg,
+                          tree + (blocked_index(i, height, block_log) << 5));
+  }
+}
+
+// Writes log2( N ) -many sibling hashes ( 32 -bytes each ), on path from leaf
+// at given index to root, bottom-up, same as `tree_file_proof( ... )` does,
+// so that they can be verified using `merkle_proof_verify( ... )`
+void
+blocked_proof(const cl_uchar* tree,
+              size_t leaf_count,
+              size_t block_log,
+              size_t leaf_idx,
+              cl_uchar* const proof)
+{
+  assert(leaf_idx < leaf_count);
+
+  const size_t height = blocked_height(leaf_count);
+
+  size_t node = leaf_count + leaf_idx;
+  for (size_t h = 0; h < height; h++, node >>= 1) {
+    memcpy(proof + (h << 5),
+           tree + (blocked_index(node ^ 1, height, block_log) << 5),
+           32);
+  }
+}
+
+// Same as `merklize_inplace( ... )`, but tree is in blocked layout, of
+// `blocked_slots( ... )` -many slots, whose leaves are already set ( see
+// `blocked_set_leaves( ... )` ), and `krnl` is `merklize_blocked` kernel,
+// which writes each parent straight into its slot, after gathering its two
+// children in private memory, so there's no layout conversion afterwards
+//
+// One kernel is dispatched per level, bottom-up
+cl_int
+merklize_blocked(cl_context ctx,
+                 cl_command_queue cq,
+                 cl_kernel krnl,
+                 cl_uchar* const tree,
+                 size_t t_size, // in bytes
+                 size_t leaf_count,
+                 size_t block_log,
+                 size_t wg_size,
+                 cl_ulong* const ts,
+                 const merklize_opts_t* opts)
+{
+  assert(leaf_count >= 2);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+  assert((wg_size & (wg_size - 1)) == 0);
+
+  const size_t height = blocked_height(leaf_count);
+  assert(blocked_slots(height, block_log) << 5 == t_size);
+
+  cl_int status;
+
+  const int le = host_is_little_endian();
+  cl_uint* const words = (cl_uint*)tree;
+
+  cl_ulong api_calls = 0;
+  cl_ulong host_allocs = 0;
+
+  const cl_ulong t0 = metrics_now_ns();
+
+  // leaves are spread all over last band, so whole tree is converted
+  if (!le) {
+    words_from_le_bytes(tree, t_size, words, t_size >> 2);
+  }
+
+  const cl_ulong t1 = metrics_now_ns();
+
+  cl_mem buf = metrics_count(
+    api_calls,
+    clCreateBuffer(
+      ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, t_size, tree, &status));
+  check_for_error_and_return(status);
+
+  cl_event* round_evts =
+    (cl_event*)metrics_count(host_allocs, malloc(sizeof(cl_event) * height));
+  check_mem_alloc(round_evts);
+
+  const cl_ulong t2 = metrics_now_ns();
+
+  const cl_uint height_ = (cl_uint)height;
+  const cl_uint block_log_ = (cl_uint)blocked_band_height(height, block_log);
+
+  // depth of parents being computed, leaves at depth `height`
+  for (size_t r = 0; r < height; r++) {
+    const cl_uint depth = (cl_uint)(height - 1 - r);
+
+    metrics_count(api_calls, clSetKernelArg(krnl, 0, sizeof(cl_mem), &buf));
+    metrics_count(api_calls, clSetKernelArg(krnl, 1, sizeof(cl_uint), &depth));
+    metrics_count(api_calls,
+                  clSetKernelArg(krnl, 2, sizeof(cl_uint), &height_));
+    metrics_count(api_calls,
+                  clSetKernelArg(krnl, 3, sizeof(cl_uint), &block_log_));
+
+    size_t glb_work_items[] = { (size_t)1 << depth };
+    size_t loc_work_items[] = { glb_work_items[0] >= wg_size
+                                  ? wg_size
+                                  : glb_work_items[0] };
+
+    status =
+      metrics_count(api_calls,
+                    clEnqueueNDRangeKernel(cq,
+                                           krnl,
+                                           1,
+                                           NULL,
+                                           glb_work_items,
+                                           wg_size != 0 ? loc_work_items : NULL,
+                                           r == 0 ? 0 : 1,
+                                           r == 0 ? NULL : round_evts + r - 1,
+                                           round_evts + r));
+    check_for_error_and_return(status);
+  }
+
+  const cl_ulong t3 = metrics_now_ns();
+
+  // mapping whole tree makes it visible to host, in same allocation
+  cl_event evt_0;
+  metrics_count(api_calls,
+                clEnqueueMapBuffer(cq,
+                                   buf,
+                                   CL_FALSE,
+                                   CL_MAP_READ,
+                                   0,
+                                   t_size,
+                                   1,
+                                   round_evts + height - 1,
+                                   &evt_0,
+                                   &status));
+  check_for_error_and_return(status);
+
+  cl_event evt_1;
+  status = metrics_count(
+    api_calls, clEnqueueUnmapMemObject(cq, buf, tree, 1, &evt_0, &evt_1));
+  check_for_error_and_return(status);
+
+  status = metrics_count(api_calls, clWaitForEvents(1, &evt_1));
+  check_for_error_and_return(status);
+
+  const cl_ulong t4 = metrics_now_ns();
+
+  if (!le) {
+    words_to_le_bytes(words, t_size >> 2, tree, t_size);
+  }
+
+  const cl_ulong t5 = metrics_now_ns();
+
+  cl_ulong exec_tm = 0;
+  cl_ulong d2h_tm = 0;
+  cl_ulong tmp;
+
+  for (size_t i = 0; i < height; i++) {
+    tmp = 0;
+    time_event(*(round_evts + i), &tmp);
+    exec_tm += tmp;
+  }
+
+  tmp = 0;
+  time_event(evt_0, &tmp);
+  d2h_tm += tmp;
+
+  if (opts != NULL && opts->trace != NULL) {
+    trace_t* const trace = opts->trace;
+    trace_begin_tree(trace);
+
+    for (size_t i = 0; i < height; i++) {
+      trace_record(trace, *(round_evts + i), "kernel", i + 1);
+    }
+    trace_record(trace, evt_0, "read", -1);
+  }
+
+  *(ts + 0) = exec_tm;
+  *(ts + 1) = 0;
+  *(ts + 2) = d2h_tm;
+
+  // counted same way as `merklize_forest( ... )` does, though whole tree is
+  // mapped back, because leaves are interleaved with intermediate nodes
+  if (opts != NULL && opts->metrics != NULL) {
+    merklize_metrics_t m = {
+      .calls = 1,
+      .leaves = leaf_count,
+      .h2d_bytes = t_size,
+      .d2h_bytes = t_size,
+      .host_allocs = host_allocs,
+      .host_bytes = sizeof(cl_event) * height,
+      .dev_bytes = t_size,
+      .buffers = 1,
+      .api_calls = api_calls,
+      .kernels = height,
+      .phase_ns = { [METRICS_ALLOC] = t2 - t1,
+                    [METRICS_CONVERT] = (t1 - t0) + (t5 - t4),
+                    [METRICS_ENQUEUE] = t3 - t2,
+                    [METRICS_KERNEL] = exec_tm,
+                    [METRICS_D2H] = d2h_tm,
+                    [METRICS_TOTAL] = t5 - t0 },
+    };
+    m.peak_bytes = m.host_bytes + m.dev_bytes;
+
+    metrics_commit(opts->metrics, &m);
+  }
+
+  clReleaseEvent(evt_0);
+  clReleaseEvent(evt_1);
+
+  for (size_t i = 0; i < height; i++) {
+    clReleaseEvent(*(round_evts + i));
+  }
+
+  clReleaseMemObject(buf);
+  free(round_evts);
+
+  return CL_SUCCESS;
+}
@@ -0,0 +1,254 @@
+#pragma once
+#include "utils.h"
+
+// Finding leaves where two merkle trees, built from same number of leaves,
+// differ, by walking both trees top-down, from root, descending only into
+// children which differ; so for d differing leaves, it reads O(d * log(N))
+// nodes, instead of O(N) nodes, as comparing both trees byte by byte does
+
+// Node at given heap index ( root at 1 ), where intermediate nodes live in
+// `nodes` ( as produced by `merklize( ... )` ) & leaves in `leaves`
+const cl_uchar*
+diff_node(const cl_uchar* nodes,
+          const cl_uchar* leaves,
+          size_t leaf_count,
+          size_t idx)
+{
+  return idx < leaf_count ? nodes + (idx << 5)
+                          : leaves + ((idx - leaf_count) << 5);
+}
+
+// Writes indices of ( at most `cap` -many ) differing leaves of two trees,
+// in ascending order, to `out`, returning total # -of differing leaves, which
+// can be more than `cap`
+//
+// Each tree is given as its intermediate nodes ( N nodes, as produced by
+// `merklize( ... )` ) and its N leaves; for trees in layout of
+// `merklize_inplace( ... )`, pass tree as `nodes` & tree + N * 32 as `leaves`
+size_t
+merkle_diff(const cl_uchar* a_nodes,
+            const cl_uchar* a_leaves,
+            const cl_uchar* b_nodes,
+            const cl_uchar* b_leaves,
+            size_t leaf_count,
+            size_t* const out,
+            size_t cap)
+{
+  assert(leaf_count >= 2);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+
+  size_t height = 0;
+  while (((size_t)1 << height) < leaf_count) {
+    height++;
+  }
+
+  // depth-first, left child popped first, so that leaves are found in
+  // ascending order; at most one pending sibling per level, plus root
+  size_t* stack = (size_t*)malloc(sizeof(size_t) * (height + 2));
+  check_mem_alloc(stack);
+
+  size_t top = 0;
+  size_t cnt = 0;
+
+  *(stack + top++) = 1;
+
+  while (top > 0) {
+    const size_t idx = *(stack + --top);
+
+    const cl_uchar* a = diff_node(a_nodes, a_leaves, leaf_count, idx);
+    const cl_uchar* b = diff_node(b_nodes, b_leaves, leaf_count, idx);
+
+    if (memcmp(a, b, 32) == 0) {
+      continue;
+    }
+
+    if (idx >= leaf_count) {
+      if (cnt < cap) {
+        *(out + cnt) = idx - leaf_count;
+      }
+      cnt++;
+      continue;
+    }
+
+    *(stack + top++) = (idx << 1) | 1;
+    *(stack + top++) = idx << 1;
+  }
+
+  free(stack);
+  return cnt;
+}
+
+int
+diff_idx_cmp(const void* a, const void* b)
+{
+  const cl_ulong a_ = *(const cl_ulong*)a;
+  const cl_ulong b_ = *(const cl_ulong*)b;
+
+  return a_ < b_ ? -1 : (a_ > b_ ? 1 : 0);
+}
+
+// Walks frontier of `f_cnt` -many differing nodes down by one level, on
+// device, setting `next` to frontier of their differing children & `f_cnt` to
+// its size
+//
+// Everything else acquired here is released before returning, even on
+// failure, once kernel ( which may still be running, when readback failed )
+// is done; `next` is only set on success
+cl_int
+merkle_diff_level(cl_context ctx,
+                  cl_command_queue cq,
+                  cl_kernel krnl,
+                  cl_mem tree_a,
+                  cl_mem tree_b,
+                  cl_mem frontier,
+                  cl_uint* const f_cnt,
+                  cl_mem* const next)
+{
+  cl_int status;
+
+  // each frontier node has at most two differing children
+  const cl_uint zero = 0;
+
+  cl_mem next_ = clCreateBuffer(ctx,
+                                CL_MEM_READ_WRITE,
+                                sizeof(cl_ulong) * (*f_cnt << 1),
+                                NULL,
+                                &status);
+  check_for_error_and_return(status);
+
+  cl_mem next_cnt = clCreateBuffer(ctx,
+                                   CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(cl_uint),
+                                   (void*)&zero,
+                                   &status);
+  if (status != CL_SUCCESS) {
+    clReleaseMemObject(next_);
+    return status;
+  }
+
+  const cl_mem args[] = { tree_a, tree_b, frontier, next_, next_cnt };
+  for (cl_uint i = 0; i < 5 && status == CL_SUCCESS; i++) {
+    status = clSetKernelArg(krnl, i, sizeof(cl_mem), args + i);
+  }
+
+  cl_event evt = NULL;
+
+  if (status == CL_SUCCESS) {
+    size_t glb_work_items[] = { *f_cnt };
+
+    status = clEnqueueNDRangeKernel(
+      cq, krnl, 1, NULL, glb_work_items, NULL, 0, NULL, &evt);
+  }
+
+  // size of next frontier decides next dispatch size
+  if (status == CL_SUCCESS) {
+    status = clEnqueueReadBuffer(
+      cq, next_cnt, CL_TRUE, 0, sizeof(cl_uint), f_cnt, 1, &evt, NULL);
+  }
+
+  if (evt != NULL) {
+    clWaitForEvents(1, &evt);
+    clReleaseEvent(evt);
+  }
+  clReleaseMemObject(next_cnt);
+
+  if (status != CL_SUCCESS) {
+    clReleaseMemObject(next_);
+    return status;
+  }
+
+  *next = next_;
+  return CL_SUCCESS;
+}
+
+// Same as `merkle_diff( ... )`, but two trees live on device, in layout of
+// `merklize_inplace( ... )` ( i.e. 2N nodes, as `cl_uint`s ), and their
+// frontier of differing nodes is walked down on device, one level per
+// dispatch of `diff_frontier` kernel, which compacts differing children using
+// atomic counter
+//
+// Differing leaves are found in no particular order, so they're sorted on
+// host, before writing ( at most `cap` -many of them ) to `out`; `cnt` is set
+// to total # -of differing leaves
+cl_int
+merkle_diff_device(cl_context ctx,
+                   cl_command_queue cq,
+                   cl_kernel krnl,
+                   cl_mem tree_a,
+                   cl_mem tree_b,
+                   size_t leaf_count,
+                   size_t* const out,
+                   size_t cap,
+                   size_t* const cnt)
+{
+  assert(leaf_count >= 2);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+
+  cl_int status;
+
+  *cnt = 0;
+
+  // roots are compared on host, so that frontier starts non-empty
+  cl_uint roots[16];
+  status = clEnqueueReadBuffer(
+    cq, tree_a, CL_TRUE, 32, 32, roots, 0, NULL, NULL);
+  check_for_error_and_return(status);
+  status = clEnqueueReadBuffer(
+    cq, tree_b, CL_TRUE, 32, 32, roots + 8, 0, NULL, NULL);
+  check_for_error_and_return(status);
+
+  if (memcmp(roots, roots + 8, 32) == 0) {
+    return CL_SUCCESS;
+  }
+
+  cl_ulong root = 1;
+  cl_uint f_cnt = 1;
+
+  cl_mem frontier = clCreateBuffer(ctx,
+                                   CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(cl_ulong),
+                                   &root,
+                                   &status);
+  check_for_error_and_return(status);
+
+  for (size_t l = leaf_count; l > 1 && f_cnt > 0; l >>= 1) {
+    cl_mem next;
+    status = merkle_diff_level(
+      ctx, cq, krnl, tree_a, tree_b, frontier, &f_cnt, &next);
+
+    // frontier of this level is no longer used by device, either way
+    clReleaseMemObject(frontier);
+    check_for_error_and_return(status);
+
+    frontier = next;
+  }
+
+  // frontier now holds heap indices of differing leaves
+  cl_ulong* leaves = (cl_ulong*)malloc(sizeof(cl_ulong) * (f_cnt + 1));
+  check_mem_alloc(leaves);
+
+  if (f_cnt > 0) {
+    status = clEnqueueReadBuffer(cq,
+                                 frontier,
+                                 CL_TRUE,
+                                 0,
+                                 sizeof(cl_ulong) * f_cnt,
+                                 leaves,
+                                 0,
+                                 NULL,
+                                 NULL);
+  }
+  clReleaseMemObject(frontier);
+
+  if (status == CL_SUCCESS) {
+    qsort(leaves, f_cnt, sizeof(cl_ulong), diff_idx_cmp);
+
+    for (size_t i = 0; i < f_cnt && i < cap; i++) {
+      *(out + i) = (size_t)(*(leaves + i) - leaf_count);
+    }
+    *cnt = f_cnt;
+  }
+
+  free(leaves);
+  return status;
+}
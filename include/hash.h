@@ -1,4 +1,8 @@
 #pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define CL_TARGET_OPENCL_VERSION 220
 #include <CL/cl.h>
 #include <assert.h>
@@ -0,0 +1,262 @@
+#pragma once
+#include "utils.h"
+
+// Host side ( scalar ) port of BLAKE3 compression function, same as what's
+// implemented in kernel.cl, so that trees ( or parts of them ) can also be
+// hashed on host, e.g. when they're too small to be worth offloading
+//
+// Taken from BLAKE3 reference implementation
+// https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs
+
+const cl_uint BLAKE3_IV[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                               0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+
+const size_t BLAKE3_MSG_PERMUTATION[16] = { 2, 6,  3,  10, 7, 0,  4,  13,
+                                            1, 11, 12, 5,  9, 14, 15, 8 };
+
+const cl_uint BLAKE3_BLOCK_LEN = 64;
+const cl_uint BLAKE3_CHUNK_START = 1 << 0;
+const cl_uint BLAKE3_CHUNK_END = 1 << 1;
+const cl_uint BLAKE3_PARENT = 1 << 2;
+const cl_uint BLAKE3_ROOT = 1 << 3;
+
+#define rotr32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// BLAKE3 quarter-round, see
+// https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs#L42-L52
+void
+blake3_g_host(cl_uint* const state,
+              size_t a,
+              size_t b,
+              size_t c,
+              size_t d,
+              cl_uint mx,
+              cl_uint my)
+{
+  state[a] = state[a] + state[b] + mx;
+  state[d] = rotr32(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = rotr32(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + my;
+  state[d] = rotr32(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+// Column-wise & diagonal mixing of 16 message words into hash state
+void
+blake3_round_host(cl_uint* const state, const cl_uint* msg)
+{
+  blake3_g_host(state, 0, 4, 8, 12, msg[0], msg[1]);
+  blake3_g_host(state, 1, 5, 9, 13, msg[2], msg[3]);
+  blake3_g_host(state, 2, 6, 10, 14, msg[4], msg[5]);
+  blake3_g_host(state, 3, 7, 11, 15, msg[6], msg[7]);
+
+  blake3_g_host(state, 0, 5, 10, 15, msg[8], msg[9]);
+  blake3_g_host(state, 1, 6, 11, 12, msg[10], msg[11]);
+  blake3_g_host(state, 2, 7, 8, 13, msg[12], msg[13]);
+  blake3_g_host(state, 3, 4, 9, 14, msg[14], msg[15]);
+}
+
+// Compresses one 64 -bytes block ( as 16 message words ) into given 32 -bytes
+// input chaining value, producing 32 -bytes output chaining value
+//
+// Unlike `compress( ... )` in kernel.cl, this is general form, so that it can
+// also be used for hashing arbitrary length input, chunk by chunk
+void
+blake3_compress_host(const cl_uint* cv,
+                     const cl_uint* block,
+                     cl_ulong counter,
+                     cl_uint block_len,
+                     cl_uint flags,
+                     cl_uint* const out_cv)
+{
+  cl_uint state[16] = { cv[0],
+                        cv[1],
+                        cv[2],
+                        cv[3],
+                        cv[4],
+                        cv[5],
+                        cv[6],
+                        cv[7],
+                        BLAKE3_IV[0],
+                        BLAKE3_IV[1],
+                        BLAKE3_IV[2],
+                        BLAKE3_IV[3],
+                        (cl_uint)(counter & 0xffffffff),
+                        (cl_uint)(counter >> 32),
+                        block_len,
+                        flags };
+
+  cl_uint msg[16];
+  cl_uint permuted[16];
+  memcpy(msg, block, sizeof(msg));
+
+  for (size_t r = 0; r < 7; r++) {
+    blake3_round_host(state, msg);
+
+    for (size_t i = 0; i < 16; i++) {
+      permuted[i] = msg[BLAKE3_MSG_PERMUTATION[i]];
+    }
+    memcpy(msg, permuted, sizeof(msg));
+  }
+
+  for (size_t i = 0; i < 8; i++) {
+    out_cv[i] = state[i] ^ state[i + 8];
+  }
+}
+
+// 2-to-1 BLAKE3 hash, on host, of two contiguous 32 -bytes nodes ( as little
+// endian bytes ), producing 32 -bytes digest; same as what `merklize` kernel
+// computes for each intermediate node
+void
+blake3_hash_pair_host(const cl_uchar* input, cl_uchar* const output)
+{
+  cl_uint msg[16];
+  cl_uint out[8];
+
+  words_from_le_bytes(input, 64, msg, 16);
+  blake3_compress_host(BLAKE3_IV,
+                       msg,
+                       0,
+                       BLAKE3_BLOCK_LEN,
+                       BLAKE3_CHUNK_START | BLAKE3_CHUNK_END | BLAKE3_ROOT,
+                       out);
+  words_to_le_bytes(out, 8, output, 32);
+}
+
+// BLAKE3 hash, on host, of input of at most 1024 -bytes ( i.e. one chunk ),
+// producing 32 -bytes digest; input is compressed in 64 -bytes blocks, last
+// one being zero padded
+//
+// See
+// https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs#L151-L234
+void
+blake3_hash_host(const cl_uchar* input, size_t i_size, cl_uchar* const output)
+{
+  assert(i_size <= 1024);
+
+  cl_uint cv[8];
+  cl_uint msg[16];
+  cl_uchar block[64];
+
+  memcpy(cv, BLAKE3_IV, sizeof(cv));
+
+  // empty input is compressed as single empty block
+  const size_t blk_cnt = i_size == 0 ? 1 : (i_size + 63) >> 6;
+
+  for (size_t b = 0; b < blk_cnt; b++) {
+    const size_t len = b + 1 < blk_cnt ? 64 : i_size - (b << 6);
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, input + (b << 6), len);
+    words_from_le_bytes(block, 64, msg, 16);
+
+    cl_uint flags = 0;
+    flags |= b == 0 ? BLAKE3_CHUNK_START : 0;
+    flags |= b + 1 == blk_cnt ? BLAKE3_CHUNK_END | BLAKE3_ROOT : 0;
+
+    blake3_compress_host(cv, msg, 0, (cl_uint)len, flags, cv);
+  }
+
+  words_to_le_bytes(cv, 8, output, 32);
+}
+
+// Chaining value of one chunk ( at most 1024 -bytes ) of some longer input,
+// at given chunk index; ROOT flag is set on its last block, only when `root`
+// is truthy i.e. whole input is this one chunk
+void
+blake3_chunk_cv_host(const cl_uchar* input,
+                     size_t i_size,
+                     cl_ulong chunk_idx,
+                     int root,
+                     cl_uint* const cv)
+{
+  assert(i_size <= 1024);
+
+  cl_uint msg[16];
+  cl_uchar block[64];
+
+  memcpy(cv, BLAKE3_IV, sizeof(BLAKE3_IV));
+
+  const size_t blk_cnt = i_size == 0 ? 1 : (i_size + 63) >> 6;
+
+  for (size_t b = 0; b < blk_cnt; b++) {
+    const size_t len = b + 1 < blk_cnt ? 64 : i_size - (b << 6);
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, input + (b << 6), len);
+    words_from_le_bytes(block, 64, msg, 16);
+
+    cl_uint flags = 0;
+    flags |= b == 0 ? BLAKE3_CHUNK_START : 0;
+    flags |= b + 1 == blk_cnt ? BLAKE3_CHUNK_END : 0;
+    flags |= b + 1 == blk_cnt && root ? BLAKE3_ROOT : 0;
+
+    blake3_compress_host(cv, msg, chunk_idx, (cl_uint)len, flags, cv);
+  }
+}
+
+// Chaining value of parent of two chaining values, which is root of whole
+// input, when `root` is truthy
+void
+blake3_parent_cv_host(const cl_uint* left,
+                      const cl_uint* right,
+                      int root,
+                      cl_uint* const cv)
+{
+  cl_uint msg[16];
+
+  memcpy(msg, left, 32);
+  memcpy(msg + 8, right, 32);
+
+  blake3_compress_host(BLAKE3_IV,
+                       msg,
+                       0,
+                       BLAKE3_BLOCK_LEN,
+                       BLAKE3_PARENT | (root ? BLAKE3_ROOT : 0),
+                       cv);
+}
+
+// BLAKE3 hash, on host, of input of any length, producing 32 -bytes digest;
+// chunks are merged into parents as soon as they complete a subtree, keeping
+// a stack of pending chaining values, same as reference implementation
+//
+// See
+// https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs
+void
+blake3_hash_long_host(const cl_uchar* input,
+                      size_t i_size,
+                      cl_uchar* const output)
+{
+  // one pending chaining value per set bit of # -of chunks
+  cl_uint stack[64][8];
+  size_t depth = 0;
+
+  const size_t chunk_cnt = i_size == 0 ? 1 : (i_size + 1023) >> 10;
+
+  cl_uint cv[8];
+
+  for (size_t c = 0; c + 1 < chunk_cnt; c++) {
+    blake3_chunk_cv_host(input + (c << 10), 1024, c, 0, cv);
+
+    // each trailing zero bit of # -of chunks seen so far completes a subtree
+    for (size_t total = c + 1; (total & 1) == 0; total >>= 1) {
+      blake3_parent_cv_host(stack[--depth], cv, 0, cv);
+    }
+    memcpy(stack[depth++], cv, sizeof(cv));
+  }
+
+  // last chunk is root only when it's the only one, otherwise pending
+  // chaining values are merged with it from right to left
+  const size_t last = chunk_cnt - 1;
+  blake3_chunk_cv_host(
+    input + (last << 10), i_size - (last << 10), last, depth == 0, cv);
+
+  while (depth > 0) {
+    depth--;
+    blake3_parent_cv_host(stack[depth], cv, depth == 0, cv);
+  }
+
+  words_to_le_bytes(cv, 8, output, 32);
+}
@@ -0,0 +1,597 @@
+#pragma once
+#include "host_blake3.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Host side merklization, for when trees are hashed on host ( as fallback, for
+// top levels or for small trees ), which uses a NUMA-aware work-stealing task
+// scheduler, instead of naive parallel-for over tree levels, which runs into
+// memory bandwidth limits & cross-socket traffic for large trees
+//
+// - tree is recursively split into cache-sized subtrees ( blocks ), each of
+//   which, along with all its intermediate nodes, fits in L2 cache; a block is
+//   hashed bottom-up by one worker, so each level is still in cache when its
+//   parents are hashed
+// - each worker is pinned to CPUs of one NUMA node & is seeded with a
+//   contiguous range of subtrees, whose output pages it first-touches, so that
+//   they're placed on worker's NUMA node
+// - idle workers steal largest pending subtree, first from workers of their
+//   own NUMA node & only then from remote ones
+// - parents of blocks are joined depth-first, i.e. the worker finishing second
+//   child of some node hashes that node right away, while its children are
+//   still in its cache, and continues upwards
+
+// CPUs of each NUMA node of this host, as read from
+// /sys/devices/system/node, falling back to single node having all CPUs this
+// process is allowed to run on
+typedef struct
+{
+  size_t node_cnt;
+  cpu_set_t* cpus; // one set per node
+} numa_topology_t;
+
+// Parses Linux cpulist format e.g. "0-15,32-47" into given CPU set
+void
+parse_cpulist(const char* list, cpu_set_t* const set)
+{
+  CPU_ZERO(set);
+
+  const char* ptr = list;
+  while (*ptr != '\0' && *ptr != '\n') {
+    char* end;
+    const long from = strtol(ptr, &end, 10);
+    long to = from;
+
+    if (*end == '-') {
+      to = strtol(end + 1, &end, 10);
+    }
+
+    for (long cpu = from; cpu <= to && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+
+    ptr = *end == ',' ? end + 1 : end;
+    if (end == ptr && *ptr != ',') {
+      break;
+    }
+  }
+}
+
+void
+numa_topology_init(numa_topology_t* const topo)
+{
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+
+  topo->node_cnt = 0;
+  topo->cpus = NULL;
+
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (dir != NULL) {
+    struct dirent* ent;
+
+    while ((ent = readdir(dir)) != NULL) {
+      unsigned int node;
+      if (sscanf(ent->d_name, "node%u", &node) != 1) {
+        continue;
+      }
+
+      char path[128];
+      snprintf(path,
+               sizeof(path),
+               "/sys/devices/system/node/node%u/cpulist",
+               node);
+
+      FILE* fd = fopen(path, "r");
+      if (fd == NULL) {
+        continue;
+      }
+
+      char list[4096] = { 0 };
+      const int ok = fgets(list, sizeof(list), fd) != NULL;
+      fclose(fd);
+
+      if (!ok) {
+        continue;
+      }
+
+      cpu_set_t set;
+      parse_cpulist(list, &set);
+      CPU_AND(&set, &set, &allowed);
+
+      // memory only nodes/ nodes we can't run on, are of no use
+      if (CPU_COUNT(&set) == 0) {
+        continue;
+      }
+
+      topo->cpus = (cpu_set_t*)realloc(
+        topo->cpus, sizeof(cpu_set_t) * (topo->node_cnt + 1));
+      check_mem_alloc(topo->cpus);
+      *(topo->cpus + topo->node_cnt++) = set;
+    }
+
+    closedir(dir);
+  }
+
+  if (topo->node_cnt == 0) {
+    topo->cpus = (cpu_set_t*)malloc(sizeof(cpu_set_t));
+    check_mem_alloc(topo->cpus);
+
+    *topo->cpus = allowed;
+    topo->node_cnt = 1;
+  }
+}
+
+void
+numa_topology_free(numa_topology_t* const topo)
+{
+  free(topo->cpus);
+  topo->cpus = NULL;
+  topo->node_cnt = 0;
+}
+
+// Size of L2 cache ( per core ) in bytes, falling back to 1 MB when it can't
+// be figured out
+size_t
+l2_cache_size()
+{
+  long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  return size > 0 ? (size_t)size : (size_t)1 << 20;
+}
+
+// Allocates memory for holding ( output ) nodes of merkle tree, without
+// touching it, so that pages get placed on NUMA node of whichever worker
+// first writes to them
+//
+// Release using `host_tree_free( ... )`
+void*
+host_tree_alloc(size_t size)
+{
+  void* ptr = mmap(
+    NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+void
+host_tree_free(void* ptr, size_t size)
+{
+  munmap(ptr, size);
+}
+
+// Task is a subtree, identified by its root node index ( in heap order, root
+// of whole tree at 1 ) and its height ( leaves at height 0 )
+typedef struct
+{
+  size_t node;
+  size_t height;
+} host_task_t;
+
+// Double ended queue of tasks owned by one worker, where owner pushes/ pops at
+// bottom ( depth-first ), while thieves steal from top ( largest subtrees )
+typedef struct
+{
+  pthread_mutex_t lock;
+  host_task_t* tasks;
+  size_t top;
+  size_t bottom;
+  size_t cap;
+} host_deque_t;
+
+void
+host_deque_init(host_deque_t* const dq)
+{
+  pthread_mutex_init(&dq->lock, NULL);
+  dq->cap = 64;
+  dq->top = 0;
+  dq->bottom = 0;
+  dq->tasks = (host_task_t*)malloc(sizeof(host_task_t) * dq->cap);
+  check_mem_alloc(dq->tasks);
+}
+
+void
+host_deque_free(host_deque_t* const dq)
+{
+  pthread_mutex_destroy(&dq->lock);
+  free(dq->tasks);
+}
+
+void
+host_deque_push(host_deque_t* const dq, host_task_t task)
+{
+  pthread_mutex_lock(&dq->lock);
+
+  if (dq->bottom == dq->cap) {
+    // compact before growing
+    const size_t len = dq->bottom - dq->top;
+    memmove(dq->tasks, dq->tasks + dq->top, sizeof(host_task_t) * len);
+    dq->top = 0;
+    dq->bottom = len;
+
+    if (dq->bottom == dq->cap) {
+      dq->cap <<= 1;
+      dq->tasks =
+        (host_task_t*)realloc(dq->tasks, sizeof(host_task_t) * dq->cap);
+      check_mem_alloc(dq->tasks);
+    }
+  }
+
+  *(dq->tasks + dq->bottom++) = task;
+
+  pthread_mutex_unlock(&dq->lock);
+}
+
+// Returns 1 when some task is popped ( by owner ) or stolen ( by thief )
+int
+host_deque_take(host_deque_t* const dq, host_task_t* const task, int steal)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&dq->lock);
+
+  if (dq->bottom > dq->top) {
+    *task = steal ? *(dq->tasks + dq->top++) : *(dq->tasks + --dq->bottom);
+    found = 1;
+  }
+
+  pthread_mutex_unlock(&dq->lock);
+
+  return found;
+}
+
+// State shared among all workers of one host merklization
+typedef struct
+{
+  const cl_uchar* input; // N leaves
+  cl_uchar* output;      // N nodes, heap order, slot 0 unused
+  size_t leaf_count;
+  size_t height;       // of whole tree i.e. log2(N)
+  size_t block_height; // subtrees of this height are hashed by one worker
+  size_t seed_height;  // subtrees of this height are initially distributed
+
+  atomic_uint* joins; // pending children of each node above blocks
+  atomic_int done;
+
+  // all workers first-touch their seeded subtrees, before anyone starts
+  // hashing/ stealing
+  pthread_barrier_t touched;
+
+  // workers wait here till rest of scheduler state is set up, which is only
+  // done once it's known how many of them could be started
+  pthread_mutex_t gate_lock;
+  pthread_cond_t gate;
+  int ready;
+
+  size_t worker_cnt;
+  host_deque_t* deques;
+  size_t* worker_node; // NUMA node of each worker
+  const numa_topology_t* topo;
+} host_sched_t;
+
+typedef struct
+{
+  host_sched_t* sched;
+  size_t id;
+} host_worker_t;
+
+// Pointer to 32 -bytes node, with given heap index, where nodes at [N, 2N) are
+// leaves, living in input
+const cl_uchar*
+host_node(const host_sched_t* sched, size_t idx)
+{
+  return idx >= sched->leaf_count
+           ? sched->input + ((idx - sched->leaf_count) << 5)
+           : sched->output + (idx << 5);
+}
+
+// Hashes all intermediate nodes of a block, bottom-up, level by level
+void
+host_hash_block(const host_sched_t* sched, size_t root, size_t height)
+{
+  for (size_t t = 1; t <= height; t++) {
+    const size_t first = root << (height - t);
+    const size_t count = (size_t)1 << (height - t);
+
+    for (size_t i = first; i < first + count; i++) {
+      // two children of node i are contiguous, at 2i & 2i + 1
+      blake3_hash_pair_host(host_node(sched, i << 1),
+                            sched->output + (i << 5));
+    }
+  }
+}
+
+// Called once subtree rooted at `node` is fully hashed, walks up the tree,
+// hashing each parent whose both children are now done
+void
+host_complete(host_sched_t* const sched, size_t node)
+{
+  while (node > 1) {
+    const size_t parent = node >> 1;
+
+    // sibling subtree is still being hashed, whoever finishes it, continues
+    if (atomic_fetch_sub(sched->joins + parent, 1) != 1) {
+      return;
+    }
+
+    blake3_hash_pair_host(host_node(sched, parent << 1),
+                          sched->output + (parent << 5));
+    node = parent;
+  }
+
+  atomic_store(&sched->done, 1);
+}
+
+// Depth-first execution of a task, splitting it till it's of block size,
+// while pushing right halves to own deque, so that they can be stolen
+void
+host_run_task(host_sched_t* const sched, size_t id, host_task_t task)
+{
+  while (task.height > sched->block_height) {
+    host_deque_push(sched->deques + id,
+                    (host_task_t){ .node = (task.node << 1) + 1,
+                                   .height = task.height - 1 });
+
+    task.node <<= 1;
+    task.height -= 1;
+  }
+
+  host_hash_block(sched, task.node, task.height);
+  host_complete(sched, task.node);
+}
+
+// Tries to steal one task, first from workers of same NUMA node, then from
+// workers of other NUMA nodes
+int
+host_steal(host_sched_t* const sched, size_t id, host_task_t* const task)
+{
+  const size_t node = *(sched->worker_node + id);
+
+  for (int remote = 0; remote < 2; remote++) {
+    for (size_t i = 1; i < sched->worker_cnt; i++) {
+      const size_t victim = (id + i) % sched->worker_cnt;
+      const int same = *(sched->worker_node + victim) == node;
+
+      if (same == remote) {
+        continue;
+      }
+
+      if (host_deque_take(sched->deques + victim, task, 1)) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// First-touches all pages of output, which hold intermediate nodes of given
+// subtree, so that they're placed on NUMA node of calling worker
+void
+host_first_touch(host_sched_t* const sched, size_t root, size_t height)
+{
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  for (size_t t = 1; t <= height; t++) {
+    const size_t first = root << (height - t);
+    const size_t count = (size_t)1 << (height - t);
+
+    // only pages which are fully owned by this subtree, rest are shared
+    const size_t from = ((first << 5) + page - 1) / page * page;
+    const size_t to = ((first + count) << 5) / page * page;
+
+    for (size_t off = from; off < to; off += page) {
+      *(volatile cl_uchar*)(sched->output + off) = 0;
+    }
+  }
+}
+
+void*
+host_worker(void* arg)
+{
+  host_worker_t* const worker = (host_worker_t*)arg;
+  host_sched_t* const sched = worker->sched;
+  const size_t id = worker->id;
+
+  pthread_mutex_lock(&sched->gate_lock);
+  while (!sched->ready) {
+    pthread_cond_wait(&sched->gate, &sched->gate_lock);
+  }
+  pthread_mutex_unlock(&sched->gate_lock);
+
+  const cpu_set_t* cpus = sched->topo->cpus + *(sched->worker_node + id);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+
+  // seeded tasks are only in own deque, so far
+  host_deque_t* const dq = sched->deques + id;
+  for (size_t i = dq->top; i < dq->bottom; i++) {
+    host_first_touch(sched, (dq->tasks + i)->node, (dq->tasks + i)->height);
+  }
+
+  pthread_barrier_wait(&sched->touched);
+
+  host_task_t task;
+  while (!atomic_load(&sched->done)) {
+    if (host_deque_take(dq, &task, 0) || host_steal(sched, id, &task)) {
+      host_run_task(sched, id, task);
+    } else {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+// Merklizes N leaf nodes on host, using `worker_cnt` -many threads ( pass 0 for
+// using all CPUs this process is allowed to run on ), producing output in
+// exactly same layout as `merklize( ... )` does
+//
+// For first-touch placement of output pages to be effective, output memory
+// must not have been touched before e.g. allocate it using
+// `host_tree_alloc( ... )`
+//
+// When fewer threads could be created than asked for, work is spread over
+// ones which could be; when none could be, whole tree is hashed on calling
+// thread
+void
+merklize_host(const cl_uchar* input,
+              size_t i_size, // in bytes
+              size_t leaf_count,
+              cl_uchar* const output,
+              size_t o_size, // in bytes
+              size_t worker_cnt)
+{
+  assert(i_size == o_size);
+  assert(leaf_count << 5 == i_size);
+  assert(leaf_count >= 2);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+
+  numa_topology_t topo;
+  numa_topology_init(&topo);
+
+  if (worker_cnt == 0) {
+    for (size_t i = 0; i < topo.node_cnt; i++) {
+      worker_cnt += (size_t)CPU_COUNT(topo.cpus + i);
+    }
+  }
+
+  host_sched_t sched = { .input = input,
+                         .output = output,
+                         .leaf_count = leaf_count,
+                         .topo = &topo };
+
+  sched.height = 0;
+  while (((size_t)1 << sched.height) < leaf_count) {
+    sched.height++;
+  }
+
+  // subtree of height h has 2 ^ h leaves & ( 2 ^ h - 1 ) intermediate nodes,
+  // all of them together must fit in L2 cache
+  const size_t l2 = l2_cache_size();
+  sched.block_height = 1;
+  while (sched.block_height < sched.height &&
+         ((size_t)2 << (sched.block_height + 1 + 5)) <= l2) {
+    sched.block_height++;
+  }
+
+  pthread_mutex_init(&sched.gate_lock, NULL);
+  pthread_cond_init(&sched.gate, NULL);
+  sched.ready = 0;
+
+  host_worker_t* workers =
+    (host_worker_t*)malloc(sizeof(host_worker_t) * worker_cnt);
+  check_mem_alloc(workers);
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * worker_cnt);
+  check_mem_alloc(threads);
+
+  // started workers block at gate, so they don't look at scheduler state
+  // before it's sized to # -of workers which actually got started
+  size_t started = 0;
+  for (; started < worker_cnt; started++) {
+    *(workers + started) = (host_worker_t){ .sched = &sched, .id = started };
+    if (pthread_create(
+          threads + started, NULL, host_worker, workers + started) != 0) {
+      break;
+    }
+  }
+
+  if (started == 0) {
+    host_hash_block(&sched, 1, sched.height);
+
+    pthread_mutex_destroy(&sched.gate_lock);
+    pthread_cond_destroy(&sched.gate);
+
+    free(workers);
+    free(threads);
+
+    numa_topology_free(&topo);
+    return;
+  }
+
+  worker_cnt = started;
+  sched.worker_cnt = worker_cnt;
+
+  // at least four seeded subtrees per worker, when tree is large enough,
+  // though never smaller than a block
+  sched.seed_height = sched.height;
+  while (sched.seed_height > sched.block_height &&
+         (leaf_count >> sched.seed_height) < (worker_cnt << 2)) {
+    sched.seed_height--;
+  }
+
+  // join counters for all nodes above seeded subtrees & blocks
+  const size_t join_cnt = leaf_count >> sched.block_height;
+  sched.joins = (atomic_uint*)malloc(sizeof(atomic_uint) * (join_cnt + 1));
+  check_mem_alloc(sched.joins);
+  for (size_t i = 0; i <= join_cnt; i++) {
+    atomic_init(sched.joins + i, 2);
+  }
+  atomic_init(&sched.done, 0);
+  pthread_barrier_init(&sched.touched, NULL, (unsigned)worker_cnt);
+
+  sched.deques = (host_deque_t*)malloc(sizeof(host_deque_t) * worker_cnt);
+  check_mem_alloc(sched.deques);
+  sched.worker_node = (size_t*)malloc(sizeof(size_t) * worker_cnt);
+  check_mem_alloc(sched.worker_node);
+
+  // workers are spread over NUMA nodes proportional to their CPU count, in
+  // order of NUMA nodes, so that contiguous range of seeded subtrees ( i.e.
+  // contiguous range of leaves ) is owned by workers of same NUMA node
+  size_t total_cpus = 0;
+  for (size_t i = 0; i < topo.node_cnt; i++) {
+    total_cpus += (size_t)CPU_COUNT(topo.cpus + i);
+  }
+
+  for (size_t w = 0, node = 0, acc = 0; w < worker_cnt; w++) {
+    while (node + 1 < topo.node_cnt &&
+           w * total_cpus >=
+             (acc + (size_t)CPU_COUNT(topo.cpus + node)) * worker_cnt) {
+      acc += (size_t)CPU_COUNT(topo.cpus + node);
+      node++;
+    }
+
+    *(sched.worker_node + w) = node;
+    host_deque_init(sched.deques + w);
+  }
+
+  // seeding, in reverse order, so that each worker starts with its leftmost
+  // subtree ( popped from bottom ) while thieves steal its rightmost one
+  const size_t seed_cnt = leaf_count >> sched.seed_height;
+  const size_t seed_first = seed_cnt; // heap index of leftmost seed
+
+  for (size_t s = seed_cnt; s > 0; s--) {
+    const size_t owner = (s - 1) * worker_cnt / seed_cnt;
+
+    host_deque_push(sched.deques + owner,
+                    (host_task_t){ .node = seed_first + s - 1,
+                                   .height = sched.seed_height });
+  }
+
+  pthread_mutex_lock(&sched.gate_lock);
+  sched.ready = 1;
+  pthread_cond_broadcast(&sched.gate);
+  pthread_mutex_unlock(&sched.gate_lock);
+
+  for (size_t w = 0; w < worker_cnt; w++) {
+    pthread_join(*(threads + w), NULL);
+  }
+
+  for (size_t w = 0; w < worker_cnt; w++) {
+    host_deque_free(sched.deques + w);
+  }
+
+  pthread_barrier_destroy(&sched.touched);
+  pthread_mutex_destroy(&sched.gate_lock);
+  pthread_cond_destroy(&sched.gate);
+
+  free(workers);
+  free(threads);
+  free(sched.deques);
+  free(sched.worker_node);
+  free(sched.joins);
+
+  numa_topology_free(&topo);
+}
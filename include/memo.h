@@ -0,0 +1,390 @@
+#pragma once
+#include "host_blake3.h"
+#include "merklize.h"
+#include <sys/random.h>
+#include <time.h>
+
+// Memoization of subtree roots, for repeatedly merklizing successive
+// snapshots of some dataset, where most of aligned leaf ranges don't change
+// from one snapshot to another
+//
+// Tree of N leaves is viewed as N / 2 ^ h subtrees of chosen height h. Leaf
+// range of each subtree is digested using BLAKE3, and root of subtree is
+// looked up in cache, keyed by ( height, subtree index, digest ), so a hit
+// can't return root of some other leaf range, short of finding a BLAKE3
+// collision. Only subtrees missing from cache are merklized on device, all
+// together, using `merklize_forest( ... )`, before combining all subtree
+// roots into top of tree.
+//
+// Digesting costs about as much host time as hashing leaves once, what's
+// saved is device work & transfers of unchanged subtrees.
+//
+// Cache has bounded memory budget & evicts least recently used roots, when
+// going over it.
+
+typedef struct memo_entry_s
+{
+  cl_ulong height;
+  cl_ulong index;
+  cl_uchar digest[32]; // of leaves of subtree
+  cl_uchar root[32];
+  struct memo_entry_s* chain; // next entry in same bucket
+  struct memo_entry_s* prev;  // towards most recently used
+  struct memo_entry_s* next;  // towards least recently used
+} memo_entry_t;
+
+typedef struct
+{
+  size_t height; // of subtrees, whose roots are cached
+  size_t budget; // in bytes
+  size_t bytes;  // currently used
+  cl_ulong seed; // of bucket hashing, so that buckets can't be flooded
+  memo_entry_t** buckets;
+  size_t bucket_cnt;  // power of 2
+  memo_entry_t* head; // most recently used
+  memo_entry_t* tail; // least recently used
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} memo_cache_t;
+
+// 64 -bit finalizer of MurmurHash3, see
+// https://github.com/aappleby/smhasher/blob/61a0530f28277f2e850bfc39600ce61d02b518de/src/MurmurHash3.cpp#L81-L90
+cl_ulong
+memo_fmix64(cl_ulong k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdul;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ul;
+  k ^= k >> 33;
+  return k;
+}
+
+// Initializes cache of roots of subtrees of given height ( > 0 ), which never
+// uses more than `budget` -bytes, in total, for cached entries & buckets
+void
+memo_init(memo_cache_t* const cache, size_t height, size_t budget)
+{
+  assert(height > 0);
+
+  memset(cache, 0, sizeof(memo_cache_t));
+
+  cache->height = height;
+
+  // digests are attacker controlled, when leaves are, so bucket selection is
+  // seeded from OS entropy, falling back to clock when it's not available
+  if (getrandom(&cache->seed, sizeof(cache->seed), 0) !=
+      (ssize_t)sizeof(cache->seed)) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    cache->seed = memo_fmix64((cl_ulong)t.tv_sec ^ (cl_ulong)t.tv_nsec);
+  }
+
+  // roughly one bucket per entry, which fits in budget
+  cache->bucket_cnt = 1;
+  while ((cache->bucket_cnt << 1) *
+           (sizeof(memo_entry_t) + sizeof(memo_entry_t*)) <=
+         budget) {
+    cache->bucket_cnt <<= 1;
+  }
+
+  cache->buckets =
+    (memo_entry_t**)calloc(cache->bucket_cnt, sizeof(memo_entry_t*));
+  check_mem_alloc(cache->buckets);
+
+  cache->bytes = cache->bucket_cnt * sizeof(memo_entry_t*);
+  cache->budget = budget > cache->bytes ? budget : cache->bytes;
+}
+
+void
+memo_free(memo_cache_t* const cache)
+{
+  memo_entry_t* e = cache->head;
+  while (e != NULL) {
+    memo_entry_t* const next = e->next;
+    free(e);
+    e = next;
+  }
+
+  free(cache->buckets);
+  memset(cache, 0, sizeof(memo_cache_t));
+}
+
+size_t
+memo_bucket_of(const memo_cache_t* cache,
+               cl_ulong height,
+               cl_ulong index,
+               const cl_uchar* digest)
+{
+  cl_ulong d;
+  memcpy(&d, digest, sizeof(d));
+
+  const cl_ulong h = memo_fmix64(d ^ cache->seed ^
+                                 (index * 0x9e3779b97f4a7c15ul) ^
+                                 (height << 56));
+  return (size_t)h & (cache->bucket_cnt - 1);
+}
+
+// Moves entry to head of LRU list
+void
+memo_touch(memo_cache_t* const cache, memo_entry_t* const e)
+{
+  if (cache->head == e) {
+    return;
+  }
+
+  // unlinking
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  }
+  if (cache->tail == e) {
+    cache->tail = e->prev;
+  }
+
+  // linking at head
+  e->prev = NULL;
+  e->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = e;
+  }
+  cache->head = e;
+  if (cache->tail == NULL) {
+    cache->tail = e;
+  }
+}
+
+// Returns cached 32 -bytes root of subtree, or NULL when it's not cached
+const cl_uchar*
+memo_lookup(memo_cache_t* const cache,
+            cl_ulong height,
+            cl_ulong index,
+            const cl_uchar* digest)
+{
+  const size_t b = memo_bucket_of(cache, height, index, digest);
+  memo_entry_t* e = *(cache->buckets + b);
+
+  for (; e != NULL; e = e->chain) {
+    if (e->height == height && e->index == index &&
+        memcmp(e->digest, digest, 32) == 0) {
+      memo_touch(cache, e);
+      cache->hits++;
+      return e->root;
+    }
+  }
+
+  cache->misses++;
+  return NULL;
+}
+
+// Evicts least recently used entry
+void
+memo_evict(memo_cache_t* const cache)
+{
+  memo_entry_t* const e = cache->tail;
+
+  memo_entry_t** link =
+    cache->buckets + memo_bucket_of(cache, e->height, e->index, e->digest);
+  while (*link != e) {
+    link = &(*link)->chain;
+  }
+  *link = e->chain;
+
+  cache->tail = e->prev;
+  if (cache->tail != NULL) {
+    cache->tail->next = NULL;
+  } else {
+    cache->head = NULL;
+  }
+
+  free(e);
+  cache->bytes -= sizeof(memo_entry_t);
+  cache->evictions++;
+}
+
+// Caches 32 -bytes root of subtree, evicting least recently used ones, if
+// required to stay within budget; it's a no-op when subtree is already cached
+// ( e.g. it was looked up, but couldn't be reused )
+void
+memo_insert(memo_cache_t* const cache,
+            cl_ulong height,
+            cl_ulong index,
+            const cl_uchar* digest,
+            const cl_uchar* root)
+{
+  memo_entry_t* c =
+    *(cache->buckets + memo_bucket_of(cache, height, index, digest));
+  for (; c != NULL; c = c->chain) {
+    if (c->height == height && c->index == index &&
+        memcmp(c->digest, digest, 32) == 0) {
+      return;
+    }
+  }
+
+  if (cache->bytes + sizeof(memo_entry_t) > cache->budget) {
+    if (cache->tail == NULL) {
+      return; // budget doesn't allow even a single entry
+    }
+    memo_evict(cache);
+  }
+
+  memo_entry_t* const e = (memo_entry_t*)malloc(sizeof(memo_entry_t));
+  check_mem_alloc(e);
+
+  *e = (memo_entry_t){ .height = height, .index = index };
+  memcpy(e->digest, digest, 32);
+  memcpy(e->root, root, 32);
+
+  memo_entry_t** const bucket =
+    cache->buckets + memo_bucket_of(cache, height, index, digest);
+  e->chain = *bucket;
+  *bucket = e;
+
+  memo_touch(cache, e);
+  cache->bytes += sizeof(memo_entry_t);
+}
+
+// Same as `merklize( ... )`, but roots of subtrees of height `cache->height`
+// are looked up in given cache, so that only those subtrees whose leaves have
+// changed since they were last cached, are merklized on device ( all of them
+// together, in `cache->height` -many kernel dispatches ); rest of tree is
+// then built on top of subtree roots
+//
+// Nodes below root of a reused subtree are copied from `prev`, which holds
+// intermediate nodes of some previous build of same sized tree ( in same
+// layout as output ), or is output itself, when it still holds one. So a
+// cached root is reused only when `prev` has same root at that subtree's
+// slot, otherwise nodes below it in `prev` belong to different leaves & that
+// subtree is merklized afresh. Pass `prev` as NULL, when there's no previous
+// build, then every subtree is merklized ( while cache is still filled ).
+//
+// `reused` is set to # -of subtrees whose roots were reused; `ts` is set to
+// sum of times of all device commands, same as `merklize( ... )`
+cl_int
+merklize_memo(memo_cache_t* const cache,
+              cl_context ctx,
+              cl_command_queue cq,
+              cl_kernel krnl,
+              const cl_uchar* input,
+              size_t i_size, // in bytes
+              size_t leaf_count,
+              cl_uchar* const output,
+              size_t o_size, // in bytes
+              const cl_uchar* prev,
+              size_t wg_size,
+              size_t* const reused,
+              cl_ulong* const ts)
+{
+  assert(i_size == o_size);
+  assert(leaf_count << 5 == i_size);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+  assert(leaf_count >> cache->height > 0);
+
+  const size_t h = cache->height;
+  const size_t m = (size_t)1 << h;      // leaves per subtree
+  const size_t s_cnt = leaf_count >> h; // # -of subtrees
+  const size_t s_size = m << 5;         // leaf bytes per subtree
+
+  cl_int status = CL_SUCCESS;
+  memset(ts, 0, sizeof(cl_ulong) * 3);
+
+  cl_uchar* digests = (cl_uchar*)malloc(s_cnt << 5);
+  check_mem_alloc(digests);
+  size_t* missed = (size_t*)malloc(sizeof(size_t) * s_cnt);
+  check_mem_alloc(missed);
+
+  size_t k = 0; // # -of subtrees to be merklized
+
+  // roots of subtrees live at [N >> h, 2N >> h) in output
+  for (size_t s = 0; s < s_cnt; s++) {
+    cl_uchar* const digest = digests + (s << 5);
+    blake3_hash_long_host(input + s * s_size, s_size, digest);
+
+    const cl_uchar* root = memo_lookup(cache, h, s, digest);
+    const size_t slot = (s_cnt + s) << 5;
+
+    if (root == NULL || prev == NULL || memcmp(prev + slot, root, 32) != 0) {
+      *(missed + k++) = s;
+      continue;
+    }
+
+    // level l of subtree lives at [(N >> l) + s * (m >> l), ...), root
+    // included
+    if (prev != output) {
+      for (size_t l = 1; l <= h; l++) {
+        const size_t cnt = m >> l;
+        const size_t off = ((leaf_count >> l) + s * cnt) << 5;
+
+        memcpy(output + off, prev + off, cnt << 5);
+      }
+    }
+  }
+
+  *reused = s_cnt - k;
+
+  if (k > 0) {
+    // forest of k subtrees, leaves concatenated at [k * m, 2 * k * m)
+    const size_t f_leaves = k * m;
+    const size_t f_size = f_leaves << 6;
+
+    cl_uchar* forest = (cl_uchar*)malloc(f_size);
+    check_mem_alloc(forest);
+
+    for (size_t i = 0; i < k; i++) {
+      memcpy(forest + ((f_leaves + i * m) << 5),
+             input + *(missed + i) * s_size,
+             s_size);
+    }
+
+    status = merklize_forest(
+      ctx, cq, krnl, forest, f_size, f_leaves, h, wg_size, ts, NULL);
+
+    if (status == CL_SUCCESS) {
+      for (size_t i = 0; i < k; i++) {
+        const size_t s = *(missed + i);
+
+        // level l of i-th subtree of forest lives at
+        // [(k * m >> l) + i * (m >> l), ...), which is placed at
+        // [(N >> l) + s * (m >> l), ...) in whole tree's output
+        for (size_t l = 1; l <= h; l++) {
+          const size_t cnt = m >> l;
+
+          memcpy(output + (((leaf_count >> l) + s * cnt) << 5),
+                 forest + (((f_leaves >> l) + i * cnt) << 5),
+                 cnt << 5);
+        }
+
+        memo_insert(
+          cache, h, s, digests + (s << 5), output + ((s_cnt + s) << 5));
+      }
+    }
+
+    free(forest);
+  }
+
+  // combining roots of all subtrees into top of tree
+  if (status == CL_SUCCESS && s_cnt > 1) {
+    const size_t size = s_cnt << 5;
+
+    cl_uchar* top = (cl_uchar*)malloc(size);
+    check_mem_alloc(top);
+
+    status =
+      merklize_small(ctx, cq, krnl, output + size, size, s_cnt, top, size);
+
+    // node slot 0 is unused
+    if (status == CL_SUCCESS) {
+      memcpy(output + 32, top + 32, size - 32);
+    }
+
+    free(top);
+  }
+
+  free(digests);
+  free(missed);
+
+  return status;
+}
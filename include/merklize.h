@@ -1,27 +1,837 @@
 #pragma once
+#include "arena.h"
+#include "metrics.h"
+#include "trace.h"
 #include "utils.h"
 #include <math.h>
+#include <pthread.h>
 
-// Given a N -many leaf nodes of some binary merkle tree, this function
-// constructs all intermediate nodes of tree, including root of merkle tree
+typedef struct merklize_async_s merklize_async_t;
+
+// Invoked once intermediate nodes of tree levels, whose heights ( leaves at 0
+// ) are in [from, to], are on host, in output, at node indices
+// [first, first + count), as little endian bytes; from a thread owned by
+// OpenCL runtime, so same restrictions as of `merklize_callback_t` apply
+typedef void (*merklize_level_callback_t)(merklize_async_t* handle,
+                                          size_t from,
+                                          size_t to,
+                                          size_t first,
+                                          size_t count,
+                                          void* user_data);
+
+// Optional knobs of `merklize( ... )`, pass NULL for going with defaults
+typedef struct
+{
+  // when non-NULL, QUEUED/ SUBMIT/ START/ END timestamps of all commands
+  // enqueued during tree construction are appended to this timeline
+  trace_t* trace;
+  // when non-NULL, host staging & device buffers are acquired from this
+  // arena & handed back to it, once tree is built, instead of being allocated
+  // & freed on every call; see `merklize_async( ... )`
+  arena_t* arena;
+  // when non-NULL, resource usage & data movement of each call is recorded
+  // in this session, once tree is built; see include/metrics.h
+  metrics_t* metrics;
+  // when non-zero, intermediate nodes are read back in groups of these many
+  // levels, each one as soon as kernel producing its topmost level completes,
+  // instead of all of them after root is computed, so that readback of lower
+  // levels overlaps with computing upper ones; and `on_level` ( if non-NULL )
+  // is invoked with `level_data`, once each group is on host
+  //
+  // each group lives in its own device buffer, so that reading it back never
+  // touches a buffer, later kernels are still writing into
+  size_t stream_levels;
+  merklize_level_callback_t on_level;
+  void* level_data;
+} merklize_opts_t;
+
+// One contiguous run of leaf nodes ( each 32 -bytes, as little endian bytes ),
+// among many which are concatenated, in order, for forming input of tree
+typedef struct
+{
+  const cl_uchar* ptr;
+  size_t leaf_count;
+} merklize_iov_t;
+
+// Invoked once tree is built ( or failed to be built ), from a thread owned by
+// OpenCL runtime ( or from thread enqueuing tree build, when it's already
+// built by then ), so it must return quickly & must neither call blocking
+// OpenCL functions nor wait on/ release handle itself; polling it is fine
+typedef void (*merklize_callback_t)(merklize_async_t* handle,
+                                    cl_int status,
+                                    void* user_data);
+
+// Handle of tree being built asynchronously, which holds all host/ device
+// resources required for building it, until it's released
+struct merklize_async_s
+{
+  cl_uchar* output;
+  size_t o_size;
+  size_t rounds;
+
+  // word converted copies of input/ output, only required on big endian host
+  // or when staging through pinned buffers of arena
+  cl_uint* i_buf_ptr;
+  cl_uint* itmd_buf_ptr;
+
+  // buffers acquired from arena, in order i_buf, itmd_buf, i_buf_ptr,
+  // itmd_buf_ptr, when `arena` is non-NULL
+  arena_t* arena;
+  arena_buf_t* arena_bufs[4];
+
+  // buffer offsets, written to device using non-blocking writes, so they
+  // must live as long as tree is being built
+  size_t* offsets;
+
+  cl_mem i_buf;
+  cl_mem itmd_buf; // NULL, when streaming
+  cl_mem* tmp_bufs;
+
+  // when streaming, intermediate nodes of each group of levels are kept in
+  // their own buffer ( acquired from arena, when using one ), in place of
+  // `itmd_buf`
+  cl_mem* group_bufs;
+  arena_buf_t** group_arena_bufs;
+
+  cl_event evt_0;       // input leaf nodes written, marker over `seg_evts`
+  cl_event* seg_evts;   // one write per non-empty input segment
+  size_t seg_cnt;
+  cl_event evt_4;       // intermediate nodes read back, marker over
+                        // `read_evts` when there're many
+  cl_event* read_evts;  // one readback per group of levels
+  cl_event* round_evts; // kernel executions
+  cl_event* tmp_evts;   // offset writes
+
+  trace_t* trace;
+  merklize_callback_t cb;
+  void* user_data;
+
+  // readback groups, see `merklize_opts_t`; `pending` callbacks ( one per
+  // group, when streaming, and one of last command ), along with enqueuing
+  // thread itself, must arrive before tree is considered built
+  struct merklize_level_s* levels;
+  size_t group_cnt;
+  int streaming;
+  merklize_level_callback_t on_level;
+  void* level_data;
+  size_t pending;
+  size_t registered; // # -of callbacks registered, so far
+
+  // filled in while building tree, committed to session once it's waited on
+  metrics_t* metrics;
+  merklize_metrics_t m;
+  cl_ulong started;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;
+  int finished; // timestamps collected & trace recorded ?
+  cl_int status;
+  cl_ulong ts[3];
+};
+
+// Readback of a group of consecutive tree levels, whose intermediate nodes
+// are contiguous in heap layout
+typedef struct merklize_level_s
+{
+  merklize_async_t* handle;
+  size_t from; // heights of lowest & topmost level, leaves at 0
+  size_t to;
+  size_t first; // node index, where group begins
+  size_t count; // # -of nodes
+} merklize_level_t;
+
+// Converts intermediate nodes at [first, first + count) from staging buffer
+// to output ( if staged ), returning time spent
+cl_ulong
+merklize_async_convert(merklize_async_t* const handle,
+                       size_t first,
+                       size_t count)
+{
+  const cl_ulong t0 = metrics_now_ns();
+
+  // all intermediate nodes of merkle tree being interpreted
+  // as little endian byte array, as input was provided, output being
+  // converted to similar representation
+  if (handle->itmd_buf_ptr != NULL) {
+    if (host_is_little_endian()) {
+      memcpy(handle->output + (first << 5),
+             handle->itmd_buf_ptr + (first << 3),
+             count << 5);
+    } else {
+      words_to_le_bytes(handle->itmd_buf_ptr + (first << 3),
+                        count << 3,
+                        handle->output + (first << 5),
+                        count << 5);
+    }
+  }
+
+  return metrics_now_ns() - t0;
+}
+
+// Each of `pending` callbacks arrives here, once; last one to arrive marks
+// tree as built, so that it can't be released while others are still running
+void
+merklize_async_arrive(merklize_async_t* const handle,
+                      cl_int status,
+                      cl_ulong convert_ns)
+{
+  pthread_mutex_lock(&handle->lock);
+
+  if (status != CL_SUCCESS && handle->status == CL_SUCCESS) {
+    handle->status = status;
+  }
+  handle->m.phase_ns[METRICS_CONVERT] += convert_ns;
+
+  const int last = --handle->pending == 0;
+  status = handle->status;
+
+  pthread_mutex_unlock(&handle->lock);
+
+  if (!last) {
+    return;
+  }
+
+  handle->m.phase_ns[METRICS_TOTAL] = metrics_now_ns() - handle->started;
+
+  // user callback runs before waiters are woken up, so that handle can't be
+  // released from under it
+  if (handle->cb != NULL) {
+    handle->cb(handle, status, handle->user_data);
+  }
+
+  pthread_mutex_lock(&handle->lock);
+  handle->done = 1;
+  pthread_cond_broadcast(&handle->cond);
+  pthread_mutex_unlock(&handle->lock);
+}
+
+// Registered as completion callback of readback of each group of levels, when
+// streaming
+void CL_CALLBACK
+merklize_async_on_level(cl_event evt, cl_int evt_status, void* arg)
+{
+  const merklize_level_t* level = (const merklize_level_t*)arg;
+  merklize_async_t* const handle = level->handle;
+
+  const cl_int status = evt_status == CL_COMPLETE ? CL_SUCCESS : evt_status;
+  cl_ulong convert_ns = 0;
+
+  if (status == CL_SUCCESS) {
+    convert_ns = merklize_async_convert(handle, level->first, level->count);
+
+    // node slot 0 is read back along with root, but it's never written
+    const size_t first = level->first == 0 ? 1 : level->first;
+
+    if (handle->on_level != NULL) {
+      handle->on_level(handle,
+                       level->from,
+                       level->to,
+                       first,
+                       level->count - (first - level->first),
+                       handle->level_data);
+    }
+  }
+
+  merklize_async_arrive(handle, status, convert_ns);
+}
+
+// Registered as completion callback of last command of tree build
+void CL_CALLBACK
+merklize_async_on_complete(cl_event evt, cl_int evt_status, void* arg)
+{
+  merklize_async_t* const handle = (merklize_async_t*)arg;
+
+  const cl_int status = evt_status == CL_COMPLETE ? CL_SUCCESS : evt_status;
+  cl_ulong convert_ns = 0;
+
+  // when streaming, each group is converted as soon as it's read back
+  if (status == CL_SUCCESS && !handle->streaming) {
+    convert_ns = merklize_async_convert(handle, 0, handle->o_size >> 5);
+  }
+
+  merklize_async_arrive(handle, status, convert_ns);
+}
+
+// Registers completion callback of some command of tree build, which must
+// arrive at `merklize_async_arrive( ... )` exactly once
+cl_int
+merklize_async_register(merklize_async_t* const handle,
+                        cl_event evt,
+                        void(CL_CALLBACK* fn)(cl_event, cl_int, void*),
+                        void* arg)
+{
+  pthread_mutex_lock(&handle->lock);
+  handle->pending++;
+  pthread_mutex_unlock(&handle->lock);
+
+  const cl_int status = clSetEventCallback(evt, CL_COMPLETE, fn, arg);
+
+  // enqueuing thread's own arrival is still pending, so this can't be last one
+  pthread_mutex_lock(&handle->lock);
+  if (status == CL_SUCCESS) {
+    handle->registered++;
+  } else {
+    handle->pending--;
+  }
+  pthread_mutex_unlock(&handle->lock);
+
+  return status;
+}
+
+// Waits for each of `cnt` -many events, which were created i.e. non-NULL
+void
+merklize_async_wait_events(const cl_event* evts, size_t cnt)
+{
+  for (size_t i = 0; evts != NULL && i < cnt; i++) {
+    if (*(evts + i) != NULL) {
+      clWaitForEvents(1, evts + i);
+    }
+  }
+}
+
+// Releases each of `cnt` -many events, which were created i.e. non-NULL
+void
+merklize_async_release_events(const cl_event* evts, size_t cnt)
+{
+  for (size_t i = 0; evts != NULL && i < cnt; i++) {
+    if (*(evts + i) != NULL) {
+      clReleaseEvent(*(evts + i));
+    }
+  }
+}
+
+// Releases all opencl resources & heap allocations held by handle, skipping
+// ones which were never acquired, when tree build failed while being enqueued
+void
+merklize_async_free(merklize_async_t* const handle)
+{
+  const size_t rounds = handle->rounds;
+  const size_t tmp_cnt = handle->tmp_bufs != NULL ? (rounds + 1) << 1 : 0;
+
+  merklize_async_release_events(&handle->evt_0, 1);
+  merklize_async_release_events(&handle->evt_4, 1);
+  merklize_async_release_events(handle->seg_evts, handle->seg_cnt);
+  merklize_async_release_events(handle->read_evts, handle->group_cnt);
+  merklize_async_release_events(handle->round_evts, rounds + 1);
+  merklize_async_release_events(handle->tmp_evts, tmp_cnt);
+
+  for (size_t i = 0; i < tmp_cnt; i++) {
+    if (*(handle->tmp_bufs + i) != NULL) {
+      clReleaseMemObject(*(handle->tmp_bufs + i));
+    }
+  }
+
+  pthread_mutex_destroy(&handle->lock);
+  pthread_cond_destroy(&handle->cond);
+
+  if (handle->arena != NULL) {
+    // handed back to arena, for being reused by later builds
+    for (size_t i = 0; i < 4; i++) {
+      if (handle->arena_bufs[i] != NULL) {
+        arena_release(handle->arena, handle->arena_bufs[i]);
+      }
+    }
+
+    for (size_t i = 0; handle->group_arena_bufs != NULL &&
+                       i < handle->group_cnt;
+         i++) {
+      if (*(handle->group_arena_bufs + i) != NULL) {
+        arena_release(handle->arena, *(handle->group_arena_bufs + i));
+      }
+    }
+  } else {
+    for (size_t i = 0; handle->group_bufs != NULL && i < handle->group_cnt;
+         i++) {
+      if (*(handle->group_bufs + i) != NULL) {
+        clReleaseMemObject(*(handle->group_bufs + i));
+      }
+    }
+
+    if (handle->i_buf != NULL) {
+      clReleaseMemObject(handle->i_buf);
+    }
+    if (handle->itmd_buf != NULL) {
+      clReleaseMemObject(handle->itmd_buf);
+    }
+
+    free(handle->i_buf_ptr);
+    free(handle->itmd_buf_ptr);
+  }
+
+  // release all heap allocation
+  free(handle->offsets);
+  free(handle->round_evts);
+  free(handle->seg_evts);
+  free(handle->read_evts);
+  free(handle->levels);
+  free(handle->group_bufs);
+  free(handle->group_arena_bufs);
+  free(handle->tmp_evts);
+  free(handle->tmp_bufs);
+  free(handle);
+}
+
+// Device buffer holding intermediate nodes of given group of levels, where
+// node at index `first` of group lives at its beginning
+cl_mem*
+merklize_async_group_buf(merklize_async_t* const handle, size_t g)
+{
+  return handle->streaming ? handle->group_bufs + g : &handle->itmd_buf;
+}
+
+// Enqueues all commands of tree build, whose handle is already initialized,
+// returning on first failure, leaving whatever is already acquired/ enqueued
+// in handle, for caller to tear down
+cl_int
+merklize_async_enqueue(cl_context ctx,
+                       cl_command_queue cq,
+                       cl_kernel krnl,
+                       const merklize_iov_t* iov,
+                       size_t iov_cnt,
+                       size_t leaf_count,
+                       size_t wg_size,
+                       const merklize_opts_t* opts,
+                       merklize_async_t* const h)
+{
+  const size_t i_size = leaf_count << 5;
+  const size_t seg_cnt = h->seg_cnt;
+
+  cl_int status;
+
+  const cl_ulong t0 = h->started;
+  cl_ulong convert_ns = 0;
+  cl_ulong api_calls = 0;
+  cl_ulong host_allocs = 0;
+
+  // converting 4 contiguous little endian bytes to `cl_uint`
+  const size_t itmd_buf_elm_cnt = i_size >> 2;
+  const size_t itmd_buf_size = itmd_buf_elm_cnt << 2; // in bytes
+
+  // on little endian host, four contiguous little endian bytes already are
+  // `cl_uint` they encode, so input can be transferred to device & output
+  // can be transferred back to host, as is; otherwise segments are gathered
+  // in staging buffer, at same offsets as they're written to on device
+  int staged = 0;
+  void* o_dst = h->output;
+
+  // when streaming, levels are read back in groups, otherwise all of them
+  // together, once root is computed
+  h->streaming = opts != NULL && opts->stream_levels != 0;
+  h->on_level = opts != NULL ? opts->on_level : NULL;
+  h->level_data = opts != NULL ? opts->level_data : NULL;
+
+  if (h->arena != NULL) {
+    for (size_t i = 0; i < 4; i++) {
+      // groups' own buffers are acquired, in place of intermediate one
+      if (i == 1 && h->streaming) {
+        continue;
+      }
+
+      status = arena_acquire(h->arena,
+                             i < 2 ? ARENA_DEVICE : ARENA_HOST,
+                             i_size,
+                             h->arena_bufs + i);
+      check_for_error_and_return(status);
+    }
+
+    h->i_buf = h->arena_bufs[0]->mem;
+    h->itmd_buf = h->streaming ? NULL : h->arena_bufs[1]->mem;
+
+    // pinned staging buffers, input is copied ( and converted, if required )
+    // into first one, while second one receives intermediate nodes
+    h->i_buf_ptr = (cl_uint*)h->arena_bufs[2]->host;
+    h->itmd_buf_ptr = (cl_uint*)h->arena_bufs[3]->host;
+
+    staged = 1;
+    o_dst = h->itmd_buf_ptr;
+  } else if (!host_is_little_endian()) {
+    // input byte array to be stored as `cl_uint *` on host, which will
+    // be later explicitly transferred to device
+    h->i_buf_ptr = (cl_uint*)metrics_count(host_allocs, malloc(i_size));
+    check_mem_alloc(h->i_buf_ptr);
+
+    // allocating enough memory on heap for storing all intermediate nodes of
+    // merkle tree
+    h->itmd_buf_ptr =
+      (cl_uint*)metrics_count(host_allocs, malloc(itmd_buf_size));
+    check_mem_alloc(h->itmd_buf_ptr);
+
+    staged = 1;
+    o_dst = h->itmd_buf_ptr;
+  }
+
+  if (staged) {
+    const cl_ulong t1 = metrics_now_ns();
+
+    // converting large input byte array into `uint *`, where each resulting
+    // `uint` is obtained by intepreting four contiguous bytes in little endian
+    // order; on little endian host, it's just a copy
+    cl_uchar* dst = (cl_uchar*)h->i_buf_ptr;
+    for (size_t i = 0; i < iov_cnt; i++) {
+      const size_t size = (iov + i)->leaf_count << 5;
+
+      if (host_is_little_endian()) {
+        memcpy(dst, (iov + i)->ptr, size);
+      } else {
+        words_from_le_bytes((iov + i)->ptr, size, (cl_uint*)dst, size >> 2);
+      }
+      dst += size;
+    }
+
+    convert_ns += metrics_now_ns() - t1;
+  }
+
+  // these many rounds of kernel dispatches are still required for computing
+  // whole merkle tree
+  const size_t rounds = (size_t)log2((double)(leaf_count >> 1));
+  h->rounds = rounds;
+
+  // one pair of offsets for first kernel dispatch & then one pair per round;
+  // each offset lives in its own buffer, in device's constant memory space
+  h->offsets = (size_t*)metrics_count(
+    host_allocs, malloc(sizeof(size_t) * ((rounds + 1) << 1)));
+  check_mem_alloc(h->offsets);
+  h->tmp_bufs = (cl_mem*)metrics_count(
+    host_allocs, calloc((rounds + 1) << 1, sizeof(cl_mem)));
+  check_mem_alloc(h->tmp_bufs);
+  h->tmp_evts = (cl_event*)metrics_count(
+    host_allocs, calloc((rounds + 1) << 1, sizeof(cl_event)));
+  check_mem_alloc(h->tmp_evts);
+
+  // these are events obtained as result of enqueuing kernel execution commands,
+  // computing intermediate nodes of binary merkle tree
+  //
+  // these events will be used later, when all computation is done, for finding
+  // out total execution time of kernel
+  h->round_evts = (cl_event*)metrics_count(
+    host_allocs, calloc(rounds + 1, sizeof(cl_event)));
+  check_mem_alloc(h->round_evts);
+  h->seg_evts =
+    (cl_event*)metrics_count(host_allocs, calloc(seg_cnt, sizeof(cl_event)));
+  check_mem_alloc(h->seg_evts);
+
+  const size_t group_levels = h->streaming ? opts->stream_levels : rounds + 1;
+  h->group_cnt = (rounds + group_levels) / group_levels;
+
+  h->levels = (merklize_level_t*)metrics_count(
+    host_allocs, malloc(sizeof(merklize_level_t) * h->group_cnt));
+  check_mem_alloc(h->levels);
+  h->read_evts = (cl_event*)metrics_count(
+    host_allocs, calloc(h->group_cnt, sizeof(cl_event)));
+  check_mem_alloc(h->read_evts);
+
+  // level written in round r lives at [(N / 2) >> r, N >> r) & topmost group
+  // also takes node slot 0, so that without streaming, there's one group,
+  // covering whole intermediate nodes buffer
+  for (size_t g = 0; g < h->group_cnt; g++) {
+    const size_t r0 = g * group_levels;
+    const size_t r1 =
+      (r0 + group_levels < rounds + 1 ? r0 + group_levels : rounds + 1) - 1;
+
+    merklize_level_t* const level = h->levels + g;
+    level->handle = h;
+    level->from = r0 + 1;
+    level->to = r1 + 1;
+    level->first = r1 == rounds ? 0 : (leaf_count >> 1) >> r1;
+    level->count = (leaf_count >> r0) - level->first;
+  }
+
+  if (h->streaming) {
+    h->group_bufs = (cl_mem*)metrics_count(
+      host_allocs, calloc(h->group_cnt, sizeof(cl_mem)));
+    check_mem_alloc(h->group_bufs);
+
+    if (h->arena != NULL) {
+      h->group_arena_bufs = (arena_buf_t**)metrics_count(
+        host_allocs, calloc(h->group_cnt, sizeof(arena_buf_t*)));
+      check_mem_alloc(h->group_arena_bufs);
+    }
+
+    for (size_t g = 0; g < h->group_cnt; g++) {
+      const size_t size = (h->levels + g)->count << 5;
+
+      if (h->arena != NULL) {
+        status = arena_acquire(
+          h->arena, ARENA_DEVICE, size, h->group_arena_bufs + g);
+        check_for_error_and_return(status);
+
+        *(h->group_bufs + g) = (*(h->group_arena_bufs + g))->mem;
+      } else {
+        *(h->group_bufs + g) = metrics_count(
+          api_calls,
+          clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, NULL, &status));
+        check_for_error_and_return(status);
+      }
+    }
+  }
+
+  if (h->arena == NULL) {
+    // input leaf nodes to be transferred to this buffer, allocated on device
+    h->i_buf = metrics_count(
+      api_calls,
+      clCreateBuffer(ctx, CL_MEM_READ_ONLY, i_size, NULL, &status));
+    check_for_error_and_return(status);
+    // all intermediate nodes of merkle tree to be kept in this buffer,
+    // allocated on device
+    //
+    // note, r/ w flag mentioned on this buffer, because in certain kernel
+    // dispatch rounds I'll pass this same buffer as both input & output to
+    // `merklize` kernel
+    if (!h->streaming) {
+      h->itmd_buf = metrics_count(
+        api_calls,
+        clCreateBuffer(ctx, CL_MEM_READ_WRITE, itmd_buf_size, NULL, &status));
+      check_for_error_and_return(status);
+    }
+  }
+
+  const cl_ulong t2 = metrics_now_ns();
+
+  // transfering input bytes ( actually it's `uint *` ) to device, segment by
+  // segment, each at its own offset
+  size_t offset = 0;
+  for (size_t i = 0, j = 0; i < iov_cnt; i++) {
+    const size_t size = (iov + i)->leaf_count << 5;
+    if (size == 0) {
+      continue;
+    }
+
+    const void* src =
+      staged ? (const void*)((cl_uchar*)h->i_buf_ptr + offset) : (iov + i)->ptr;
+
+    status = metrics_count(
+      api_calls,
+      clEnqueueWriteBuffer(
+        cq, h->i_buf, CL_FALSE, offset, size, src, 0, NULL, h->seg_evts + j++));
+    check_for_error_and_return(status);
+
+    offset += size;
+  }
+
+  // so that kernel dispatch depends on one event, irrespective of # -of
+  // segments
+  status = metrics_count(
+    api_calls,
+    clEnqueueMarkerWithWaitList(cq, seg_cnt, h->seg_evts, &h->evt_0));
+  check_for_error_and_return(status);
+
+  for (size_t r = 0; r <= rounds; r++) {
+    // first round reads leaf nodes from input buffer, while rest of them read
+    // previous level from buffer of its group
+    const merklize_level_t* src_level = h->levels + (r == 0 ? 0 : r - 1) /
+                                                      group_levels;
+    const merklize_level_t* dst_level = h->levels + r / group_levels;
+
+    cl_mem* const src =
+      r == 0 ? &h->i_buf : merklize_async_group_buf(h, (r - 1) / group_levels);
+    cl_mem* const dst = merklize_async_group_buf(h, r / group_levels);
+
+    size_t* const i_offset_ = h->offsets + (r << 1) + 0;
+    size_t* const itmd_offset_ = h->offsets + (r << 1) + 1;
+
+    // in terms of `cl_uint`s, relative to beginning of group's buffer
+    *i_offset_ =
+      r == 0 ? 0 : (((leaf_count >> 1) >> (r - 1)) - src_level->first) << 3;
+    *itmd_offset_ = (((leaf_count >> 1) >> r) - dst_level->first) << 3;
+
+    for (size_t j = 0; j < 2; j++) {
+      cl_mem buf = metrics_count(
+        api_calls,
+        clCreateBuffer(ctx, CL_MEM_READ_ONLY, sizeof(size_t), NULL, &status));
+      check_for_error_and_return(status);
+
+      *(h->tmp_bufs + (r << 1) + j) = buf;
+
+      // transferring constant i.e. offset to input/ output buffer, to
+      // device's constant memory space
+      status = metrics_count(api_calls,
+                             clEnqueueWriteBuffer(cq,
+                                                  buf,
+                                                  CL_FALSE,
+                                                  0,
+                                                  sizeof(size_t),
+                                                  h->offsets + (r << 1) + j,
+                                                  0,
+                                                  NULL,
+                                                  h->tmp_evts + (r << 1) + j));
+      check_for_error_and_return(status);
+    }
+
+    // preparing kernel dispatch, setting kernel arguments ( `merklize`
+    // kernel ), which are captured when kernel is enqueued
+    metrics_count(api_calls, clSetKernelArg(krnl, 0, sizeof(cl_mem), src));
+    metrics_count(
+      api_calls,
+      clSetKernelArg(krnl, 1, sizeof(cl_mem), h->tmp_bufs + (r << 1) + 0));
+    metrics_count(api_calls, clSetKernelArg(krnl, 2, sizeof(cl_mem), dst));
+    metrics_count(
+      api_calls,
+      clSetKernelArg(krnl, 3, sizeof(cl_mem), h->tmp_bufs + (r << 1) + 1));
+
+    size_t glb_work_items[] = { (leaf_count >> 1) >> r };
+    size_t loc_work_items[] = { glb_work_items[0] >= wg_size
+                                  ? wg_size
+                                  : glb_work_items[0] };
+
+    // first round depends on input leaf nodes, rest of them on previous
+    // round, so that compute dependency graph can be constructed
+    cl_event evts_0[] = { *(h->tmp_evts + (r << 1) + 0),
+                          *(h->tmp_evts + (r << 1) + 1),
+                          r == 0 ? h->evt_0 : *(h->round_evts + r - 1) };
+
+    status = metrics_count(api_calls,
+                           clEnqueueNDRangeKernel(cq,
+                                                  krnl,
+                                                  1,
+                                                  NULL,
+                                                  glb_work_items,
+                                                  loc_work_items,
+                                                  3,
+                                                  evts_0,
+                                                  h->round_evts + r));
+    check_for_error_and_return(status);
+  }
+
+  // intermediate nodes of merkle tree being copied back to host, group by
+  // group, each one whole buffer of its own, so that without streaming, all
+  // of them are read back at once
+  size_t d2h_bytes = 0;
+
+  for (size_t g = 0; g < h->group_cnt; g++) {
+    merklize_level_t* const level = h->levels + g;
+    const size_t r1 = level->to - 1;
+
+    // topmost level of group is written last, as each round depends on
+    // previous one
+    status =
+      metrics_count(api_calls,
+                    clEnqueueReadBuffer(cq,
+                                        *merklize_async_group_buf(h, g),
+                                        CL_FALSE,
+                                        0,
+                                        level->count << 5,
+                                        (cl_uchar*)o_dst + (level->first << 5),
+                                        1,
+                                        h->round_evts + r1,
+                                        h->read_evts + g));
+    check_for_error_and_return(status);
+
+    // registration is one `clSetEventCallback( ... )`
+    if (h->streaming) {
+      status = metrics_count(
+        api_calls,
+        merklize_async_register(
+          h, *(h->read_evts + g), merklize_async_on_level, level));
+      check_for_error_and_return(status);
+    }
+
+    d2h_bytes += level->count << 5;
+  }
+
+  // so that completion of tree build is denoted by one event, irrespective of
+  // # -of groups
+  if (h->group_cnt == 1) {
+    h->evt_4 = *h->read_evts;
+    status = metrics_count(api_calls, clRetainEvent(h->evt_4));
+  } else {
+    status = metrics_count(
+      api_calls,
+      clEnqueueMarkerWithWaitList(cq, h->group_cnt, h->read_evts, &h->evt_4));
+  }
+  check_for_error_and_return(status);
+
+  status = metrics_count(
+    api_calls,
+    merklize_async_register(h, h->evt_4, merklize_async_on_complete, h));
+  check_for_error_and_return(status);
+
+  // so that enqueued commands get submitted to device, without anyone waiting
+  // on them
+  status = metrics_count(api_calls, clFlush(cq));
+  check_for_error_and_return(status);
+
+  // everything but timing, which is only known once tree is built; callbacks
+  // registered above may already be adding their conversion time, so it's
+  // filled in under lock
+  pthread_mutex_lock(&h->lock);
+
+  merklize_metrics_t* const m = &h->m;
+  const size_t offsets_size = sizeof(size_t) * ((rounds + 1) << 1);
+
+  m->calls = 1;
+  m->leaves = leaf_count;
+  m->h2d_bytes = i_size + offsets_size;
+  m->d2h_bytes = d2h_bytes;
+  m->host_allocs += host_allocs;
+  m->host_bytes = sizeof(merklize_async_t) + offsets_size +
+                  (sizeof(cl_mem) + sizeof(cl_event)) * ((rounds + 1) << 1) +
+                  sizeof(cl_event) * (rounds + 1 + seg_cnt + h->group_cnt) +
+                  sizeof(merklize_level_t) * h->group_cnt +
+                  (h->group_bufs != NULL ? sizeof(cl_mem) * h->group_cnt : 0) +
+                  (h->group_arena_bufs != NULL
+                     ? sizeof(arena_buf_t*) * h->group_cnt
+                     : 0) +
+                  (h->arena == NULL && staged ? i_size + itmd_buf_size : 0);
+  m->dev_bytes = i_size + itmd_buf_size + offsets_size;
+  m->buffers = ((rounds + 1) << 1) +
+               (h->arena == NULL ? 1 + (h->streaming ? h->group_cnt : 1) : 0);
+  m->api_calls = api_calls;
+  m->kernels = rounds + 1;
+  m->peak_bytes = m->host_bytes + m->dev_bytes +
+                  (h->arena != NULL ? i_size + itmd_buf_size : 0);
+  m->phase_ns[METRICS_ALLOC] = t2 - t0 - convert_ns;
+  m->phase_ns[METRICS_CONVERT] += convert_ns;
+  m->phase_ns[METRICS_ENQUEUE] = metrics_now_ns() - t2;
+
+  pthread_mutex_unlock(&h->lock);
+
+  return CL_SUCCESS;
+}
+
+// Same as `merklize_async( ... )`, but N leaf nodes are gathered from
+// `iov_cnt` -many segments, concatenated in order, whose leaf counts sum up to
+// N, so that leaves living in many separate buffers ( e.g. per-shard arrays,
+// network receive buffers ) needn't be copied into one contiguous input first
 //
-// Expects to get access to OpenCL queue which has enabled out of order
-// execution of dispatched kernels
+// Each non-empty segment is uploaded using its own write, at its offset in
+// device buffer; writes don't depend on each other, so out of order queue may
+// run them concurrently, while first kernel dispatch waits for all of them.
+// When input is staged through host buffers ( on big endian host, or using
+// arena ), segments are copied/ converted straight into staging buffer.
 //
-// This function also need to time execution of commands using OpenCL event
-// profiling, which calls for profiling enabled queue
+// All segments must remain valid till tree is built
+//
+// When enqueuing fails before any completion callback is registered, commands
+// already enqueued are waited on, everything is released & error is returned,
+// leaving `*handle` NULL. Once a callback is registered, handle can't be torn
+// down from under it, so failure is instead reported through handle, same as
+// failure of an enqueued command i.e. `*handle` is set & CL_SUCCESS returned.
 cl_int
-merklize(cl_context ctx,
-         cl_command_queue cq,
-         cl_kernel krnl,
-         const cl_uchar* input,
-         size_t i_size, // in bytes
-         size_t leaf_count,
-         cl_uchar* const output,
-         size_t o_size, // in bytes
-         size_t wg_size,
-         cl_ulong* const ts)
+merklize_async_iov(cl_context ctx,
+                   cl_command_queue cq,
+                   cl_kernel krnl,
+                   const merklize_iov_t* iov,
+                   size_t iov_cnt,
+                   size_t leaf_count,
+                   cl_uchar* const output,
+                   size_t o_size, // in bytes
+                   size_t wg_size,
+                   merklize_callback_t cb,
+                   void* user_data,
+                   const merklize_opts_t* opts,
+                   merklize_async_t** const handle)
 {
+  const size_t i_size = leaf_count << 5;
+
+  size_t seg_leaves = 0;
+  size_t seg_cnt = 0;
+  for (size_t i = 0; i < iov_cnt; i++) {
+    seg_leaves += (iov + i)->leaf_count;
+    seg_cnt += (iov + i)->leaf_count > 0;
+  }
+  assert(seg_leaves == leaf_count);
+
   // binary merkle tree with N leaf nodes is input, where N = 2 ^ i
   // there will be (N - 1) intermediate nodes, to be computed in this function
   //
@@ -29,9 +839,6 @@ merklize(cl_context ctx,
   // as return value, allocation size of output is same as input
   assert(i_size == o_size);
 
-  // because each leaf node of Merkle Tree will be of width 32 -bytes
-  assert(leaf_count << 5 == i_size);
-
   // power of 2 many leaf nodes in binary merkle tree
   assert((leaf_count & (leaf_count - 1)) == 0);
   // initially requested work group size should also be
@@ -45,266 +852,717 @@ merklize(cl_context ctx,
   assert((leaf_count >> 1) >= wg_size);
   assert((leaf_count >> 1) % wg_size == 0);
 
-  cl_int status;
+  merklize_async_t* const h =
+    (merklize_async_t*)calloc(1, sizeof(merklize_async_t));
+  check_mem_alloc(h);
 
-  // notice they are initialized !
-  cl_ulong exec_tm = 0; // total kernel execution time
-  cl_ulong h2d_tm = 0;  // total time spent in moving data from host to device
-  cl_ulong d2h_tm = 0;  // total time spent in moving data to host from device
+  h->m.host_allocs = 1; // handle itself
+  h->started = metrics_now_ns();
+  h->metrics = opts != NULL ? opts->metrics : NULL;
 
-  // converting 4 contiguous little endian bytes to `cl_uint`
-  const size_t i_buf_elm_cnt = i_size >> 2;
-  const size_t itmd_buf_elm_cnt = i_size >> 2;
-  const size_t itmd_buf_size = itmd_buf_elm_cnt << 2; // in bytes
+  h->output = output;
+  h->o_size = o_size;
+  h->trace = opts != NULL ? opts->trace : NULL;
+  h->arena = opts != NULL ? opts->arena : NULL;
+  h->cb = cb;
+  h->user_data = user_data;
+  h->seg_cnt = seg_cnt;
+  h->pending = 1; // of enqueuing thread itself
+  pthread_mutex_init(&h->lock, NULL);
+  pthread_cond_init(&h->cond, NULL);
 
-  // input byte array to be stored as `cl_uint *` on host, which will
-  // be later explicitly transferred to device
-  cl_uint* i_buf_ptr = (cl_uint*)malloc(i_size);
+  const cl_int status = merklize_async_enqueue(
+    ctx, cq, krnl, iov, iov_cnt, leaf_count, wg_size, opts, h);
 
-  // converting large input byte array into `uint *`, where each resulting
-  // `uint` is obtained by intepreting four contiguous bytes in little endian
-  // order
-  words_from_le_bytes(input, i_size, i_buf_ptr, i_buf_elm_cnt);
+  if (status != CL_SUCCESS && h->registered == 0) {
+    const size_t tmp_cnt = h->tmp_evts != NULL ? (h->rounds + 1) << 1 : 0;
 
-  // allocating enough memory on heap for storing all intermediate nodes of
-  // merkle tree
-  cl_uint* itmd_buf_ptr = (cl_uint*)malloc(itmd_buf_size);
+    // nothing else refers to handle, once enqueued commands are done
+    merklize_async_wait_events(&h->evt_0, 1);
+    merklize_async_wait_events(&h->evt_4, 1);
+    merklize_async_wait_events(h->seg_evts, seg_cnt);
+    merklize_async_wait_events(h->read_evts, h->group_cnt);
+    merklize_async_wait_events(h->round_evts, h->rounds + 1);
+    merklize_async_wait_events(h->tmp_evts, tmp_cnt);
 
-  const size_t i_offset = 0;
-  const size_t itmd_offset = itmd_buf_elm_cnt >> 1;
+    merklize_async_free(h);
 
-  // input leaf nodes to be transferred to this buffer, allocated on device
-  cl_mem i_buf = clCreateBuffer(ctx, CL_MEM_READ_ONLY, i_size, NULL, &status);
-  // all intermediate nodes of merkle tree to be kept in this buffer, allocated
-  // on device
-  //
-  // note, r/ w flag mentioned on this buffer, because in certain kernel
-  // dispatch rounds I'll pass this same buffer as both input & output to
-  // `merklize` kernel
-  cl_mem itmd_buf =
-    clCreateBuffer(ctx, CL_MEM_READ_WRITE, itmd_buf_size, NULL, &status);
-  // following two buffers allocated on device to be kept in constant memory
-  cl_mem i_offset_buf =
-    clCreateBuffer(ctx, CL_MEM_READ_ONLY, sizeof(size_t), NULL, &status);
-  cl_mem itmd_offset_buf =
-    clCreateBuffer(ctx, CL_MEM_READ_ONLY, sizeof(size_t), NULL, &status);
-
-  // transfering input bytes ( actually it's `uint *` ) to device
-  cl_event evt_0;
-  clEnqueueWriteBuffer(
-    cq, i_buf, CL_FALSE, 0, i_size, i_buf_ptr, 0, NULL, &evt_0);
-
-  // transferring constant i.e. offset to input buffer, to device's constant
-  // memory space
-  cl_event evt_1;
-  clEnqueueWriteBuffer(
-    cq, i_offset_buf, CL_FALSE, 0, sizeof(size_t), &i_offset, 0, NULL, &evt_1);
-
-  // transferring constant i.e. offset to intermediate nodes buffer, to device's
-  // constant memory space
-  cl_event evt_2;
-  clEnqueueWriteBuffer(cq,
-                       itmd_offset_buf,
-                       CL_FALSE,
-                       0,
-                       sizeof(size_t),
-                       &itmd_offset,
-                       0,
-                       NULL,
-                       &evt_2);
-
-  // preparing kernel dispatch, setting kernel arguments ( `merklize` kernel )
-  clSetKernelArg(krnl, 0, sizeof(cl_mem), &i_buf);
-  clSetKernelArg(krnl, 1, sizeof(cl_mem), &i_offset_buf);
-  clSetKernelArg(krnl, 2, sizeof(cl_mem), &itmd_buf);
-  clSetKernelArg(krnl, 3, sizeof(cl_mem), &itmd_offset_buf);
-
-  size_t glb_work_items[] = { leaf_count >> 1 };
-  size_t loc_work_items[] = { wg_size };
-  cl_event evts_0[] = { evt_0, evt_1, evt_2 };
-
-  // dispatching kernel for computing intermediate nodes living just above
-  // merkle tree leaf nodes ( which are provided as input )
-  cl_event evt_3;
-  clEnqueueNDRangeKernel(
-    cq, krnl, 1, NULL, glb_work_items, loc_work_items, 3, evts_0, &evt_3);
+    *handle = NULL;
+    return status;
+  }
 
-  // these many rounds of kernel dispatches are still required for computing
-  // whole merkle tree
-  const size_t rounds = (size_t)log2((double)(leaf_count >> 1));
+  // when enqueuing failed midway, commands whose callbacks are registered
+  // may not be submitted yet; without flushing, those callbacks may never
+  // fire, so neither would waiters on handle ever wake up
+  if (status != CL_SUCCESS) {
+    clFlush(cq);
+  }
 
-  // these are events obtained as result of enqueuing kernel execution commands,
-  // computing intermediate nodes of binary merkle tree
+  // enqueuing thread arrives last of all, so that tree isn't considered built
+  // before all callbacks are registered
+  *handle = h;
+  merklize_async_arrive(h, status, 0);
+
+  return CL_SUCCESS;
+}
+
+// Given a N -many leaf nodes of some binary merkle tree, this function
+// enqueues all commands required for constructing all intermediate nodes of
+// tree, including root of merkle tree, and returns without waiting for them
+// to complete, setting `handle`
+//
+// Completion can be observed by polling ( see `merklize_async_poll( ... )` ),
+// by blocking ( see `merklize_async_wait( ... )` ) or via `cb`, which is
+// invoked with `user_data`, on completion; `cb` can be NULL
+//
+// Both `input` & `output` must remain valid till tree is built, and handle
+// must be released using `merklize_async_release( ... )`, which releases all
+// resources acquired for building tree
+//
+// Several trees can be kept in flight, from same host thread, on same out of
+// order queue, so that upload/ compute/ readback of them can overlap
+//
+// When `opts->arena` is set, device buffers are reused across calls & input/
+// output are staged through pinned host buffers of arena, which costs one
+// host side copy of each, but makes transfers to/ from device faster and
+// avoids fresh allocations/ page faults for every tree
+//
+// When `opts->stream_levels` is set, lower levels ( which hold most of the
+// nodes ) are read back while upper ones are still being computed, so that
+// readback is mostly hidden behind compute, instead of following it; and
+// consumers ( say, ones persisting or serving proofs ) can start on them
+// early, via `opts->on_level`. Output is complete only once tree is built.
+//
+// Expects to get access to OpenCL queue which has enabled out of order
+// execution of dispatched kernels
+//
+// This function also need to time execution of commands using OpenCL event
+// profiling, which calls for profiling enabled queue
+//
+// See `merklize_opts_t` for optional knobs, `opts` can be NULL
+cl_int
+merklize_async(cl_context ctx,
+               cl_command_queue cq,
+               cl_kernel krnl,
+               const cl_uchar* input,
+               size_t i_size, // in bytes
+               size_t leaf_count,
+               cl_uchar* const output,
+               size_t o_size, // in bytes
+               size_t wg_size,
+               merklize_callback_t cb,
+               void* user_data,
+               const merklize_opts_t* opts,
+               merklize_async_t** const handle)
+{
+  // because each leaf node of Merkle Tree will be of width 32 -bytes
+  assert(leaf_count << 5 == i_size);
+
+  const merklize_iov_t iov = { .ptr = input, .leaf_count = leaf_count };
+
+  return merklize_async_iov(ctx,
+                            cq,
+                            krnl,
+                            &iov,
+                            1,
+                            leaf_count,
+                            output,
+                            o_size,
+                            wg_size,
+                            cb,
+                            user_data,
+                            opts,
+                            handle);
+}
+
+// Returns truth value of whether tree build is complete
+int
+merklize_async_poll(merklize_async_t* const handle)
+{
+  pthread_mutex_lock(&handle->lock);
+  const int done = handle->done;
+  pthread_mutex_unlock(&handle->lock);
+
+  return done;
+}
+
+// Event of last command of tree build, which can be waited on by commands
+// enqueued later, on same context; it stays owned by handle
+cl_event
+merklize_async_event(const merklize_async_t* handle)
+{
+  return handle->evt_4;
+}
+
+// Blocks until tree build is complete, returning its status; on success, `ts`
+// is set with sum of kernel execution/ host to device data tx/ device to host
+// data tx times, in nanoseconds, same as `merklize( ... )` does; `ts` can be
+// NULL
+cl_int
+merklize_async_wait(merklize_async_t* const handle, cl_ulong* const ts)
+{
+  pthread_mutex_lock(&handle->lock);
+  while (!handle->done) {
+    pthread_cond_wait(&handle->cond, &handle->lock);
+  }
+
+  // first waiter collects timestamps, commits metrics & records trace, while
+  // others wait on lock, so that it's done exactly once, before any of them
+  // returns
+  if (handle->status == CL_SUCCESS && !handle->finished) {
+    const size_t rounds = handle->rounds;
+
+    // notice they are initialized !
+    cl_ulong exec_tm = 0; // total kernel execution time
+    cl_ulong h2d_tm = 0;  // total time spent in moving data from host to device
+    cl_ulong d2h_tm = 0;  // total time spent in moving data to host from device
+
+    // just a temporary variable for holding a specific opencl command
+    // execution time
+    cl_ulong tmp;
+
+    // sum of execution time of kernels with nanosecond level of granularity
+    for (size_t i = 0; i < rounds + 1; i++) {
+      tmp = 0;
+      time_event(*(handle->round_evts + i), &tmp);
+      exec_tm += tmp;
+    }
+
+    // calculating sum of time ( in nanosecond level granularity ) spent
+    // transferring data from host to device
+    // input leaf nodes transfer cost, segment by segment
+    for (size_t i = 0; i < handle->seg_cnt; i++) {
+      tmp = 0;
+      time_event(*(handle->seg_evts + i), &tmp);
+      h2d_tm += tmp;
+    }
+
+    // during multiple rounds of kernel dispatch constants needs to be set for
+    // denoting offset into buffer from where input can be read or output can
+    // be written to
+    for (size_t i = 0; i < (rounds + 1) << 1; i++) {
+      tmp = 0;
+      time_event(*(handle->tmp_evts + i), &tmp);
+      h2d_tm += tmp;
+    }
+
+    // calculating total device to host data transfer cost
+    //
+    // this is the only time when device to host data transfer is required !
+    for (size_t i = 0; i < handle->group_cnt; i++) {
+      tmp = 0;
+      time_event(*(handle->read_evts + i), &tmp); // intermediate node tx cost
+      d2h_tm += tmp;
+    }
+
+    handle->ts[0] = exec_tm; // sum of kernel execution times
+    handle->ts[1] = h2d_tm;  // sum of host to device data tx time
+    handle->ts[2] = d2h_tm;  // sum of device to host data tx time
+
+    if (handle->metrics != NULL) {
+      handle->m.phase_ns[METRICS_H2D] = h2d_tm;
+      handle->m.phase_ns[METRICS_KERNEL] = exec_tm;
+      handle->m.phase_ns[METRICS_D2H] = d2h_tm;
+
+      metrics_commit(handle->metrics, &handle->m);
+    }
+
+    // record timeline of all commands, level by level, where level denotes
+    // height of tree level being written by command ( leaves at 0 )
+    if (handle->trace != NULL) {
+      trace_t* const trace = handle->trace;
+      trace_begin_tree(trace);
+
+      for (size_t i = 0; i < handle->seg_cnt; i++) {
+        trace_record(trace, *(handle->seg_evts + i), "write", 0);
+      }
+
+      for (size_t i = 0; i < rounds + 1; i++) {
+        trace_record(trace, *(handle->tmp_evts + (i << 1) + 0), "write", i + 1);
+        trace_record(trace, *(handle->tmp_evts + (i << 1) + 1), "write", i + 1);
+        trace_record(trace, *(handle->round_evts + i), "kernel", i + 1);
+      }
+
+      // when streaming, read of each group is attributed to its lowest level
+      for (size_t i = 0; i < handle->group_cnt; i++) {
+        trace_record(trace,
+                     *(handle->read_evts + i),
+                     "read",
+                     handle->streaming ? (cl_long)(handle->levels + i)->from
+                                       : -1);
+      }
+    }
+
+    handle->finished = 1;
+  }
+
+  if (ts != NULL) {
+    memcpy(ts, handle->ts, sizeof(handle->ts));
+  }
+
+  const cl_int status = handle->status;
+  pthread_mutex_unlock(&handle->lock);
+
+  return status;
+}
+
+// Waits for tree build to complete ( if not already ) & releases all opencl
+// resources & heap allocations acquired during course of building it
+void
+merklize_async_release(merklize_async_t* const handle)
+{
+  merklize_async_wait(handle, NULL);
+  merklize_async_free(handle);
+}
+
+// Given a N -many leaf nodes of some binary merkle tree, this function
+// constructs all intermediate nodes of tree, including root of merkle tree,
+// blocking until it's done; see `merklize_async( ... )`, for building it
+// without blocking
+//
+// Expects to get access to OpenCL queue which has enabled out of order
+// execution of dispatched kernels
+//
+// This function also need to time execution of commands using OpenCL event
+// profiling, which calls for profiling enabled queue
+//
+// See `merklize_opts_t` for optional knobs, `opts` can be NULL
+cl_int
+merklize(cl_context ctx,
+         cl_command_queue cq,
+         cl_kernel krnl,
+         const cl_uchar* input,
+         size_t i_size, // in bytes
+         size_t leaf_count,
+         cl_uchar* const output,
+         size_t o_size, // in bytes
+         size_t wg_size,
+         cl_ulong* const ts,
+         const merklize_opts_t* opts)
+{
+  merklize_async_t* handle;
+
+  cl_int status = merklize_async(ctx,
+                                 cq,
+                                 krnl,
+                                 input,
+                                 i_size,
+                                 leaf_count,
+                                 output,
+                                 o_size,
+                                 wg_size,
+                                 NULL,
+                                 NULL,
+                                 opts,
+                                 &handle);
+  check_for_error_and_return(status);
+
+  status = merklize_async_wait(handle, ts);
+  merklize_async_release(handle);
+
+  return status;
+}
+
+// Same as `merklize( ... )`, but N leaf nodes are gathered from `iov_cnt`
+// -many segments, without building one contiguous input; see
+// `merklize_async_iov( ... )`
+cl_int
+merklize_iov(cl_context ctx,
+             cl_command_queue cq,
+             cl_kernel krnl,
+             const merklize_iov_t* iov,
+             size_t iov_cnt,
+             size_t leaf_count,
+             cl_uchar* const output,
+             size_t o_size, // in bytes
+             size_t wg_size,
+             cl_ulong* const ts,
+             const merklize_opts_t* opts)
+{
+  merklize_async_t* handle;
+
+  cl_int status = merklize_async_iov(ctx,
+                                     cq,
+                                     krnl,
+                                     iov,
+                                     iov_cnt,
+                                     leaf_count,
+                                     output,
+                                     o_size,
+                                     wg_size,
+                                     NULL,
+                                     NULL,
+                                     opts,
+                                     &handle);
+  check_for_error_and_return(status);
+
+  status = merklize_async_wait(handle, ts);
+  merklize_async_release(handle);
+
+  return status;
+}
+
+// Waits for commands of `merklize_forest( ... )`, which were enqueued, to
+// complete, before releasing all resources acquired by it, skipping ones which
+// were never acquired; so device never writes into tree after it's handed
+// back to caller, even when build failed midway
+void
+merklize_forest_free(cl_mem buf,
+                     cl_mem* const tmp_bufs,
+                     cl_event* const round_evts,
+                     size_t rounds,
+                     cl_event evt_0,
+                     cl_event evt_1)
+{
+  merklize_async_wait_events(&evt_1, 1);
+  merklize_async_wait_events(&evt_0, 1);
+  merklize_async_wait_events(round_evts, rounds);
+
+  merklize_async_release_events(&evt_0, 1);
+  merklize_async_release_events(&evt_1, 1);
+  merklize_async_release_events(round_evts, rounds);
+
+  for (size_t i = 0; i < (rounds << 1); i++) {
+    if (*(tmp_bufs + i) != NULL) {
+      clReleaseMemObject(*(tmp_bufs + i));
+    }
+  }
+
+  clReleaseMemObject(buf);
+
+  free(tmp_bufs);
+  free(round_evts);
+}
+
+// Reduces forest of equally sized, adjacent subtrees, each having 2 ^ `rounds`
+// leaves, to their roots, in place, by dispatching `rounds` -many kernels,
+// each one hashing whole level of all subtrees together
+//
+// Tree is laid out same as `merklize_inplace( ... )` expects, i.e. 2N nodes,
+// where N leaves ( of all subtrees, concatenated ) live at [N, 2N) & level l
+// of all subtrees live at [N >> l, 2N >> l); so roots of subtrees end up at
+// [N >> rounds, 2N >> rounds). Because subtrees are aligned, two adjacent
+// nodes paired up at any level always belong to same subtree.
+//
+// N must be multiple of 2 ^ `rounds`, though it needn't be power of 2, so
+// unrelated trees of same size can be merklized together, using one kernel
+// dispatch per level, instead of one per level per tree. With
+// N = 2 ^ `rounds`, it's merklization of whole tree.
+//
+// See `merklize_inplace( ... )` for rest of arguments
+cl_int
+merklize_forest(cl_context ctx,
+                cl_command_queue cq,
+                cl_kernel krnl,
+                cl_uchar* const tree,
+                size_t t_size, // in bytes
+                size_t leaf_count,
+                size_t rounds,
+                size_t wg_size,
+                cl_ulong* const ts,
+                const merklize_opts_t* opts)
+{
+  // 2N nodes, each of 32 -bytes
+  assert(leaf_count << 6 == t_size);
+  assert(rounds > 0 && rounds < 64);
+  assert(((leaf_count >> rounds) << rounds) == leaf_count);
+  assert((wg_size & (wg_size - 1)) == 0);
+
+  cl_int status;
+
+  const int le = host_is_little_endian();
+  cl_uint* const words = (cl_uint*)tree;
+
+  cl_ulong api_calls = 0;
+  cl_ulong host_allocs = 0;
+
+  const cl_ulong t0 = metrics_now_ns();
+
+  // each word is read before being written back at same address, so
+  // conversion can be done in place
+  if (!le) {
+    words_from_le_bytes(
+      tree + (t_size >> 1), t_size >> 1, words + (t_size >> 3), t_size >> 3);
+  }
+
+  const cl_ulong t1 = metrics_now_ns();
+
+  cl_mem buf = metrics_count(
+    api_calls,
+    clCreateBuffer(
+      ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, t_size, tree, &status));
+  check_for_error_and_return(status);
+
+  // per round, two offset buffers, which are initialized during creation
+  // itself, so no write command is required; and one kernel execution event
   //
-  // these events will be used later, when all computation is done, for finding
-  // out total execution time of kernel
-  cl_event* round_evts = (cl_event*)malloc(sizeof(cl_event) * (rounds + 1));
-  *(round_evts + 0) = evt_3;
+  // zeroed, so that ones not yet created are skipped during teardown
+  cl_mem* tmp_bufs = (cl_mem*)metrics_count(
+    host_allocs, calloc(rounds << 1, sizeof(cl_mem)));
+  check_mem_alloc(tmp_bufs);
+  cl_event* round_evts =
+    (cl_event*)metrics_count(host_allocs, calloc(rounds, sizeof(cl_event)));
+  check_mem_alloc(round_evts);
 
-  // these events are obtained as a result of enqueuing buffer writing
-  // commands, inside body of following for-loop construct
-  cl_event* tmp_evts = (cl_event*)malloc(sizeof(cl_event) * (rounds << 1));
+  cl_event evt_0 = NULL;
+  cl_event evt_1 = NULL;
 
-  // these allocations hold those constant buffers which convey
-  // input/ output buffer offset to kernel, executing on device
-  cl_mem* tmp_bufs = (cl_mem*)malloc(sizeof(cl_mem) * (rounds << 1));
+  const cl_ulong t2 = metrics_now_ns();
 
   for (size_t r = 0; r < rounds; r++) {
-    const size_t i_offset_ = itmd_offset >> r;
-    const size_t itmd_offset_ = itmd_offset >> (r + 1);
-
-    cl_mem i_offset_buf_ =
-      clCreateBuffer(ctx, CL_MEM_READ_ONLY, sizeof(size_t), NULL, &status);
-    cl_mem itmd_offset_buf_ =
-      clCreateBuffer(ctx, CL_MEM_READ_ONLY, sizeof(size_t), NULL, &status);
-
-    cl_event evt_0_;
-    clEnqueueWriteBuffer(cq,
-                         i_offset_buf_,
-                         CL_FALSE,
-                         0,
-                         sizeof(size_t),
-                         &i_offset_,
-                         0,
-                         NULL,
-                         &evt_0_);
-
-    cl_event evt_1_;
-    clEnqueueWriteBuffer(cq,
-                         itmd_offset_buf_,
-                         CL_FALSE,
-                         0,
-                         sizeof(size_t),
-                         &itmd_offset_,
-                         0,
-                         NULL,
-                         &evt_1_);
-
-    clSetKernelArg(krnl, 0, sizeof(cl_mem), &itmd_buf);
-    clSetKernelArg(krnl, 1, sizeof(cl_mem), &i_offset_buf_);
-    clSetKernelArg(krnl, 2, sizeof(cl_mem), &itmd_buf);
-    clSetKernelArg(krnl, 3, sizeof(cl_mem), &itmd_offset_buf_);
-
-    size_t glb_work_items[] = { (leaf_count >> 1) >> (r + 1) };
+    // node offsets of level being read/ written, in terms of `cl_uint`s
+    size_t i_offset_ = (leaf_count >> r) << 3;
+    size_t o_offset_ = (leaf_count >> (r + 1)) << 3;
+
+    cl_mem i_offset_buf_ = metrics_count(
+      api_calls,
+      clCreateBuffer(ctx,
+                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(size_t),
+                     &i_offset_,
+                     &status));
+    if (status != CL_SUCCESS) {
+      merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+      return status;
+    }
+    *(tmp_bufs + (r << 1) + 0) = i_offset_buf_;
+
+    cl_mem o_offset_buf_ = metrics_count(
+      api_calls,
+      clCreateBuffer(ctx,
+                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(size_t),
+                     &o_offset_,
+                     &status));
+    if (status != CL_SUCCESS) {
+      merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+      return status;
+    }
+    *(tmp_bufs + (r << 1) + 1) = o_offset_buf_;
+
+    metrics_count(api_calls, clSetKernelArg(krnl, 0, sizeof(cl_mem), &buf));
+    metrics_count(api_calls,
+                  clSetKernelArg(krnl, 1, sizeof(cl_mem), &i_offset_buf_));
+    metrics_count(api_calls, clSetKernelArg(krnl, 2, sizeof(cl_mem), &buf));
+    metrics_count(api_calls,
+                  clSetKernelArg(krnl, 3, sizeof(cl_mem), &o_offset_buf_));
+
+    size_t glb_work_items[] = { leaf_count >> (r + 1) };
     size_t loc_work_items[] = { glb_work_items[0] >= wg_size
                                   ? wg_size
                                   : glb_work_items[0] };
-    cl_event evts_0_[] = { evt_0_, evt_1_, round_evts[r] };
 
-    cl_event evt_2_;
-    clEnqueueNDRangeKernel(
-      cq, krnl, 1, NULL, glb_work_items, loc_work_items, 3, evts_0_, &evt_2_);
+    // when # -of subtrees isn't power of 2, level may not be evenly divisible
+    // into work-groups
+    const int uniform =
+      wg_size != 0 && glb_work_items[0] % loc_work_items[0] == 0;
 
-    // so that compute dependency graph can be constructed
-    *(round_evts + r + 1) = evt_2_;
+    status =
+      metrics_count(api_calls,
+                    clEnqueueNDRangeKernel(cq,
+                                           krnl,
+                                           1,
+                                           NULL,
+                                           glb_work_items,
+                                           uniform ? loc_work_items : NULL,
+                                           r == 0 ? 0 : 1,
+                                           r == 0 ? NULL : round_evts + r - 1,
+                                           round_evts + r));
+    if (status != CL_SUCCESS) {
+      merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+      return status;
+    }
+  }
 
-    // so that these data transfer related event resources
-    // can be released at end of computation
-    *(tmp_evts + (r << 1) + 0) = evt_0_;
-    *(tmp_evts + (r << 1) + 1) = evt_1_;
+  const cl_ulong t3 = metrics_now_ns();
 
-    *(tmp_bufs + (r << 1) + 0) = i_offset_buf_;
-    *(tmp_bufs + (r << 1) + 1) = itmd_offset_buf_;
+  // mapping intermediate nodes ( i.e. first half of tree ) makes them visible
+  // to host, in same allocation; which is a no-op when device shares memory
+  // with host
+  metrics_count(api_calls,
+                clEnqueueMapBuffer(cq,
+                                   buf,
+                                   CL_FALSE,
+                                   CL_MAP_READ,
+                                   0,
+                                   t_size >> 1,
+                                   1,
+                                   round_evts + rounds - 1,
+                                   &evt_0,
+                                   &status));
+  if (status != CL_SUCCESS) {
+    merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+    return status;
   }
 
-  // all intermediate nodes of merkle tree being copied back to host
-  cl_event evt_4;
-  clEnqueueReadBuffer(cq,
-                      itmd_buf,
-                      CL_FALSE,
-                      0,
-                      itmd_buf_size,
-                      itmd_buf_ptr,
-                      1,
-                      round_evts + rounds,
-                      &evt_4);
+  status = metrics_count(
+    api_calls, clEnqueueUnmapMemObject(cq, buf, tree, 1, &evt_0, &evt_1));
+  if (status != CL_SUCCESS) {
+    merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+    return status;
+  }
 
-  // let compute dependency chain finish its execution
-  clWaitForEvents(1, &evt_4);
+  status = metrics_count(api_calls, clWaitForEvents(1, &evt_1));
+  if (status != CL_SUCCESS) {
+    merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+    return status;
+  }
 
-  // all intermediate nodes of merkle tree being interpreted
-  // as little endian byte array, as input was provided, output being
-  // converted to similar representation
-  words_to_le_bytes(itmd_buf_ptr, itmd_buf_elm_cnt, output, o_size);
+  const cl_ulong t4 = metrics_now_ns();
 
-  // just a temporary variable for holding a specific opencl command execution
-  // time
+  // nodes at [0, N >> rounds) are never touched by device
+  if (!le) {
+    const size_t from = (leaf_count >> rounds) << 5;
+
+    words_to_le_bytes(
+      words + (from >> 2), (t_size - from) >> 2, tree + from, t_size - from);
+  }
+
+  const cl_ulong t5 = metrics_now_ns();
+
+  cl_ulong exec_tm = 0;
+  cl_ulong d2h_tm = 0;
   cl_ulong tmp;
 
-  // sum of execution time of kernels with nanosecond level of granularity
-  for (size_t i = 0; i < rounds + 1; i++) {
+  for (size_t i = 0; i < rounds; i++) {
     tmp = 0;
     status = time_event(*(round_evts + i), &tmp);
-
     exec_tm += tmp;
   }
 
-  // calculating sum of time ( in nanosecond level granularity ) spent
-  // transferring data from host to device
   tmp = 0;
-  status = time_event(evt_0, &tmp); // input leaf nodes transfer cost
-  h2d_tm += tmp;
+  status = time_event(evt_0, &tmp);
+  d2h_tm += tmp;
 
-  tmp = 0;
-  status = time_event(evt_1, &tmp); // constant denoting buffer offset tx cost
-  h2d_tm += tmp;
+  if (opts != NULL && opts->trace != NULL) {
+    trace_t* const trace = opts->trace;
+    trace_begin_tree(trace);
 
-  tmp = 0;
-  status = time_event(evt_2, &tmp); // constant denoting buffer offset tx cost
-  h2d_tm += tmp;
+    for (size_t i = 0; i < rounds; i++) {
+      trace_record(trace, *(round_evts + i), "kernel", i + 1);
+    }
+    trace_record(trace, evt_0, "read", -1);
+  }
 
-  for (size_t i = 0; i < rounds << 1; i++) {
-    cl_ulong tmp = 0;
-    // during multiple rounds of kernel dispatch
-    // constants needs to be set for denoting offset into
-    // buffer from where input can be read or
-    // output can be written to
-    status = time_event(*(tmp_evts + i), &tmp);
+  *(ts + 0) = exec_tm;
+  *(ts + 1) = 0;
+  *(ts + 2) = d2h_tm;
 
-    h2d_tm += tmp;
+  if (opts != NULL && opts->metrics != NULL) {
+    // leaves migrate to device implicitly, when it doesn't share memory with
+    // host, while intermediate nodes are mapped back; so they're counted as
+    // transfers, even when no copy takes place
+    merklize_metrics_t m = {
+      .calls = 1,
+      .leaves = leaf_count,
+      .h2d_bytes = (t_size >> 1) + sizeof(size_t) * (rounds << 1),
+      .d2h_bytes = t_size >> 1,
+      .host_allocs = host_allocs,
+      .host_bytes = (sizeof(cl_mem) << 1) * rounds + sizeof(cl_event) * rounds,
+      .dev_bytes = t_size + sizeof(size_t) * (rounds << 1),
+      .buffers = 1 + (rounds << 1),
+      .api_calls = api_calls,
+      .kernels = rounds,
+      .phase_ns = { [METRICS_ALLOC] = t2 - t1,
+                    [METRICS_CONVERT] = (t1 - t0) + (t5 - t4),
+                    [METRICS_ENQUEUE] = t3 - t2,
+                    [METRICS_KERNEL] = exec_tm,
+                    [METRICS_D2H] = d2h_tm,
+                    [METRICS_TOTAL] = t5 - t0 },
+    };
+    m.peak_bytes = m.host_bytes + m.dev_bytes;
+
+    metrics_commit(opts->metrics, &m);
   }
 
-  // calculating total device to host data transfer cost
-  //
-  // this is the only time when device to host data transfer is required !
-  tmp = 0;
-  status = time_event(evt_4, &tmp); // intermediate node tx cost
-  d2h_tm += tmp;
+  merklize_forest_free(buf, tmp_bufs, round_evts, rounds, evt_0, evt_1);
+
+  return CL_SUCCESS;
+}
+
+// Same as `merklize( ... )`, but tree is merklized in place, in a single
+// allocation of 2N nodes ( each 32 -bytes wide ), laid out as heap, i.e. root
+// at node index 1, children of node i at 2i & 2i + 1
+//
+// Caller writes N leaf nodes ( as little endian bytes ) at [N, 2N) & gets all
+// intermediate nodes back at [1, N); node slot 0 is left untouched
+//
+// Same host allocation is wrapped by device buffer ( see CL_MEM_USE_HOST_PTR ),
+// so that devices sharing memory with host ( e.g. CPUs, integrated GPUs ) can
+// work on it without any copy, while others need only one device side copy of
+// 2N nodes. Compare it with `merklize( ... )`, which keeps caller's input &
+// output, word converted copies of both on host & two buffers on device.
+// For zero copy, most runtimes expect tree to be allocated on page boundary.
+//
+// On little endian hosts, bytes are already words, as kernel expects them,
+// otherwise they're converted ( in place ) before & after dispatching kernels
+//
+// Pass `wg_size` as 0, for letting runtime decide work-group size; otherwise
+// it must be power of 2. There's no lower bound on number of leaf nodes,
+// other than it being power of 2.
+//
+// `ts` is set same as `merklize( ... )` does, where there's no host to device
+// transfer ( i.e. ts[1] = 0 ) & device to host transfer time is of mapping
+// intermediate nodes back to host
+cl_int
+merklize_inplace(cl_context ctx,
+                 cl_command_queue cq,
+                 cl_kernel krnl,
+                 cl_uchar* const tree,
+                 size_t t_size, // in bytes
+                 size_t leaf_count,
+                 size_t wg_size,
+                 cl_ulong* const ts,
+                 const merklize_opts_t* opts)
+{
+  assert(leaf_count >= 2);
+  assert((leaf_count & (leaf_count - 1)) == 0);
 
-  *(ts + 0) = exec_tm; // sum of kernel execution times
-  *(ts + 1) = h2d_tm;  // sum of host to device data tx time
-  *(ts + 2) = d2h_tm;  // sum of device to host data tx time
+  const size_t rounds = (size_t)log2((double)leaf_count);
 
-  // release all opencl resources acquired during course of execution of this
-  // function
-  clReleaseEvent(evt_0);
-  clReleaseEvent(evt_1);
-  clReleaseEvent(evt_2);
-  clReleaseEvent(evt_4);
+  return merklize_forest(
+    ctx, cq, krnl, tree, t_size, leaf_count, rounds, wg_size, ts, opts);
+}
 
-  for (size_t i = 0; i < rounds + 1; i++) {
-    clReleaseEvent(*(round_evts + i));
-  }
+// Same as `merklize( ... )`, but meant for small trees, e.g. when combining
+// roots of subtrees computed elsewhere, so there's no lower bound on number of
+// leaf nodes ( other than it being power of 2 )
+//
+// Output is also laid out same as `merklize( ... )` i.e. root at node index 1,
+// children of node i at 2i & 2i + 1, where each node is 32 -bytes wide; while
+// leaves are copied into a temporary tree of 2N nodes, which is merklized
+// using `merklize_inplace( ... )`
+//
+// Each round of kernel dispatch uses runtime decided work-group size, because
+// number of work-items are too few to care about it
+cl_int
+merklize_small(cl_context ctx,
+               cl_command_queue cq,
+               cl_kernel krnl,
+               const cl_uchar* input,
+               size_t i_size, // in bytes
+               size_t leaf_count,
+               cl_uchar* const output,
+               size_t o_size) // in bytes
+{
+  assert(i_size == o_size);
+  assert(leaf_count << 5 == i_size);
 
-  for (size_t i = 0; i < (rounds << 1); i++) {
-    clReleaseEvent(*(tmp_evts + i));
-  }
+  cl_uchar* tree = (cl_uchar*)malloc(i_size << 1);
+  check_mem_alloc(tree);
 
-  clReleaseMemObject(i_buf);
-  clReleaseMemObject(itmd_buf);
-  clReleaseMemObject(i_offset_buf);
-  clReleaseMemObject(itmd_offset_buf);
+  // leaf nodes live in second half of tree
+  memcpy(tree + i_size, input, i_size);
 
-  for (size_t i = 0; i < (rounds << 1); i++) {
-    clReleaseMemObject(*(tmp_bufs + i));
-  }
+  cl_ulong ts[3];
+  cl_int status = merklize_inplace(
+    ctx, cq, krnl, tree, i_size << 1, leaf_count, 0, ts, NULL);
 
-  // release all heap allocation
-  free(i_buf_ptr);
-  free(itmd_buf_ptr);
-  free(round_evts);
-  free(tmp_evts);
-  free(tmp_bufs);
+  // only intermediate nodes are copied back, node slot 0 included
+  if (status == CL_SUCCESS) {
+    memcpy(output, tree, o_size);
+  }
 
-  return CL_SUCCESS;
+  free(tree);
+  return status;
 }
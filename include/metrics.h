@@ -0,0 +1,195 @@
+#pragma once
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+// Resource usage & data movement of tree builds, filled in per call & summed
+// up over a session ( i.e. all calls sharing same `metrics_t` ), so that
+// capacity planning/ regression alerts can look at more than kernel time
+//
+// Host side phases are timed using wall-clock, while transfers & kernels are
+// timed on device clock, using OpenCL event profiling; so achieved bandwidth
+// of transfers is what device observed, not what host waited for
+
+enum metrics_phase
+{
+  METRICS_ALLOC,   // host/ device allocations, arena acquisition included
+  METRICS_CONVERT, // host side byte <-> word conversion & staging copies
+  METRICS_ENQUEUE, // enqueuing commands, per-round offset buffers included
+  METRICS_H2D,     // host to device transfers, on device clock
+  METRICS_KERNEL,  // kernel executions, on device clock
+  METRICS_D2H,     // device to host transfers ( or mapping ), on device clock
+  METRICS_TOTAL,   // from entering call till tree is built, on host clock
+  METRICS_PHASES
+};
+
+const char* metrics_phase_names[METRICS_PHASES] = {
+  "alloc", "convert", "enqueue", "h2d", "kernel", "d2h", "total"
+};
+
+typedef struct
+{
+  cl_ulong calls;       // # -of tree builds
+  cl_ulong leaves;      // # -of leaves merklized
+  cl_ulong h2d_bytes;   // moved from host to device
+  cl_ulong d2h_bytes;   // moved from device to host
+  cl_ulong host_allocs; // # -of host heap allocations
+  cl_ulong host_bytes;  // bytes of those
+  cl_ulong dev_bytes;   // of device buffers used, pooled ones included
+  cl_ulong buffers;     // # -of device buffers created, pooled ones excluded
+  cl_ulong api_calls;   // # -of OpenCL calls made for building tree, not
+                        // counting profiling queries & releases
+  cl_ulong kernels;     // # -of kernel dispatches
+  cl_ulong peak_bytes;  // host & device bytes held at once, by one call
+  cl_ulong phase_ns[METRICS_PHASES];
+} merklize_metrics_t;
+
+// Evaluates `call` ( an OpenCL call or heap allocation ), counting it in
+// `counter`, so that `api_calls`/ `host_allocs` are counted where calls are
+// made, instead of being derived from how many of them should've been made
+#define metrics_count(counter, call) ((counter)++, (call))
+
+// Session, which can be shared among many threads
+typedef struct
+{
+  merklize_metrics_t last;  // of most recently completed call
+  merklize_metrics_t total; // of all calls, since `metrics_init( ... )`
+  FILE* dump;               // when non-NULL, `total` is periodically
+  cl_ulong period_ns;       // written here, once every these many ns
+  cl_ulong last_dump;
+  pthread_mutex_t lock;
+} metrics_t;
+
+// Monotonic host wall-clock time, in nanosecond level granularity
+cl_ulong
+metrics_now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return (cl_ulong)t.tv_sec * 1000000000ul + (cl_ulong)t.tv_nsec;
+}
+
+// Pass `dump` as NULL, for never dumping session totals
+void
+metrics_init(metrics_t* const metrics, FILE* const dump, cl_ulong period_ns)
+{
+  memset(metrics, 0, sizeof(metrics_t));
+
+  metrics->dump = dump;
+  metrics->period_ns = period_ns;
+  metrics->last_dump = metrics_now_ns();
+  pthread_mutex_init(&metrics->lock, NULL);
+}
+
+void
+metrics_free(metrics_t* const metrics)
+{
+  pthread_mutex_destroy(&metrics->lock);
+}
+
+// Adds counters of `src` to `dst`, while peak is maximum of both
+void
+metrics_add(merklize_metrics_t* const dst, const merklize_metrics_t* src)
+{
+  dst->calls += src->calls;
+  dst->leaves += src->leaves;
+  dst->h2d_bytes += src->h2d_bytes;
+  dst->d2h_bytes += src->d2h_bytes;
+  dst->host_allocs += src->host_allocs;
+  dst->host_bytes += src->host_bytes;
+  dst->dev_bytes += src->dev_bytes;
+  dst->buffers += src->buffers;
+  dst->api_calls += src->api_calls;
+  dst->kernels += src->kernels;
+  dst->peak_bytes =
+    src->peak_bytes > dst->peak_bytes ? src->peak_bytes : dst->peak_bytes;
+
+  for (size_t p = 0; p < METRICS_PHASES; p++) {
+    dst->phase_ns[p] += src->phase_ns[p];
+  }
+}
+
+// Achieved bandwidth, in GB/s, when moving/ processing `bytes` in `ns`
+double
+metrics_gbps(cl_ulong bytes, cl_ulong ns)
+{
+  return ns == 0 ? 0. : (double)bytes / (double)ns;
+}
+
+// Writes all counters as one line of space separated key=value pairs, along
+// with achieved bandwidth of transfers, kernels ( input leaves hashed ) &
+// whole call
+void
+metrics_print(const merklize_metrics_t* m, FILE* const fd)
+{
+  fprintf(fd,
+          "calls=%lu leaves=%lu h2d_bytes=%lu d2h_bytes=%lu host_allocs=%lu "
+          "host_bytes=%lu dev_bytes=%lu buffers=%lu api_calls=%lu "
+          "kernels=%lu peak_bytes=%lu",
+          m->calls,
+          m->leaves,
+          m->h2d_bytes,
+          m->d2h_bytes,
+          m->host_allocs,
+          m->host_bytes,
+          m->dev_bytes,
+          m->buffers,
+          m->api_calls,
+          m->kernels,
+          m->peak_bytes);
+
+  for (size_t p = 0; p < METRICS_PHASES; p++) {
+    fprintf(fd, " %s_ns=%lu", metrics_phase_names[p], m->phase_ns[p]);
+  }
+
+  fprintf(fd,
+          " h2d_gbps=%.3lf kernel_gbps=%.3lf d2h_gbps=%.3lf total_gbps=%.3lf\n",
+          metrics_gbps(m->h2d_bytes, m->phase_ns[METRICS_H2D]),
+          metrics_gbps(m->leaves << 5, m->phase_ns[METRICS_KERNEL]),
+          metrics_gbps(m->d2h_bytes, m->phase_ns[METRICS_D2H]),
+          metrics_gbps(m->leaves << 5, m->phase_ns[METRICS_TOTAL]));
+}
+
+// Records metrics of one completed call in session, dumping session totals,
+// if period has elapsed since last dump
+void
+metrics_commit(metrics_t* const metrics, const merklize_metrics_t* call)
+{
+  pthread_mutex_lock(&metrics->lock);
+
+  metrics->last = *call;
+  metrics_add(&metrics->total, call);
+
+  if (metrics->dump != NULL) {
+    const cl_ulong now = metrics_now_ns();
+
+    if (now - metrics->last_dump >= metrics->period_ns) {
+      metrics_print(&metrics->total, metrics->dump);
+      fflush(metrics->dump);
+
+      metrics->last_dump = now;
+    }
+  }
+
+  pthread_mutex_unlock(&metrics->lock);
+}
+
+// Copies out most recent call's & session's metrics, either can be NULL
+void
+metrics_snapshot(metrics_t* const metrics,
+                 merklize_metrics_t* const last,
+                 merklize_metrics_t* const total)
+{
+  pthread_mutex_lock(&metrics->lock);
+
+  if (last != NULL) {
+    *last = metrics->last;
+  }
+  if (total != NULL) {
+    *total = metrics->total;
+  }
+
+  pthread_mutex_unlock(&metrics->lock);
+}
@@ -0,0 +1,348 @@
+#pragma once
+#include "bench.h"
+#include "merklize.h"
+#include <pthread.h>
+
+// One partition of multi-device merklization, which owns its own context,
+// out-of-order profiling enabled queue & compiled `merklize` kernel, so that
+// it can be driven from its own host thread, without sharing any OpenCL object
+// with other partitions
+//
+// Device may be a root device ( e.g. one of several platforms' devices ) or a
+// sub-device ( e.g. one NUMA node of a CPU device, see
+// `create_numa_sub_devices( ... )` )
+typedef struct
+{
+  cl_device_id dev_id;
+  cl_context ctx;
+  cl_command_queue cq;
+  cl_program prgm;
+  cl_kernel krnl;
+  size_t wg_size;
+  double weight; // relative throughput, see `calibrate_device_parts( ... )`
+} device_part_t;
+
+// Creates context, queue & `merklize` kernel for given device, JIT compiling
+// kernel.cl from source
+cl_int
+device_part_init(cl_device_id dev_id, device_part_t* const part)
+{
+  memset(part, 0, sizeof(device_part_t));
+
+  cl_int status;
+
+  part->dev_id = dev_id;
+  part->weight = 1.;
+
+  part->ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &status);
+  check_for_error_and_return(status);
+
+  // see main.c, for why these queue properties are required
+  cl_queue_properties props[] = { CL_QUEUE_PROPERTIES,
+                                  CL_QUEUE_PROFILING_ENABLE |
+                                    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                  0 };
+  part->cq =
+    clCreateCommandQueueWithProperties(part->ctx, dev_id, props, &status);
+  check_for_error_and_return(status);
+
+  status = build_kernel_from_source(
+    part->ctx, dev_id, "kernel.cl", ocl_kernel_flag_2, &part->prgm);
+  if (status != CL_SUCCESS) {
+    show_build_log(dev_id, part->prgm);
+    return status;
+  }
+
+  part->krnl = clCreateKernel(part->prgm, "merklize", &status);
+  check_for_error_and_return(status);
+
+  status =
+    preferred_work_group_size_multiple(part->krnl, dev_id, &part->wg_size);
+  check_for_error_and_return(status);
+
+  // `merklize( ... )` expects power of 2 work-group size
+  while ((part->wg_size & (part->wg_size - 1)) != 0) {
+    part->wg_size &= part->wg_size - 1;
+  }
+
+  return CL_SUCCESS;
+}
+
+// Releases all OpenCL resources acquired by `device_part_init( ... )`, note
+// device itself is not released, because it may not be a sub-device
+void
+device_part_release(device_part_t* const part)
+{
+  clReleaseKernel(part->krnl);
+  clReleaseProgram(part->prgm);
+  clReleaseCommandQueue(part->cq);
+  clReleaseContext(part->ctx);
+}
+
+// Measures end-to-end throughput of each partition, by merklizing 2 ^ 20
+// random leaves on it, setting `weight` of each partition to measured leaf
+// bytes processed per nanosecond, so that tree can be split proportionally
+cl_int
+calibrate_device_parts(device_part_t* const parts, size_t part_cnt)
+{
+  const size_t leaf_count = 1 << 20;
+
+  for (size_t i = 0; i < part_cnt; i++) {
+    device_part_t* const part = parts + i;
+
+    cl_ulong phases[PHASE_COUNT];
+
+    // first run pays for JIT/ driver allocation, so it's discarded
+    for (size_t j = 0; j < 2; j++) {
+      cl_int status = bench_merklize_e2e(part->ctx,
+                                         part->cq,
+                                         part->krnl,
+                                         leaf_count,
+                                         part->wg_size,
+                                         phases,
+                                         NULL);
+      check_for_error_and_return(status);
+    }
+
+    part->weight =
+      bench_gbps(leaf_count << 5, (double)*(phases + PHASE_MERKLIZE));
+  }
+
+  return CL_SUCCESS;
+}
+
+// Splits `subtree_cnt` -many subtrees among partitions, proportional to their
+// weights, using largest remainder method, so that i-th partition gets
+// contiguous subtrees [first[i], first[i] + count[i])
+void
+split_subtrees(const device_part_t* parts,
+               size_t part_cnt,
+               size_t subtree_cnt,
+               size_t* const first,
+               size_t* const count)
+{
+  double total = 0.;
+  for (size_t i = 0; i < part_cnt; i++) {
+    total += (parts + i)->weight;
+  }
+
+  size_t assigned = 0;
+  double* rem = (double*)malloc(sizeof(double) * part_cnt);
+  check_mem_alloc(rem);
+
+  for (size_t i = 0; i < part_cnt; i++) {
+    const double share = (double)subtree_cnt * (parts + i)->weight / total;
+
+    *(count + i) = (size_t)share;
+    *(rem + i) = share - (double)*(count + i);
+    assigned += *(count + i);
+  }
+
+  // hand out remaining subtrees, one each, to partitions with largest
+  // fractional share
+  while (assigned < subtree_cnt) {
+    size_t best = 0;
+    for (size_t i = 1; i < part_cnt; i++) {
+      best = *(rem + i) > *(rem + best) ? i : best;
+    }
+
+    *(count + best) += 1;
+    *(rem + best) = -1.;
+    assigned++;
+  }
+
+  size_t next = 0;
+  for (size_t i = 0; i < part_cnt; i++) {
+    *(first + i) = next;
+    next += *(count + i);
+  }
+
+  free(rem);
+}
+
+// Work assigned to host thread driving one partition
+typedef struct
+{
+  device_part_t* part;
+  const cl_uchar* input;  // all leaves of tree
+  cl_uchar* output;       // all intermediate nodes of tree
+  size_t leaf_count;      // of whole tree
+  size_t sub_leaf_count;  // of each subtree
+  size_t first;           // first subtree to be merklized
+  size_t count;           // # -of subtrees to be merklized
+  cl_ulong ts[3];         // same as what `merklize( ... )` sets
+  cl_int status;
+  int started; // whether thread driving this partition could be created
+} part_work_t;
+
+// Merklizes all subtrees assigned to one partition, one after another, placing
+// intermediate nodes of each subtree at their position in whole tree's output
+void*
+merklize_part(void* arg)
+{
+  part_work_t* const work = (part_work_t*)arg;
+  device_part_t* const part = work->part;
+
+  const size_t m = work->sub_leaf_count;
+  const size_t n = work->leaf_count;
+  const size_t size = m << 5;
+
+  cl_uchar* tmp = (cl_uchar*)malloc(size);
+  check_mem_alloc(tmp);
+
+  work->status = CL_SUCCESS;
+  memset(work->ts, 0, sizeof(work->ts));
+
+  for (size_t s = work->first; s < work->first + work->count; s++) {
+    cl_ulong ts[3] = { 0 };
+
+    work->status = merklize(part->ctx,
+                            part->cq,
+                            part->krnl,
+                            work->input + s * size,
+                            size,
+                            m,
+                            tmp,
+                            size,
+                            part->wg_size,
+                            ts,
+                            NULL);
+    if (work->status != CL_SUCCESS) {
+      break;
+    }
+
+    work->ts[0] += ts[0];
+    work->ts[1] += ts[1];
+    work->ts[2] += ts[2];
+
+    // level l ( leaves at 0 ) of subtree s has ( m >> l ) -many nodes, living
+    // at [m >> l, m >> (l - 1)) in subtree's output, which are placed at
+    // [(n >> l) + s * (m >> l), ...) in whole tree's output
+    for (size_t l = 1; (m >> l) > 0; l++) {
+      const size_t cnt = m >> l;
+
+      memcpy(work->output + (((n >> l) + s * cnt) << 5),
+             tmp + (cnt << 5),
+             cnt << 5);
+    }
+  }
+
+  free(tmp);
+  return NULL;
+}
+
+// Merklizes N leaf nodes, concurrently on multiple devices, by splitting tree
+// into 2 ^ k subtrees ( each having N / 2 ^ k leaves ), which are distributed
+// among partitions proportional to their `weight`; roots of subtrees are then
+// combined on first partition
+//
+// Output is exactly same as what `merklize( ... )` produces, on single device
+//
+// `ts` is set with sum of kernel/ host to device/ device to host times, over
+// all partitions ( see `merklize( ... )` ), which may overlap in wall-clock
+cl_int
+merklize_multi(device_part_t* const parts,
+               size_t part_cnt,
+               const cl_uchar* input,
+               size_t i_size, // in bytes
+               size_t leaf_count,
+               cl_uchar* const output,
+               size_t o_size, // in bytes
+               size_t log_subtrees,
+               cl_ulong* const ts)
+{
+  assert(i_size == o_size);
+  assert(leaf_count << 5 == i_size);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+  assert(part_cnt > 0);
+
+  const size_t subtree_cnt = (size_t)1 << log_subtrees;
+  const size_t sub_leaf_count = leaf_count >> log_subtrees;
+
+  // each subtree is merklized using `merklize( ... )`
+  assert(sub_leaf_count >= 1 << 20);
+
+  size_t* first = (size_t*)malloc(sizeof(size_t) * part_cnt);
+  check_mem_alloc(first);
+  size_t* count = (size_t*)malloc(sizeof(size_t) * part_cnt);
+  check_mem_alloc(count);
+  part_work_t* works = (part_work_t*)malloc(sizeof(part_work_t) * part_cnt);
+  check_mem_alloc(works);
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * part_cnt);
+  check_mem_alloc(threads);
+
+  split_subtrees(parts, part_cnt, subtree_cnt, first, count);
+
+  for (size_t i = 0; i < part_cnt; i++) {
+    *(works + i) = (part_work_t){ .part = parts + i,
+                                  .input = input,
+                                  .output = output,
+                                  .leaf_count = leaf_count,
+                                  .sub_leaf_count = sub_leaf_count,
+                                  .first = *(first + i),
+                                  .count = *(count + i),
+                                  .status = CL_SUCCESS,
+                                  .started = 0 };
+
+    // partition whose thread can't be created fails tree build, while
+    // threads of others are still joined
+    if (*(count + i) > 0) {
+      (works + i)->started =
+        pthread_create(threads + i, NULL, merklize_part, works + i) == 0;
+      if (!(works + i)->started) {
+        (works + i)->status = CL_OUT_OF_HOST_MEMORY;
+      }
+    }
+  }
+
+  cl_int status = CL_SUCCESS;
+  memset(ts, 0, sizeof(cl_ulong) * 3);
+
+  for (size_t i = 0; i < part_cnt; i++) {
+    if (*(count + i) == 0) {
+      continue;
+    }
+
+    if ((works + i)->started) {
+      pthread_join(*(threads + i), NULL);
+    }
+
+    status = status == CL_SUCCESS ? (works + i)->status : status;
+
+    *(ts + 0) += (works + i)->ts[0];
+    *(ts + 1) += (works + i)->ts[1];
+    *(ts + 2) += (works + i)->ts[2];
+  }
+
+  // roots of subtrees live at [2 ^ k, 2 ^ (k + 1)) in output, which are
+  // now combined into top k levels of tree, on first partition
+  if (status == CL_SUCCESS && subtree_cnt > 1) {
+    const size_t size = subtree_cnt << 5;
+
+    cl_uchar* top = (cl_uchar*)malloc(size);
+    check_mem_alloc(top);
+
+    status = merklize_small(parts->ctx,
+                            parts->cq,
+                            parts->krnl,
+                            output + size,
+                            size,
+                            subtree_cnt,
+                            top,
+                            size);
+
+    // node slot 0 is unused
+    if (status == CL_SUCCESS) {
+      memcpy(output + 32, top + 32, size - 32);
+    }
+
+    free(top);
+  }
+
+  free(first);
+  free(count);
+  free(works);
+  free(threads);
+
+  return status;
+}
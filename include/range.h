@@ -0,0 +1,299 @@
+#pragma once
+#include "diff.h"
+#include "host_blake3.h"
+
+// Commitment of arbitrary contiguous range of leaves [a, b), of some merkle
+// tree with N leaves, e.g. for committing to a time window of leaves, without
+// building a new tree for it
+//
+// Range is covered by maximal aligned subtrees ( at most 2 * log2(N) of them,
+// like in segment tree ), whose roots c_0, c_1, ... c_(k - 1), from left to
+// right, are folded from left, as
+//
+// r_0 = c_0
+// r_i = blake3( r_(i - 1) || c_i ), for 0 < i < k
+// range_root = r_(k - 1)
+//
+// so that root of aligned, power of 2 sized range is same as root of that
+// subtree, in whole tree
+
+// Writes heap indices ( root at 1 ) of roots of maximal aligned subtrees
+// covering [a, b), from left to right, returning # -of them
+size_t
+range_cover(size_t leaf_count, size_t a, size_t b, size_t* const cover)
+{
+  assert(a < b && b <= leaf_count);
+
+  // left & right boundaries, in heap indices
+  size_t l = leaf_count + a;
+  size_t r = leaf_count + b;
+
+  size_t l_cnt = 0;
+  size_t r_cnt = 0;
+  size_t right[64]; // found from right to left
+
+  while (l < r) {
+    if (l & 1) {
+      *(cover + l_cnt++) = l++;
+    }
+    if (r & 1) {
+      right[r_cnt++] = --r;
+    }
+
+    l >>= 1;
+    r >>= 1;
+  }
+
+  for (size_t i = 0; i < r_cnt; i++) {
+    *(cover + l_cnt + i) = right[r_cnt - 1 - i];
+  }
+
+  return l_cnt + r_cnt;
+}
+
+// Folds roots of covering subtrees ( 32 -bytes each ), from left to right,
+// into 32 -bytes range root
+void
+range_fold(const cl_uchar* covers, size_t cnt, cl_uchar* const root)
+{
+  cl_uchar msg[64];
+
+  memcpy(msg, covers, 32);
+
+  for (size_t i = 1; i < cnt; i++) {
+    memcpy(msg + 32, covers + (i << 5), 32);
+    blake3_hash_pair_host(msg, msg);
+  }
+
+  memcpy(root, msg, 32);
+}
+
+// Computes root of leaf range [a, b), of already built tree, by folding
+// O(log(N)) nodes; tree is given same as `merkle_diff( ... )` expects
+void
+range_root(const cl_uchar* nodes,
+           const cl_uchar* leaves,
+           size_t leaf_count,
+           size_t a,
+           size_t b,
+           cl_uchar* const root)
+{
+  size_t cover[128];
+  cl_uchar covers[128 << 5];
+
+  const size_t cnt = range_cover(leaf_count, a, b, cover);
+
+  for (size_t i = 0; i < cnt; i++) {
+    memcpy(covers + (i << 5),
+           diff_node(nodes, leaves, leaf_count, *(cover + i)),
+           32);
+  }
+
+  range_fold(covers, cnt, root);
+}
+
+// Computes root of leaf range [a, b), when only leaves are available, by
+// uploading only leaves in range & hashing only nodes inside it, on device,
+// one level per dispatch of `merklize` kernel, where level is read from one
+// buffer & its parents are written to another
+//
+// At each level, boundary nodes which can't be paired up inside range, are
+// roots of covering subtrees, which are copied to a separate buffer, on
+// device, so that there's only one readback; all commands form a single
+// chain of events
+cl_int
+range_root_device(cl_context ctx,
+                  cl_command_queue cq,
+                  cl_kernel krnl,
+                  const cl_uchar* leaves,
+                  size_t leaf_count,
+                  size_t a,
+                  size_t b,
+                  cl_uchar* const root)
+{
+  assert(a < b && b <= leaf_count);
+
+  cl_int status;
+
+  const size_t cnt = b - a;
+  const size_t size = cnt << 5;
+  const int le = host_is_little_endian();
+
+  // on little endian host, bytes already are words, as kernel expects them
+  cl_uint* words = (cl_uint*)(leaves + (a << 5));
+  if (!le) {
+    words = (cl_uint*)malloc(size);
+    check_mem_alloc(words);
+
+    words_from_le_bytes(leaves + (a << 5), size, words, size >> 2);
+  }
+
+  cl_mem bufs[2];
+  bufs[0] = clCreateBuffer(ctx,
+                           CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                           size,
+                           words,
+                           &status);
+  check_for_error_and_return(status);
+  bufs[1] = clCreateBuffer(
+    ctx, CL_MEM_READ_WRITE, (size >> 1) + 32, NULL, &status);
+  check_for_error_and_return(status);
+
+  // left covering nodes fill slots from beginning, right ones from end
+  const size_t slots = 128;
+  cl_mem cover_buf =
+    clCreateBuffer(ctx, CL_MEM_READ_WRITE, slots << 5, NULL, &status);
+  check_for_error_and_return(status);
+
+  size_t l_cnt = 0;
+  size_t r_cnt = 0;
+
+  // at most, per level, two copies, two offset buffers & one kernel
+  cl_event* evts = (cl_event*)malloc(sizeof(cl_event) * slots * 3);
+  check_mem_alloc(evts);
+  cl_mem* tmp_bufs = (cl_mem*)malloc(sizeof(cl_mem) * slots * 2);
+  check_mem_alloc(tmp_bufs);
+
+  size_t evt_cnt = 0;
+  size_t tmp_cnt = 0;
+
+  size_t lo = a;
+  size_t hi = b;
+  size_t cur = 0; // buffer holding current level, whose slot 0 is node `lo`
+
+  while (lo < hi) {
+    const size_t base = lo;
+
+    cl_event* const last = evt_cnt == 0 ? NULL : evts + evt_cnt - 1;
+
+    if (lo & 1) {
+      status = clEnqueueCopyBuffer(cq,
+                                   bufs[cur],
+                                   cover_buf,
+                                   (lo - base) << 5,
+                                   (l_cnt++) << 5,
+                                   32,
+                                   last == NULL ? 0 : 1,
+                                   last,
+                                   evts + evt_cnt);
+      check_for_error_and_return(status);
+      evt_cnt++;
+      lo++;
+    }
+
+    if (hi & 1) {
+      hi--;
+
+      cl_event* const last_ = evt_cnt == 0 ? NULL : evts + evt_cnt - 1;
+      status = clEnqueueCopyBuffer(cq,
+                                   bufs[cur],
+                                   cover_buf,
+                                   (hi - base) << 5,
+                                   (slots - ++r_cnt) << 5,
+                                   32,
+                                   last_ == NULL ? 0 : 1,
+                                   last_,
+                                   evts + evt_cnt);
+      check_for_error_and_return(status);
+      evt_cnt++;
+    }
+
+    if (lo >= hi) {
+      break;
+    }
+
+    // offsets, in terms of `cl_uint`s
+    size_t i_offset = (lo - base) << 3;
+    size_t o_offset = 0;
+
+    cl_mem i_offset_buf = clCreateBuffer(ctx,
+                                         CL_MEM_READ_ONLY |
+                                           CL_MEM_COPY_HOST_PTR,
+                                         sizeof(size_t),
+                                         &i_offset,
+                                         &status);
+    check_for_error_and_return(status);
+    cl_mem o_offset_buf = clCreateBuffer(ctx,
+                                         CL_MEM_READ_ONLY |
+                                           CL_MEM_COPY_HOST_PTR,
+                                         sizeof(size_t),
+                                         &o_offset,
+                                         &status);
+    check_for_error_and_return(status);
+
+    *(tmp_bufs + tmp_cnt++) = i_offset_buf;
+    *(tmp_bufs + tmp_cnt++) = o_offset_buf;
+
+    clSetKernelArg(krnl, 0, sizeof(cl_mem), bufs + cur);
+    clSetKernelArg(krnl, 1, sizeof(cl_mem), &i_offset_buf);
+    clSetKernelArg(krnl, 2, sizeof(cl_mem), bufs + (cur ^ 1));
+    clSetKernelArg(krnl, 3, sizeof(cl_mem), &o_offset_buf);
+
+    size_t glb_work_items[] = { (hi - lo) >> 1 };
+
+    cl_event* const last_ = evt_cnt == 0 ? NULL : evts + evt_cnt - 1;
+    status = clEnqueueNDRangeKernel(cq,
+                                    krnl,
+                                    1,
+                                    NULL,
+                                    glb_work_items,
+                                    NULL,
+                                    last_ == NULL ? 0 : 1,
+                                    last_,
+                                    evts + evt_cnt);
+    check_for_error_and_return(status);
+    evt_cnt++;
+
+    lo >>= 1;
+    hi >>= 1;
+    cur ^= 1;
+  }
+
+  cl_uint* cover_words = (cl_uint*)malloc(slots << 5);
+  check_mem_alloc(cover_words);
+
+  status = clEnqueueReadBuffer(cq,
+                               cover_buf,
+                               CL_TRUE,
+                               0,
+                               slots << 5,
+                               cover_words,
+                               1,
+                               evts + evt_cnt - 1,
+                               NULL);
+
+  if (status == CL_SUCCESS) {
+    // left covering nodes, followed by right ones, in left to right order
+    cl_uchar* covers = (cl_uchar*)malloc((l_cnt + r_cnt) << 5);
+    check_mem_alloc(covers);
+
+    words_to_le_bytes(cover_words, l_cnt << 3, covers, l_cnt << 5);
+    words_to_le_bytes(cover_words + ((slots - r_cnt) << 3),
+                      r_cnt << 3,
+                      covers + (l_cnt << 5),
+                      r_cnt << 5);
+
+    range_fold(covers, l_cnt + r_cnt, root);
+    free(covers);
+  }
+
+  for (size_t i = 0; i < evt_cnt; i++) {
+    clReleaseEvent(*(evts + i));
+  }
+  for (size_t i = 0; i < tmp_cnt; i++) {
+    clReleaseMemObject(*(tmp_bufs + i));
+  }
+
+  clReleaseMemObject(bufs[0]);
+  clReleaseMemObject(bufs[1]);
+  clReleaseMemObject(cover_buf);
+
+  if (!le) {
+    free(words);
+  }
+  free(cover_words);
+  free(evts);
+  free(tmp_bufs);
+
+  return status;
+}
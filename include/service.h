@@ -0,0 +1,1060 @@
+#pragma once
+#include "host_merklize.h"
+#include "merklize.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local merklization service, where one long-running process ( see
+// merklized.c ) owns OpenCL context, compiled kernel & built trees, and
+// serves requests of other processes, on same host, over a Unix domain
+// socket, so that OpenCL initialization & kernel compilation cost is paid
+// once per host, not once per process, and processes don't compete for device
+//
+// Protocol is binary, each request/ response is a fixed size header, followed
+// by `len` -bytes of payload. Both ends run on same host, so all fields are
+// in host byte order. Requests on same connection are served in order they're
+// received, except that batched merklize requests are responded to when their
+// batch is dispatched, so responses echo request's `tag`.
+//
+// op         | request                      | response
+// -----------|------------------------------|-------------------------------
+// MERKLIZE   | arg = N, N leaves            | tree = id, 32 -bytes root
+// ROOT       | tree                         | 32 -bytes root
+// PROOF      | tree, arg = leaf index       | arg = height, leaf & siblings
+// UPDATE     | tree, arg = cnt, cnt -many   | 32 -bytes root
+//            | ( 8 -bytes index, leaf )     |
+// STATS      |                              | `service_stats_t`
+// RELEASE    | tree                         |
+//
+// Merklize requests having at most 2 ^ `batch_log` leaves are not dispatched
+// right away, rather they're held for upto `batch_ns`, so that all pending
+// requests having same leaf count are merklized together, as a forest, using
+// one kernel dispatch per level ( see `merklize_forest( ... )` ).
+//
+// Payload longer than what op allows ( 32 -bytes per leaf of largest tree,
+// for MERKLIZE, 40 -bytes per leaf of tree, for UPDATE, none for others ) is
+// answered with SERVICE_EINVAL, before any of it is received, and discarded.
+
+#define SERVICE_MAGIC 0x534c4b4du // "MKLS"
+
+enum service_op
+{
+  SERVICE_MERKLIZE = 1,
+  SERVICE_ROOT = 2,
+  SERVICE_PROOF = 3,
+  SERVICE_UPDATE = 4,
+  SERVICE_STATS = 5,
+  SERVICE_RELEASE = 6,
+  SERVICE_OP_COUNT = 7
+};
+
+enum service_status
+{
+  SERVICE_OK = 0,
+  SERVICE_EINVAL = 1, // malformed request
+  SERVICE_ENOENT = 2, // no tree with that id
+  SERVICE_EDEVICE = 3 // tree couldn't be built on device
+};
+
+typedef struct
+{
+  cl_uint magic;
+  cl_ushort op;
+  cl_ushort status; // of response
+  cl_ulong tag;     // chosen by client, echoed back in response
+  cl_ulong tree;
+  cl_ulong arg; // op specific
+  cl_ulong len; // of payload, in bytes
+} service_hdr_t;
+
+// Counters since start of service, all times are in nanoseconds
+typedef struct
+{
+  cl_ulong requests[SERVICE_OP_COUNT];
+  cl_ulong errors;
+  cl_ulong leaves;     // merklized
+  cl_ulong bytes_in;   // received, including headers
+  cl_ulong bytes_out;  // sent, including headers
+  cl_ulong dispatches; // tree/ forest builds on device
+  cl_ulong batched;    // merklize requests served by forest builds
+  cl_ulong build_ns;   // wall time spent building trees
+  cl_ulong latency_cnt;
+  cl_ulong latency_sum;
+  cl_ulong latency_max;
+  cl_ulong trees; // currently held
+  cl_ulong uptime;
+} service_stats_t;
+
+cl_ulong
+service_now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return (cl_ulong)t.tv_sec * 1000000000ul + (cl_ulong)t.tv_nsec;
+}
+
+// Returns 0 when all `len` -bytes are sent, otherwise -1
+int
+service_write_all(int fd, const void* buf, size_t len)
+{
+  const cl_uchar* ptr = (const cl_uchar*)buf;
+
+  while (len > 0) {
+    // peer going away must not kill whole process, using SIGPIPE
+    const ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    ptr += n;
+    len -= (size_t)n;
+  }
+
+  return 0;
+}
+
+// Returns 0 when all `len` -bytes are received, otherwise -1
+int
+service_read_all(int fd, void* buf, size_t len)
+{
+  cl_uchar* ptr = (cl_uchar*)buf;
+
+  while (len > 0) {
+    const ssize_t n = recv(fd, ptr, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    ptr += n;
+    len -= (size_t)n;
+  }
+
+  return 0;
+}
+
+// Sends header, with its `len` set, followed by payload
+int
+service_send(int fd,
+             service_hdr_t* const hdr,
+             const void* payload,
+             size_t len)
+{
+  hdr->magic = SERVICE_MAGIC;
+  hdr->len = len;
+
+  if (service_write_all(fd, hdr, sizeof(service_hdr_t)) != 0) {
+    return -1;
+  }
+  return len > 0 ? service_write_all(fd, payload, len) : 0;
+}
+
+// Receives header & payload, which is allocated on heap ( when non-empty ) &
+// must be freed by caller; payloads longer than `max_len` are rejected
+int
+service_recv(int fd,
+             service_hdr_t* const hdr,
+             cl_uchar** const payload,
+             size_t max_len)
+{
+  *payload = NULL;
+
+  if (service_read_all(fd, hdr, sizeof(service_hdr_t)) != 0) {
+    return -1;
+  }
+  if (hdr->magic != SERVICE_MAGIC || hdr->len > max_len) {
+    return -1;
+  }
+  if (hdr->len == 0) {
+    return 0;
+  }
+
+  *payload = (cl_uchar*)malloc(hdr->len);
+  check_mem_alloc(*payload);
+
+  if (service_read_all(fd, *payload, hdr->len) != 0) {
+    free(*payload);
+    *payload = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Connects to service listening at given path, returning socket or -1
+int
+service_connect(const char* path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Client side of one request/ response round trip, where response's payload
+// is allocated on heap & must be freed by caller; returns -1 on I/ O failure,
+// otherwise response's status
+int
+service_call(int fd,
+             enum service_op op,
+             cl_ulong tree,
+             cl_ulong arg,
+             const void* payload,
+             size_t len,
+             service_hdr_t* const resp,
+             cl_uchar** const resp_payload)
+{
+  service_hdr_t hdr = { .op = op, .tree = tree, .arg = arg };
+
+  if (service_send(fd, &hdr, payload, len) != 0) {
+    return -1;
+  }
+  if (service_recv(fd, resp, resp_payload, SIZE_MAX) != 0) {
+    return -1;
+  }
+
+  return resp->status;
+}
+
+// Tree built by service, laid out same as `merklize_inplace( ... )` expects
+typedef struct
+{
+  size_t leaf_count;
+  size_t height;
+  cl_uchar* nodes; // 2N nodes
+} service_tree_t;
+
+// Merklize request, waiting to be batched
+typedef struct
+{
+  int fd;
+  service_hdr_t hdr;
+  cl_uchar* leaves;
+  cl_ulong received; // when
+} service_pending_t;
+
+// Request being received on a connection; sockets are read without blocking,
+// whatever has arrived, so that a client sending its request slowly doesn't
+// stall others
+typedef struct
+{
+  service_hdr_t hdr;
+  size_t hdr_got;    // bytes of header received
+  cl_uchar* payload; // NULL, when payload is empty or being discarded
+  cl_ulong got;      // bytes of payload received
+  int rejected;      // payload is being discarded, request already answered
+  cl_ulong received; // when header was completely received
+} service_conn_t;
+
+typedef struct
+{
+  cl_context ctx;
+  cl_command_queue cq;
+  cl_kernel krnl; // `merklize` kernel
+  size_t wg_size; // 0, for letting runtime decide
+
+  const char* path;
+  int listen_fd;
+
+  size_t max_log;     // largest tree served has 2 ^ max_log leaves
+  size_t batch_log;   // merklize requests upto 2 ^ batch_log leaves are batched
+  cl_ulong batch_ns;  // how long oldest pending request may wait
+  size_t batch_bytes; // pending leaves are dispatched when they reach it
+
+  struct pollfd* fds; // first one is listening socket
+  service_conn_t* conns; // parallel to `fds`, first one is unused
+  size_t fd_cnt;
+  size_t fd_cap;
+
+  service_pending_t* pending;
+  size_t pend_cnt;
+  size_t pend_cap;
+  size_t pend_bytes;
+  cl_ulong pend_since; // when oldest pending request was received
+
+  service_tree_t** trees; // indexed by tree id - 1, NULL once released
+  size_t tree_cnt;
+  size_t tree_cap;
+
+  service_stats_t stats;
+  cl_ulong started;
+
+  atomic_int stop; // set for stopping `service_run( ... )`
+} service_t;
+
+// Starts listening at given path ( any stale socket file is replaced ),
+// returning 0 on success, otherwise -1, with `errno` set
+int
+service_init(service_t* const srv,
+             cl_context ctx,
+             cl_command_queue cq,
+             cl_kernel krnl,
+             size_t wg_size,
+             const char* path)
+{
+  memset(srv, 0, sizeof(service_t));
+
+  srv->ctx = ctx;
+  srv->cq = cq;
+  srv->krnl = krnl;
+  srv->wg_size = wg_size;
+  srv->path = path;
+  srv->max_log = 27;
+  srv->batch_log = 16;
+  srv->batch_ns = 1000000ul;
+  srv->batch_bytes = (size_t)1 << 26;
+  srv->started = service_now_ns();
+  atomic_init(&srv->stop, 0);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  srv->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (srv->listen_fd < 0) {
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(srv->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(srv->listen_fd, 64) != 0) {
+    close(srv->listen_fd);
+    return -1;
+  }
+
+  srv->fd_cap = 16;
+  srv->fds = (struct pollfd*)malloc(sizeof(struct pollfd) * srv->fd_cap);
+  check_mem_alloc(srv->fds);
+  srv->conns = (service_conn_t*)calloc(srv->fd_cap, sizeof(service_conn_t));
+  check_mem_alloc(srv->conns);
+
+  srv->fds[0] = (struct pollfd){ .fd = srv->listen_fd, .events = POLLIN };
+  srv->fd_cnt = 1;
+
+  return 0;
+}
+
+// Sends response to request & accounts for its latency
+void
+service_reply(service_t* const srv,
+              int fd,
+              const service_hdr_t* req,
+              cl_ushort status,
+              cl_ulong tree,
+              cl_ulong arg,
+              const void* payload,
+              size_t len,
+              cl_ulong received)
+{
+  service_hdr_t hdr = { .op = req->op,
+                        .status = status,
+                        .tag = req->tag,
+                        .tree = tree,
+                        .arg = arg };
+
+  // failing to send is noticed, when connection is polled next time
+  service_send(fd, &hdr, payload, len);
+
+  const cl_ulong latency = service_now_ns() - received;
+
+  srv->stats.bytes_out += sizeof(service_hdr_t) + len;
+  srv->stats.errors += status != SERVICE_OK;
+  srv->stats.latency_cnt++;
+  srv->stats.latency_sum += latency;
+  if (latency > srv->stats.latency_max) {
+    srv->stats.latency_max = latency;
+  }
+}
+
+service_tree_t*
+service_tree_get(const service_t* srv, cl_ulong id)
+{
+  if (id == 0 || id > srv->tree_cnt) {
+    return NULL;
+  }
+  return *(srv->trees + id - 1);
+}
+
+// Takes ownership of tree, returning its id
+cl_ulong
+service_tree_put(service_t* const srv, service_tree_t* const tree)
+{
+  if (srv->tree_cnt == srv->tree_cap) {
+    srv->tree_cap = srv->tree_cap == 0 ? 64 : srv->tree_cap << 1;
+    srv->trees = (service_tree_t**)realloc(
+      srv->trees, sizeof(service_tree_t*) * srv->tree_cap);
+    check_mem_alloc(srv->trees);
+  }
+
+  *(srv->trees + srv->tree_cnt++) = tree;
+  srv->stats.trees++;
+
+  return srv->tree_cnt;
+}
+
+void
+service_tree_free(service_tree_t* const tree)
+{
+  host_tree_free(tree->nodes, tree->leaf_count << 6);
+  free(tree);
+}
+
+service_tree_t*
+service_tree_alloc(size_t leaf_count)
+{
+  service_tree_t* const tree = (service_tree_t*)malloc(sizeof(service_tree_t));
+  check_mem_alloc(tree);
+
+  tree->leaf_count = leaf_count;
+  tree->height = (size_t)log2((double)leaf_count);
+  // page aligned, so that device may use it without copying
+  tree->nodes = (cl_uchar*)host_tree_alloc(leaf_count << 6);
+  check_mem_alloc(tree->nodes);
+
+  return tree;
+}
+
+// Merklizes `cnt` -many requests, all having same leaf count, together, as
+// one forest, using `merklize_forest( ... )`, then splits forest into trees
+// & responds to each request
+void
+service_build(service_t* const srv, service_pending_t* const reqs, size_t cnt)
+{
+  const size_t m = (size_t)reqs->hdr.arg; // leaves per tree
+  const size_t f_leaves = m * cnt;
+  const size_t rounds = (size_t)log2((double)m);
+
+  // single tree is built in its own allocation, as is
+  service_tree_t* const forest = service_tree_alloc(f_leaves);
+
+  for (size_t i = 0; i < cnt; i++) {
+    memcpy(forest->nodes + ((f_leaves + i * m) << 5),
+           (reqs + i)->leaves,
+           m << 5);
+  }
+
+  const cl_ulong t0 = service_now_ns();
+
+  cl_ulong ts[3];
+  const cl_int status = merklize_forest(srv->ctx,
+                                        srv->cq,
+                                        srv->krnl,
+                                        forest->nodes,
+                                        f_leaves << 6,
+                                        f_leaves,
+                                        rounds,
+                                        srv->wg_size,
+                                        ts,
+                                        NULL);
+
+  srv->stats.build_ns += service_now_ns() - t0;
+  srv->stats.dispatches++;
+  srv->stats.batched += cnt > 1 ? cnt : 0;
+
+  if (status != CL_SUCCESS) {
+    for (size_t i = 0; i < cnt; i++) {
+      const service_pending_t* req = reqs + i;
+      service_reply(srv,
+                    req->fd,
+                    &req->hdr,
+                    SERVICE_EDEVICE,
+                    0,
+                    0,
+                    NULL,
+                    0,
+                    req->received);
+    }
+
+    service_tree_free(forest);
+    return;
+  }
+
+  srv->stats.leaves += f_leaves;
+
+  for (size_t i = 0; i < cnt; i++) {
+    service_tree_t* tree = forest;
+
+    if (cnt > 1) {
+      tree = service_tree_alloc(m);
+
+      // level l of i-th tree of forest lives at [(cnt * m >> l) + i * (m >> l),
+      // ...), which is placed at [m >> l, 2m >> l) in its own tree
+      for (size_t l = 0; l <= rounds; l++) {
+        const size_t n = m >> l;
+
+        memcpy(tree->nodes + (n << 5),
+               forest->nodes + (((f_leaves >> l) + i * n) << 5),
+               n << 5);
+      }
+    }
+
+    const service_pending_t* req = reqs + i;
+    const cl_ulong id = service_tree_put(srv, tree);
+
+    service_reply(srv,
+                  req->fd,
+                  &req->hdr,
+                  SERVICE_OK,
+                  id,
+                  0,
+                  tree->nodes + 32,
+                  32,
+                  req->received);
+  }
+
+  if (cnt > 1) {
+    service_tree_free(forest);
+  }
+}
+
+int
+service_pending_cmp(const void* a, const void* b)
+{
+  const cl_ulong a_ = ((const service_pending_t*)a)->hdr.arg;
+  const cl_ulong b_ = ((const service_pending_t*)b)->hdr.arg;
+
+  return a_ < b_ ? -1 : (a_ > b_ ? 1 : 0);
+}
+
+// Dispatches all pending merklize requests, one forest per distinct leaf
+// count
+void
+service_flush(service_t* const srv)
+{
+  // stable w.r.t. arrival order isn't required, ids are handed out per tree
+  qsort(srv->pending,
+        srv->pend_cnt,
+        sizeof(service_pending_t),
+        service_pending_cmp);
+
+  for (size_t i = 0; i < srv->pend_cnt;) {
+    size_t j = i + 1;
+    while (j < srv->pend_cnt &&
+           (srv->pending + j)->hdr.arg == (srv->pending + i)->hdr.arg) {
+      j++;
+    }
+
+    service_build(srv, srv->pending + i, j - i);
+    i = j;
+  }
+
+  for (size_t i = 0; i < srv->pend_cnt; i++) {
+    free((srv->pending + i)->leaves);
+  }
+
+  srv->pend_cnt = 0;
+  srv->pend_bytes = 0;
+}
+
+// Merklize request, which takes ownership of leaves
+void
+service_merklize(service_t* const srv,
+                 int fd,
+                 const service_hdr_t* hdr,
+                 cl_uchar* leaves,
+                 cl_ulong received)
+{
+  const size_t n = (size_t)hdr->arg;
+
+  if (n < 2 || (n & (n - 1)) != 0 || n > ((size_t)1 << srv->max_log) ||
+      hdr->len != (cl_ulong)n << 5) {
+    service_reply(srv, fd, hdr, SERVICE_EINVAL, 0, 0, NULL, 0, received);
+    free(leaves);
+    return;
+  }
+
+  const service_pending_t req = {
+    .fd = fd, .hdr = *hdr, .leaves = leaves, .received = received
+  };
+
+  if (n > ((size_t)1 << srv->batch_log)) {
+    service_build(srv, (service_pending_t*)&req, 1);
+    free(leaves);
+    return;
+  }
+
+  if (srv->pend_cnt == srv->pend_cap) {
+    srv->pend_cap = srv->pend_cap == 0 ? 64 : srv->pend_cap << 1;
+    srv->pending = (service_pending_t*)realloc(
+      srv->pending, sizeof(service_pending_t) * srv->pend_cap);
+    check_mem_alloc(srv->pending);
+  }
+
+  if (srv->pend_cnt == 0) {
+    srv->pend_since = received;
+  }
+
+  *(srv->pending + srv->pend_cnt++) = req;
+  srv->pend_bytes += n << 5;
+
+  if (srv->pend_bytes >= srv->batch_bytes) {
+    service_flush(srv);
+  }
+}
+
+int
+service_size_cmp(const void* a, const void* b)
+{
+  const size_t a_ = *(const size_t*)a;
+  const size_t b_ = *(const size_t*)b;
+
+  return a_ < b_ ? -1 : (a_ > b_ ? 1 : 0);
+}
+
+// Sets leaves & rehashes, on host, only parents on their paths to root, level
+// by level, so that shared ancestors are hashed once
+void
+service_update(service_tree_t* const tree,
+               const cl_uchar* updates, // cnt -many ( index, leaf ) pairs
+               size_t cnt)
+{
+  size_t* touched = (size_t*)malloc(sizeof(size_t) * cnt);
+  check_mem_alloc(touched);
+
+  for (size_t i = 0; i < cnt; i++) {
+    cl_ulong idx;
+    memcpy(&idx, updates + i * 40, sizeof(idx));
+
+    *(touched + i) = tree->leaf_count + (size_t)idx;
+    memcpy(tree->nodes + (*(touched + i) << 5), updates + i * 40 + 8, 32);
+  }
+
+  qsort(touched, cnt, sizeof(size_t), service_size_cmp);
+
+  size_t t_cnt = cnt;
+  for (size_t h = 0; h < tree->height; h++) {
+    // parents of sorted nodes remain sorted, so unique ones are kept in place
+    size_t p_cnt = 0;
+    for (size_t i = 0; i < t_cnt; i++) {
+      const size_t p = *(touched + i) >> 1;
+
+      if (p_cnt == 0 || *(touched + p_cnt - 1) != p) {
+        *(touched + p_cnt++) = p;
+      }
+    }
+    t_cnt = p_cnt;
+
+    for (size_t i = 0; i < t_cnt; i++) {
+      const size_t p = *(touched + i);
+      blake3_hash_pair_host(tree->nodes + (p << 6), tree->nodes + (p << 5));
+    }
+  }
+
+  free(touched);
+}
+
+// Drops pending requests of connection, which is going away, so that their
+// responses aren't sent to some other connection, reusing same descriptor
+void
+service_drop_pending(service_t* const srv, int fd)
+{
+  size_t k = 0;
+
+  for (size_t i = 0; i < srv->pend_cnt; i++) {
+    service_pending_t* const req = srv->pending + i;
+
+    if (req->fd == fd) {
+      srv->pend_bytes -= (size_t)req->hdr.arg << 5;
+      free(req->leaves);
+    } else {
+      *(srv->pending + k++) = *req;
+    }
+  }
+
+  srv->pend_cnt = k;
+}
+
+// Longest payload request, with given header, may carry; it's known before
+// payload is received, so that payload is never allocated for more than
+// what's served
+cl_ulong
+service_max_len(const service_t* srv, const service_hdr_t* hdr)
+{
+  if (hdr->op == SERVICE_MERKLIZE) {
+    return (cl_ulong)32 << srv->max_log;
+  }
+  if (hdr->op == SERVICE_UPDATE) {
+    const service_tree_t* tree = service_tree_get(srv, hdr->tree);
+    return tree != NULL ? (cl_ulong)tree->leaf_count * 40 : 0;
+  }
+  return 0;
+}
+
+// Serves one completely received request, taking ownership of its payload
+void
+service_handle(service_t* const srv,
+               int fd,
+               service_hdr_t hdr,
+               cl_uchar* payload,
+               cl_ulong received)
+{
+  if (hdr.op == SERVICE_MERKLIZE) {
+    service_merklize(srv, fd, &hdr, payload, received);
+    return;
+  }
+
+  if (hdr.op == SERVICE_STATS) {
+    service_stats_t stats = srv->stats;
+    stats.uptime = received - srv->started;
+
+    service_reply(srv,
+                  fd,
+                  &hdr,
+                  SERVICE_OK,
+                  0,
+                  0,
+                  &stats,
+                  sizeof(stats),
+                  received);
+    free(payload);
+    return;
+  }
+
+  service_tree_t* const tree = service_tree_get(srv, hdr.tree);
+
+  if (tree == NULL) {
+    const cl_ushort status =
+      hdr.op > 0 && hdr.op < SERVICE_OP_COUNT ? SERVICE_ENOENT : SERVICE_EINVAL;
+
+    service_reply(srv, fd, &hdr, status, hdr.tree, 0, NULL, 0, received);
+    free(payload);
+    return;
+  }
+
+  switch (hdr.op) {
+    case SERVICE_ROOT:
+      service_reply(srv,
+                    fd,
+                    &hdr,
+                    SERVICE_OK,
+                    hdr.tree,
+                    0,
+                    tree->nodes + 32,
+                    32,
+                    received);
+      break;
+
+    case SERVICE_PROOF:
+      if (hdr.arg >= tree->leaf_count) {
+        service_reply(
+          srv, fd, &hdr, SERVICE_EINVAL, hdr.tree, 0, NULL, 0, received);
+        break;
+      }
+
+      {
+        // leaf, followed by its siblings on path to root, bottom-up
+        cl_uchar* proof = (cl_uchar*)malloc((tree->height + 1) << 5);
+        check_mem_alloc(proof);
+
+        size_t node = tree->leaf_count + (size_t)hdr.arg;
+        memcpy(proof, tree->nodes + (node << 5), 32);
+
+        for (size_t h = 0; h < tree->height; h++, node >>= 1) {
+          memcpy(proof + ((h + 1) << 5), tree->nodes + ((node ^ 1) << 5), 32);
+        }
+
+        service_reply(srv,
+                      fd,
+                      &hdr,
+                      SERVICE_OK,
+                      hdr.tree,
+                      tree->height,
+                      proof,
+                      (tree->height + 1) << 5,
+                      received);
+        free(proof);
+      }
+      break;
+
+    case SERVICE_UPDATE: {
+      int valid = hdr.len > 0 && hdr.len % 40 == 0 && hdr.arg == hdr.len / 40;
+
+      for (size_t i = 0; valid && i < hdr.arg; i++) {
+        cl_ulong idx;
+        memcpy(&idx, payload + i * 40, sizeof(idx));
+        valid = idx < tree->leaf_count;
+      }
+
+      if (valid) {
+        service_update(tree, payload, (size_t)hdr.arg);
+      }
+
+      service_reply(srv,
+                    fd,
+                    &hdr,
+                    valid ? SERVICE_OK : SERVICE_EINVAL,
+                    hdr.tree,
+                    0,
+                    valid ? tree->nodes + 32 : NULL,
+                    valid ? 32 : 0,
+                    received);
+    } break;
+
+    case SERVICE_RELEASE:
+      service_tree_free(tree);
+      *(srv->trees + hdr.tree - 1) = NULL;
+      srv->stats.trees--;
+
+      service_reply(srv, fd, &hdr, SERVICE_OK, hdr.tree, 0, NULL, 0, received);
+      break;
+
+    default:
+      service_reply(
+        srv, fd, &hdr, SERVICE_EINVAL, hdr.tree, 0, NULL, 0, received);
+      break;
+  }
+
+  free(payload);
+}
+
+// Receives whatever has arrived on connection, without blocking, serving
+// request once it's completely received, returning -1 when connection is to
+// be closed
+//
+// Request carrying longer payload than what its op allows is answered right
+// away, with SERVICE_EINVAL, while its payload is read & discarded, so that
+// connection stays in sync with client
+int
+service_conn_read(service_t* const srv,
+                  int fd,
+                  service_conn_t* const conn)
+{
+  cl_uchar discard[4096];
+
+  while (1) {
+    cl_uchar* dst;
+    size_t want;
+
+    if (conn->hdr_got < sizeof(service_hdr_t)) {
+      dst = (cl_uchar*)&conn->hdr + conn->hdr_got;
+      want = sizeof(service_hdr_t) - conn->hdr_got;
+    } else {
+      const cl_ulong left = conn->hdr.len - conn->got;
+
+      dst = conn->payload != NULL ? conn->payload + conn->got : discard;
+      want = conn->payload != NULL || left < sizeof(discard) ? (size_t)left
+                                                             : sizeof(discard);
+    }
+
+    const ssize_t n = recv(fd, dst, want, MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    if (conn->hdr_got < sizeof(service_hdr_t)) {
+      conn->hdr_got += (size_t)n;
+      if (conn->hdr_got < sizeof(service_hdr_t)) {
+        continue;
+      }
+
+      const service_hdr_t* hdr = &conn->hdr;
+      if (hdr->magic != SERVICE_MAGIC) {
+        return -1;
+      }
+
+      conn->received = service_now_ns();
+
+      srv->stats.bytes_in += sizeof(service_hdr_t) + hdr->len;
+      if (hdr->op > 0 && hdr->op < SERVICE_OP_COUNT) {
+        srv->stats.requests[hdr->op]++;
+      }
+
+      if (hdr->len > service_max_len(srv, hdr)) {
+        conn->rejected = 1;
+        service_reply(
+          srv, fd, hdr, SERVICE_EINVAL, hdr->tree, 0, NULL, 0, conn->received);
+      } else if (hdr->len > 0) {
+        conn->payload = (cl_uchar*)malloc((size_t)hdr->len);
+        check_mem_alloc(conn->payload);
+      }
+    } else {
+      conn->got += (cl_ulong)n;
+    }
+
+    if (conn->got < conn->hdr.len) {
+      continue;
+    }
+
+    if (!conn->rejected) {
+      service_handle(srv, fd, conn->hdr, conn->payload, conn->received);
+    }
+    memset(conn, 0, sizeof(service_conn_t));
+
+    // one request per connection, per poll, so that a client pipelining
+    // many requests doesn't starve others
+    return 0;
+  }
+}
+
+// Accepts connections & serves requests, till `stop` is set, which is
+// noticed within 100 ms
+void
+service_run(service_t* const srv)
+{
+  while (!atomic_load(&srv->stop)) {
+    int timeout = 100; // ms
+
+    if (srv->pend_cnt > 0) {
+      const cl_ulong now = service_now_ns();
+      const cl_ulong due = srv->pend_since + srv->batch_ns;
+
+      if (now >= due) {
+        service_flush(srv);
+      } else {
+        timeout = (int)((due - now + 999999ul) / 1000000ul);
+      }
+    }
+
+    const int n = poll(srv->fds, srv->fd_cnt, timeout);
+    if (n <= 0) {
+      continue;
+    }
+
+    // connections are served in order, only then new ones are accepted, so
+    // that accepting doesn't disturb what's being iterated over
+    for (size_t i = 1; i < srv->fd_cnt;) {
+      struct pollfd* const p = srv->fds + i;
+
+      service_conn_t* const conn = srv->conns + i;
+
+      if ((p->revents & (POLLIN | POLLHUP | POLLERR)) != 0 &&
+          service_conn_read(srv, p->fd, conn) != 0) {
+        service_drop_pending(srv, p->fd);
+        close(p->fd);
+        free(conn->payload);
+
+        srv->fd_cnt--;
+        *p = *(srv->fds + srv->fd_cnt);
+        *conn = *(srv->conns + srv->fd_cnt);
+        continue;
+      }
+
+      i++;
+    }
+
+    if ((srv->fds->revents & POLLIN) != 0) {
+      const int fd = accept(srv->listen_fd, NULL, NULL);
+
+      if (fd >= 0) {
+        // requests are received without blocking, while a client not
+        // reading its responses can't stall service for more than a second
+        const struct timeval tv = { .tv_sec = 1 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        if (srv->fd_cnt == srv->fd_cap) {
+          srv->fd_cap <<= 1;
+          srv->fds = (struct pollfd*)realloc(
+            srv->fds, sizeof(struct pollfd) * srv->fd_cap);
+          check_mem_alloc(srv->fds);
+          srv->conns = (service_conn_t*)realloc(
+            srv->conns, sizeof(service_conn_t) * srv->fd_cap);
+          check_mem_alloc(srv->conns);
+        }
+
+        memset(srv->conns + srv->fd_cnt, 0, sizeof(service_conn_t));
+        *(srv->fds + srv->fd_cnt++) =
+          (struct pollfd){ .fd = fd, .events = POLLIN };
+      }
+    }
+  }
+
+  if (srv->pend_cnt > 0) {
+    service_flush(srv);
+  }
+}
+
+// Closes all connections & listening socket, releasing all trees held
+void
+service_close(service_t* const srv)
+{
+  for (size_t i = 0; i < srv->fd_cnt; i++) {
+    close((srv->fds + i)->fd);
+    free((srv->conns + i)->payload);
+  }
+  unlink(srv->path);
+
+  for (size_t i = 0; i < srv->pend_cnt; i++) {
+    free((srv->pending + i)->leaves);
+  }
+
+  for (size_t i = 0; i < srv->tree_cnt; i++) {
+    if (*(srv->trees + i) != NULL) {
+      service_tree_free(*(srv->trees + i));
+    }
+  }
+
+  free(srv->fds);
+  free(srv->conns);
+  free(srv->pending);
+  free(srv->trees);
+}
+
+// Writes counters in human readable form
+void
+service_stats_print(const service_stats_t* stats, FILE* fd)
+{
+  const double build_s = (double)stats->build_ns * 1e-9;
+  const double bytes = (double)(stats->leaves << 5);
+
+  fprintf(fd,
+          "uptime %.1lf s, requests ( merklize %lu, root %lu, proof %lu, "
+          "update %lu, stats %lu, release %lu ), errors %lu\n",
+          (double)stats->uptime * 1e-9,
+          stats->requests[SERVICE_MERKLIZE],
+          stats->requests[SERVICE_ROOT],
+          stats->requests[SERVICE_PROOF],
+          stats->requests[SERVICE_UPDATE],
+          stats->requests[SERVICE_STATS],
+          stats->requests[SERVICE_RELEASE],
+          stats->errors);
+  fprintf(fd,
+          "merklized %lu leaves in %lu dispatches ( %lu requests batched ), "
+          "%.4lf GB/s while building, %lu trees held\n",
+          stats->leaves,
+          stats->dispatches,
+          stats->batched,
+          build_s > 0. ? bytes / build_s * 1e-9 : 0.,
+          stats->trees);
+  fprintf(fd,
+          "latency mean %.1lf us, max %.1lf us, in %.1lf MB, out %.1lf MB\n",
+          stats->latency_cnt > 0
+            ? (double)stats->latency_sum / (double)stats->latency_cnt * 1e-3
+            : 0.,
+          (double)stats->latency_max * 1e-3,
+          (double)stats->bytes_in * 1e-6,
+          (double)stats->bytes_out * 1e-6);
+}
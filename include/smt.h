@@ -0,0 +1,450 @@
+#pragma once
+#include "host_blake3.h"
+
+// Sparse merkle tree, having 2 ^ D leaves ( D <= 64 ), where almost all leaves
+// are empty i.e. 32 -bytes of zeros, so it can't be built using
+// `merklize( ... )`, which requires all leaves to be present in memory
+//
+// Whole subtree of height h, having only empty leaves, hashes to same default
+// value, which is precomputed for each height, as
+//
+// default[0] = 0 ^ 32
+// default[h] = blake3( default[h - 1] || default[h - 1] )
+//
+// so only non-default nodes are stored, in an open addressing hash table,
+// keyed by ( height, index ), where height of leaves is 0 & root is at height
+// D, having index 0. Node at ( h, i ) has children at ( h - 1, 2i ) &
+// ( h - 1, 2i + 1 ), same as in dense tree built by `merklize( ... )`, so
+// when all leaves are present, both produce same root.
+
+// One slot of open addressing hash table
+typedef struct
+{
+  cl_ulong index;
+  cl_uint height;
+  cl_uint used; // is slot occupied ?
+  cl_uchar hash[32];
+} smt_slot_t;
+
+typedef struct
+{
+  size_t depth;       // D, so that tree has 2 ^ D leaves
+  cl_uchar* defaults; // ( D + 1 ) -many default hashes, of 32 -bytes each
+  smt_slot_t* slots;  // linear probing hash table
+  size_t cap;         // # -of slots, always power of 2
+  size_t count;       // # -of occupied slots i.e. non-default nodes
+} smt_t;
+
+// Optionally, parent nodes touched by batch update can be hashed on device,
+// using `merklize` kernel ( compiled with `ocl_kernel_flag_2` ), when a level
+// has enough of them; otherwise they're hashed on host
+typedef struct
+{
+  cl_context ctx;
+  cl_command_queue cq;
+  cl_kernel krnl;
+  size_t min_pairs; // levels with fewer touched parents are hashed on host
+} smt_device_t;
+
+// Index of node at given height, on path from leaf with given key to root
+cl_ulong
+smt_index(cl_ulong key, size_t height)
+{
+  return height >= 64 ? 0 : key >> height;
+}
+
+// Mixes ( height, index ) into slot index, using splitmix64 finalizer, see
+// https://xorshift.di.unimi.it/splitmix64.c
+size_t
+smt_slot_of(const smt_t* smt, size_t height, cl_ulong index)
+{
+  cl_ulong z = index + ((cl_ulong)height << 58) + 0x9e3779b97f4a7c15ul;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ul;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebul;
+  z = z ^ (z >> 31);
+
+  return (size_t)z & (smt->cap - 1);
+}
+
+// Initializes empty sparse merkle tree with 2 ^ depth leaves, precomputing
+// default hash of each height
+void
+smt_init(smt_t* const smt, size_t depth)
+{
+  assert(depth > 0 && depth <= 64);
+
+  smt->depth = depth;
+  smt->cap = 1 << 10;
+  smt->count = 0;
+
+  smt->slots = (smt_slot_t*)calloc(smt->cap, sizeof(smt_slot_t));
+  check_mem_alloc(smt->slots);
+  smt->defaults = (cl_uchar*)calloc(depth + 1, 32);
+  check_mem_alloc(smt->defaults);
+
+  cl_uchar msg[64];
+  for (size_t h = 1; h <= depth; h++) {
+    memcpy(msg, smt->defaults + ((h - 1) << 5), 32);
+    memcpy(msg + 32, smt->defaults + ((h - 1) << 5), 32);
+
+    blake3_hash_pair_host(msg, smt->defaults + (h << 5));
+  }
+}
+
+void
+smt_free(smt_t* const smt)
+{
+  free(smt->slots);
+  free(smt->defaults);
+  memset(smt, 0, sizeof(smt_t));
+}
+
+// Finds slot holding node ( height, index ), or empty slot where it'd be
+// placed, when it's not present
+smt_slot_t*
+smt_find(const smt_t* smt, size_t height, cl_ulong index)
+{
+  size_t s = smt_slot_of(smt, height, index);
+
+  while (1) {
+    smt_slot_t* const slot = smt->slots + s;
+
+    if (!slot->used || (slot->height == height && slot->index == index)) {
+      return slot;
+    }
+
+    s = (s + 1) & (smt->cap - 1);
+  }
+}
+
+// Returns 32 -bytes hash of node ( height, index ), which is default hash of
+// that height, when node isn't stored
+const cl_uchar*
+smt_get(const smt_t* smt, size_t height, cl_ulong index)
+{
+  const smt_slot_t* slot = smt_find(smt, height, index);
+  return slot->used ? slot->hash : smt->defaults + (height << 5);
+}
+
+// Doubles capacity of hash table, reinserting all occupied slots
+void
+smt_grow(smt_t* const smt)
+{
+  smt_slot_t* const old = smt->slots;
+  const size_t old_cap = smt->cap;
+
+  smt->cap <<= 1;
+  smt->slots = (smt_slot_t*)calloc(smt->cap, sizeof(smt_slot_t));
+  check_mem_alloc(smt->slots);
+
+  for (size_t i = 0; i < old_cap; i++) {
+    if ((old + i)->used) {
+      *smt_find(smt, (old + i)->height, (old + i)->index) = *(old + i);
+    }
+  }
+
+  free(old);
+}
+
+// Removes node from occupied slot, shifting following slots of same probe
+// sequence backwards, so that no tombstone is required
+void
+smt_erase(smt_t* const smt, smt_slot_t* slot)
+{
+  size_t hole = (size_t)(slot - smt->slots);
+  size_t s = hole;
+
+  while (1) {
+    s = (s + 1) & (smt->cap - 1);
+
+    smt_slot_t* const next = smt->slots + s;
+    if (!next->used) {
+      break;
+    }
+
+    // slot where `next` would ideally live; it can be moved into hole only
+    // if that's not cyclically in ( hole, s ]
+    const size_t home = smt_slot_of(smt, next->height, next->index);
+    const size_t d_home = (s - home) & (smt->cap - 1);
+    const size_t d_hole = (s - hole) & (smt->cap - 1);
+
+    if (d_home >= d_hole) {
+      *(smt->slots + hole) = *next;
+      hole = s;
+    }
+  }
+
+  (smt->slots + hole)->used = 0;
+  smt->count--;
+}
+
+// Sets hash of node ( height, index ), storing it only when it's not default
+void
+smt_set(smt_t* const smt, size_t height, cl_ulong index, const cl_uchar* hash)
+{
+  const int is_default = memcmp(hash, smt->defaults + (height << 5), 32) == 0;
+  smt_slot_t* slot = smt_find(smt, height, index);
+
+  if (slot->used) {
+    if (is_default) {
+      smt_erase(smt, slot);
+    } else {
+      memcpy(slot->hash, hash, 32);
+    }
+    return;
+  }
+
+  if (is_default) {
+    return;
+  }
+
+  // keeping load factor <= 1/2
+  if ((smt->count + 1) << 1 > smt->cap) {
+    smt_grow(smt);
+    slot = smt_find(smt, height, index);
+  }
+
+  *slot = (smt_slot_t){ .index = index, .height = (cl_uint)height, .used = 1 };
+  memcpy(slot->hash, hash, 32);
+  smt->count++;
+}
+
+// Root of sparse merkle tree, written to 32 -bytes output
+void
+smt_root(const smt_t* smt, cl_uchar* const root)
+{
+  memcpy(root, smt_get(smt, smt->depth, 0), 32);
+}
+
+// Hashes `cnt` -many 64 -bytes messages ( each being two children ) to
+// 32 -bytes parents, on device, by dispatching `merklize` kernel once, with
+// both input & output offsets set to 0
+cl_int
+smt_hash_pairs_device(const smt_device_t* dev,
+                      const cl_uchar* msgs,
+                      cl_uchar* const out,
+                      size_t cnt)
+{
+  cl_int status;
+
+  const size_t i_size = cnt << 6;
+  const size_t o_size = cnt << 5;
+  const int le = host_is_little_endian();
+
+  // on little endian host, bytes already are words, as kernel expects them
+  cl_uint* i_words = (cl_uint*)msgs;
+  cl_uint* o_words = (cl_uint*)out;
+
+  if (!le) {
+    i_words = (cl_uint*)malloc(i_size);
+    check_mem_alloc(i_words);
+    o_words = (cl_uint*)malloc(o_size);
+    check_mem_alloc(o_words);
+
+    words_from_le_bytes(msgs, i_size, i_words, i_size >> 2);
+  }
+
+  size_t offset = 0;
+
+  cl_mem i_buf = clCreateBuffer(dev->ctx,
+                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                i_size,
+                                i_words,
+                                &status);
+  check_for_error_and_return(status);
+  cl_mem o_buf =
+    clCreateBuffer(dev->ctx, CL_MEM_WRITE_ONLY, o_size, NULL, &status);
+  check_for_error_and_return(status);
+  cl_mem off_buf = clCreateBuffer(dev->ctx,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  sizeof(size_t),
+                                  &offset,
+                                  &status);
+  check_for_error_and_return(status);
+
+  clSetKernelArg(dev->krnl, 0, sizeof(cl_mem), &i_buf);
+  clSetKernelArg(dev->krnl, 1, sizeof(cl_mem), &off_buf);
+  clSetKernelArg(dev->krnl, 2, sizeof(cl_mem), &o_buf);
+  clSetKernelArg(dev->krnl, 3, sizeof(cl_mem), &off_buf);
+
+  size_t glb_work_items[] = { cnt };
+
+  cl_event evt_0;
+  status = clEnqueueNDRangeKernel(
+    dev->cq, dev->krnl, 1, NULL, glb_work_items, NULL, 0, NULL, &evt_0);
+  check_for_error_and_return(status);
+
+  status = clEnqueueReadBuffer(
+    dev->cq, o_buf, CL_TRUE, 0, o_size, o_words, 1, &evt_0, NULL);
+  check_for_error_and_return(status);
+
+  if (!le) {
+    words_to_le_bytes(o_words, o_size >> 2, out, o_size);
+
+    free(i_words);
+    free(o_words);
+  }
+
+  clReleaseEvent(evt_0);
+  clReleaseMemObject(i_buf);
+  clReleaseMemObject(o_buf);
+  clReleaseMemObject(off_buf);
+
+  return CL_SUCCESS;
+}
+
+// Key of batch update, along with its position in batch, so that when same
+// key appears more than once, last value wins
+typedef struct
+{
+  cl_ulong key;
+  size_t pos;
+} smt_key_t;
+
+int
+smt_key_cmp(const void* a, const void* b)
+{
+  const smt_key_t* a_ = (const smt_key_t*)a;
+  const smt_key_t* b_ = (const smt_key_t*)b;
+
+  if (a_->key != b_->key) {
+    return a_->key < b_->key ? -1 : 1;
+  }
+  return a_->pos < b_->pos ? -1 : (a_->pos > b_->pos ? 1 : 0);
+}
+
+// Sets `cnt` -many leaves, where i-th leaf key is keys[i] & its 32 -bytes
+// value lives at values + 32 * i; setting leaf to 32 zero bytes removes it
+//
+// Keys are sorted & then tree is updated level by level, where at each level
+// only parents of nodes touched in previous level are rehashed, so a batch of
+// K keys costs at most K * D hashes, shared paths being hashed only once
+//
+// When `dev` is non-NULL, levels with at least `dev->min_pairs` touched
+// parents are hashed on device, in a single kernel dispatch per level
+cl_int
+smt_update(smt_t* const smt,
+           const cl_ulong* keys,
+           const cl_uchar* values,
+           size_t cnt,
+           const smt_device_t* dev)
+{
+  if (cnt == 0) {
+    return CL_SUCCESS;
+  }
+
+  smt_key_t* sorted = (smt_key_t*)malloc(sizeof(smt_key_t) * cnt);
+  check_mem_alloc(sorted);
+
+  for (size_t i = 0; i < cnt; i++) {
+    assert(smt->depth == 64 || (*(keys + i) >> smt->depth) == 0);
+    *(sorted + i) = (smt_key_t){ .key = *(keys + i), .pos = i };
+  }
+
+  qsort(sorted, cnt, sizeof(smt_key_t), smt_key_cmp);
+
+  // sorted unique indices of nodes touched at current level
+  cl_ulong* touched = (cl_ulong*)malloc(sizeof(cl_ulong) * cnt);
+  check_mem_alloc(touched);
+  size_t t_cnt = 0;
+
+  for (size_t i = 0; i < cnt; i++) {
+    // for duplicate keys, only last one ( by position in batch ) is applied
+    if (i + 1 < cnt && (sorted + i + 1)->key == (sorted + i)->key) {
+      continue;
+    }
+
+    smt_set(smt, 0, (sorted + i)->key, values + ((sorted + i)->pos << 5));
+    *(touched + t_cnt++) = (sorted + i)->key;
+  }
+
+  free(sorted);
+
+  cl_uchar* msgs = (cl_uchar*)malloc(t_cnt << 6);
+  check_mem_alloc(msgs);
+  cl_uchar* out = (cl_uchar*)malloc(t_cnt << 5);
+  check_mem_alloc(out);
+
+  cl_int status = CL_SUCCESS;
+
+  for (size_t h = 0; h < smt->depth; h++) {
+    // parents of touched nodes, which remain sorted & unique, can be written
+    // in place, because there're never more parents than children
+    size_t p_cnt = 0;
+    for (size_t i = 0; i < t_cnt; i++) {
+      const cl_ulong p = *(touched + i) >> 1;
+
+      if (p_cnt == 0 || *(touched + p_cnt - 1) != p) {
+        *(touched + p_cnt++) = p;
+      }
+    }
+    t_cnt = p_cnt;
+
+    // gathering both children of each touched parent
+    for (size_t i = 0; i < t_cnt; i++) {
+      const cl_ulong p = *(touched + i);
+
+      memcpy(msgs + (i << 6), smt_get(smt, h, p << 1), 32);
+      memcpy(msgs + (i << 6) + 32, smt_get(smt, h, (p << 1) | 1), 32);
+    }
+
+    if (dev != NULL && t_cnt >= dev->min_pairs) {
+      status = smt_hash_pairs_device(dev, msgs, out, t_cnt);
+      if (status != CL_SUCCESS) {
+        break;
+      }
+    } else {
+      for (size_t i = 0; i < t_cnt; i++) {
+        blake3_hash_pair_host(msgs + (i << 6), out + (i << 5));
+      }
+    }
+
+    for (size_t i = 0; i < t_cnt; i++) {
+      smt_set(smt, h + 1, *(touched + i), out + (i << 5));
+    }
+  }
+
+  free(touched);
+  free(msgs);
+  free(out);
+
+  return status;
+}
+
+// Writes D -many sibling hashes ( 32 -bytes each ), on path from leaf with
+// given key to root, bottom-up, so that leaf's inclusion ( or absence, when
+// its value is 32 zero bytes ) can be proved
+void
+smt_proof(const smt_t* smt, cl_ulong key, cl_uchar* const siblings)
+{
+  for (size_t h = 0; h < smt->depth; h++) {
+    const cl_ulong idx = smt_index(key, h);
+    memcpy(siblings + (h << 5), smt_get(smt, h, idx ^ 1), 32);
+  }
+}
+
+// Recomputes root from leaf value & its D -many sibling hashes, returning
+// truth value of whether it matches given root
+int
+smt_verify(const cl_uchar* root,
+           size_t depth,
+           cl_ulong key,
+           const cl_uchar* value,
+           const cl_uchar* siblings)
+{
+  cl_uchar msg[64];
+  cl_uchar node[32];
+
+  memcpy(node, value, 32);
+
+  for (size_t h = 0; h < depth; h++) {
+    const int is_right = (smt_index(key, h) & 1) == 1;
+
+    memcpy(msg + (is_right ? 32 : 0), node, 32);
+    memcpy(msg + (is_right ? 0 : 32), siblings + (h << 5), 32);
+
+    blake3_hash_pair_host(msg, node);
+  }
+
+  return memcmp(node, root, 32) == 0;
+}
@@ -1,5 +1,14 @@
 #pragma once
+#include "blocked.h"
+#include "diff.h"
 #include "hash.h"
+#include "host_merklize.h"
+#include "memo.h"
+#include "multi_device.h"
+#include "range.h"
+#include "service.h"
+#include "smt.h"
+#include "tree_file.h"
 #include "utils.h"
 
 // Tests hash_0( ... ) i.e. when opencl kernel `hash` is compiled
@@ -72,3 +81,1157 @@ test_hash_1(cl_context ctx, cl_command_queue cq, cl_kernel hash_krnl)
 
   return status;
 }
+
+// Random leaves of a tree, along with its intermediate nodes, computed on host
+// one pair of nodes at a time, which trees built by tests are checked against
+typedef struct
+{
+  size_t leaf_count;
+  size_t size; // of leaves, same as of intermediate nodes, in bytes
+  cl_uchar* in;
+  cl_uchar* expected;
+} test_tree_t;
+
+void
+test_tree_init(test_tree_t* const t, size_t leaf_count)
+{
+  t->leaf_count = leaf_count;
+  t->size = leaf_count << 5;
+
+  t->in = (cl_uchar*)malloc(t->size);
+  check_mem_alloc(t->in);
+  t->expected = (cl_uchar*)calloc(t->size, 1);
+  check_mem_alloc(t->expected);
+
+  random_input(t->in, t->size);
+
+  // children of node i are at 2i & 2i + 1, where ones at index >= N are
+  // leaves
+  for (size_t i = leaf_count - 1; i > 0; i--) {
+    const cl_uchar* children = i >= (leaf_count >> 1)
+                                 ? t->in + (((i << 1) - leaf_count) << 5)
+                                 : t->expected + (i << 6);
+    blake3_hash_pair_host(children, t->expected + (i << 5));
+  }
+}
+
+void
+test_tree_free(test_tree_t* const t)
+{
+  free(t->in);
+  free(t->expected);
+}
+
+// Whether intermediate nodes, laid out as `merklize( ... )` writes them, match
+// reference; node slot 0 is unused, so it isn't compared
+int
+test_tree_check(const test_tree_t* t, const cl_uchar* out)
+{
+  return memcmp(t->expected + 32, out + 32, t->size - 32) == 0;
+}
+
+// Tests that merklizing N leaves on multiple partitions ( one per NUMA node
+// sub-device, when device can be partitioned that way, otherwise two of them
+// on same device, each with its own context & queue ), split proportional to
+// calibrated throughput, produces same intermediate nodes as merklizing them
+// on host; also tests that subtrees are split proportional to unequal weights
+cl_int
+test_merklize_multi(cl_device_id dev_id)
+{
+  cl_int status;
+
+  // shares of 8 subtrees are 5.33 & 2.67, so second partition gets the one
+  // left over, having larger fractional share
+  device_part_t weighted[3] = { { .weight = 2. }, { .weight = 1. } };
+  size_t first[3], count[3];
+
+  split_subtrees(weighted, 2, 8, first, count);
+  assert(count[0] == 5 && count[1] == 3);
+  assert(first[0] == 0 && first[1] == 5);
+
+  // shares of 4 subtrees are 2, 1.33 & 0.67
+  weighted[0].weight = 3.;
+  weighted[1].weight = 2.;
+  weighted[2].weight = 1.;
+
+  split_subtrees(weighted, 3, 4, first, count);
+  assert(count[0] == 2 && count[1] == 1 && count[2] == 1);
+  assert(first[0] == 0 && first[1] == 2 && first[2] == 3);
+
+  test_tree_t t;
+  test_tree_init(&t, 1 << 21);
+
+  cl_uchar* out = (cl_uchar*)malloc(t.size);
+  check_mem_alloc(out);
+
+  cl_device_id* sub_devices = NULL;
+  cl_uint sub_cnt = 0;
+
+  // most devices can't be partitioned by NUMA node, in that case, or when
+  // there's only one NUMA node, both partitions live on device itself
+  status = create_numa_sub_devices(dev_id, &sub_devices, &sub_cnt);
+  if (status == CL_SUCCESS && sub_cnt < 2) {
+    for (cl_uint i = 0; i < sub_cnt; i++) {
+      clReleaseDevice(*(sub_devices + i));
+    }
+    free(sub_devices);
+
+    sub_devices = NULL;
+    sub_cnt = 0;
+  }
+
+  const size_t part_cnt = sub_cnt >= 2 ? sub_cnt : 2;
+
+  device_part_t* parts =
+    (device_part_t*)malloc(sizeof(device_part_t) * part_cnt);
+  check_mem_alloc(parts);
+
+  for (size_t i = 0; i < part_cnt; i++) {
+    status = device_part_init(
+      sub_devices != NULL ? *(sub_devices + i) : dev_id, parts + i);
+    check_for_error_and_return(status);
+  }
+
+  status = calibrate_device_parts(parts, part_cnt);
+  check_for_error_and_return(status);
+
+  // two subtrees, distributed among partitions by calibrated weights
+  cl_ulong ts[3];
+  status = merklize_multi(
+    parts, part_cnt, t.in, t.size, t.leaf_count, out, t.size, 1, ts);
+  check_for_error_and_return(status);
+
+  assert(test_tree_check(&t, out));
+
+  for (size_t i = 0; i < part_cnt; i++) {
+    device_part_release(parts + i);
+  }
+
+  for (cl_uint i = 0; i < sub_cnt; i++) {
+    clReleaseDevice(*(sub_devices + i));
+  }
+
+  free(sub_devices);
+  free(parts);
+
+  test_tree_free(&t);
+  free(out);
+
+  return status;
+}
+
+// Tests that merklizing N leaves on host, using work-stealing scheduler,
+// produces same intermediate nodes as hashing them one pair at a time
+cl_int
+test_merklize_host()
+{
+  test_tree_t t;
+  test_tree_init(&t, 1 << 20);
+
+  cl_uchar* out = (cl_uchar*)host_tree_alloc(t.size);
+  check_mem_alloc(out);
+
+  merklize_host(t.in, t.size, t.leaf_count, out, t.size, 0);
+
+  assert(test_tree_check(&t, out));
+
+  test_tree_free(&t);
+  host_tree_free(out, t.size);
+
+  return CL_SUCCESS;
+}
+
+// Tests that merklizing N leaves in place, in a single allocation of 2N nodes,
+// produces same intermediate nodes as merklizing them on host
+cl_int
+test_merklize_inplace(cl_context ctx,
+                      cl_command_queue cq,
+                      cl_kernel merklize_krnl,
+                      size_t wg_size)
+{
+  cl_int status;
+
+  test_tree_t t;
+  test_tree_init(&t, 1 << 20);
+
+  // page aligned, so that device may use it without copying
+  cl_uchar* tree = (cl_uchar*)host_tree_alloc(t.size << 1);
+  check_mem_alloc(tree);
+
+  memcpy(tree + t.size, t.in, t.size);
+
+  cl_ulong ts[3];
+  status = merklize_inplace(ctx,
+                            cq,
+                            merklize_krnl,
+                            tree,
+                            t.size << 1,
+                            t.leaf_count,
+                            wg_size,
+                            ts,
+                            NULL);
+  check_for_error_and_return(status);
+
+  // while leaves must be left untouched
+  assert(test_tree_check(&t, tree));
+  assert(memcmp(t.in, tree + t.size, t.size) == 0);
+
+  test_tree_free(&t);
+  host_tree_free(tree, t.size << 1);
+
+  return status;
+}
+
+void
+test_merklize_async_cb(merklize_async_t* handle, cl_int status, void* user_data)
+{
+  if (status == CL_SUCCESS) {
+    atomic_fetch_add((atomic_size_t*)user_data, 1);
+  }
+}
+
+// Tests that several trees, kept in flight together using
+// `merklize_async( ... )`, produce same intermediate nodes as merklizing them
+// on host, while completion callback is invoked once per tree
+cl_int
+test_merklize_async(cl_context ctx,
+                    cl_command_queue cq,
+                    cl_kernel merklize_krnl,
+                    size_t wg_size)
+{
+  const size_t tree_cnt = 4;
+
+  cl_int status;
+
+  test_tree_t trees[4];
+  cl_uchar* out[4];
+
+  merklize_async_t* handles[4];
+  atomic_size_t completed = 0;
+
+  for (size_t i = 0; i < tree_cnt; i++) {
+    test_tree_init(trees + i, 1 << 20);
+
+    out[i] = (cl_uchar*)malloc(trees[i].size);
+    check_mem_alloc(out[i]);
+  }
+
+  for (size_t i = 0; i < tree_cnt; i++) {
+    status = merklize_async(ctx,
+                            cq,
+                            merklize_krnl,
+                            trees[i].in,
+                            trees[i].size,
+                            trees[i].leaf_count,
+                            out[i],
+                            trees[i].size,
+                            wg_size,
+                            test_merklize_async_cb,
+                            &completed,
+                            NULL,
+                            handles + i);
+    check_for_error_and_return(status);
+  }
+
+  for (size_t i = 0; i < tree_cnt; i++) {
+    cl_ulong ts[3];
+    status = merklize_async_wait(handles[i], ts);
+    check_for_error_and_return(status);
+    assert(merklize_async_poll(handles[i]));
+
+    assert(test_tree_check(trees + i, out[i]));
+
+    merklize_async_release(handles[i]);
+  }
+
+  assert(atomic_load(&completed) == tree_cnt);
+
+  for (size_t i = 0; i < tree_cnt; i++) {
+    test_tree_free(trees + i);
+    free(out[i]);
+  }
+
+  return status;
+}
+
+void*
+test_merklize_metrics_wait(void* arg)
+{
+  merklize_async_wait((merklize_async_t*)arg, NULL);
+  return NULL;
+}
+
+// Tests that metrics of each call are recorded in session, both when tree is
+// built using `merklize( ... )` & in place, and that session sums them up;
+// also that asynchronous build waited on by many threads is recorded once
+cl_int
+test_merklize_metrics(cl_context ctx,
+                      cl_command_queue cq,
+                      cl_kernel merklize_krnl,
+                      size_t wg_size)
+{
+  cl_int status;
+
+  test_tree_t t;
+  test_tree_init(&t, 1 << 20);
+
+  const size_t leaf_count = t.leaf_count;
+  const size_t size = t.size;
+
+  cl_uchar* out = (cl_uchar*)malloc(size);
+  check_mem_alloc(out);
+  cl_uchar* tree = (cl_uchar*)malloc(size << 1);
+  check_mem_alloc(tree);
+
+  metrics_t metrics;
+  metrics_init(&metrics, NULL, 0);
+
+  const merklize_opts_t opts = { .metrics = &metrics };
+
+  cl_ulong ts[3];
+  status = merklize(ctx,
+                    cq,
+                    merklize_krnl,
+                    t.in,
+                    size,
+                    leaf_count,
+                    out,
+                    size,
+                    wg_size,
+                    ts,
+                    &opts);
+  check_for_error_and_return(status);
+
+  merklize_metrics_t last;
+  merklize_metrics_t total;
+  metrics_snapshot(&metrics, &last, NULL);
+
+  // log2( N ) levels, leaves being uploaded & intermediate nodes read back
+  assert(last.calls == 1 && last.leaves == leaf_count && last.kernels == 20);
+  assert(last.h2d_bytes >= size && last.d2h_bytes == size);
+  assert(last.dev_bytes >= size << 1 && last.peak_bytes >= last.dev_bytes);
+  assert(last.buffers >= 2 && last.api_calls > last.kernels);
+  assert(last.phase_ns[METRICS_KERNEL] == ts[0]);
+  assert(last.phase_ns[METRICS_H2D] == ts[1]);
+  assert(last.phase_ns[METRICS_D2H] == ts[2]);
+  assert(last.phase_ns[METRICS_TOTAL] > 0);
+
+  memcpy(tree + size, t.in, size);
+  status = merklize_inplace(
+    ctx, cq, merklize_krnl, tree, size << 1, leaf_count, wg_size, ts, &opts);
+  check_for_error_and_return(status);
+
+  metrics_snapshot(&metrics, &last, &total);
+
+  assert(last.calls == 1 && last.kernels == 20 && last.d2h_bytes == size);
+  assert(last.phase_ns[METRICS_KERNEL] == ts[0]);
+  assert(total.calls == 2 && total.kernels == 40);
+  assert(total.leaves == leaf_count << 1);
+
+  merklize_async_t* handle;
+  status = merklize_async(ctx,
+                          cq,
+                          merklize_krnl,
+                          t.in,
+                          size,
+                          leaf_count,
+                          out,
+                          size,
+                          wg_size,
+                          NULL,
+                          NULL,
+                          &opts,
+                          &handle);
+  check_for_error_and_return(status);
+
+  pthread_t waiter;
+  const int res =
+    pthread_create(&waiter, NULL, test_merklize_metrics_wait, handle);
+  assert(res == 0);
+
+  status = merklize_async_wait(handle, NULL);
+  pthread_join(waiter, NULL);
+  merklize_async_release(handle);
+  check_for_error_and_return(status);
+
+  metrics_snapshot(&metrics, NULL, &total);
+  assert(total.calls == 3 && total.kernels == 60);
+
+  metrics_free(&metrics);
+
+  test_tree_free(&t);
+  free(out);
+  free(tree);
+
+  return status;
+}
+
+// Tests that merklizing leaves gathered from unevenly sized, separately
+// allocated segments ( empty one included ), both directly & through arena's
+// staging buffers, produces same intermediate nodes as merklizing their
+// concatenation on host
+cl_int
+test_merklize_iov(cl_context ctx,
+                  cl_command_queue cq,
+                  cl_kernel merklize_krnl,
+                  size_t wg_size)
+{
+  cl_int status;
+
+  test_tree_t t;
+  test_tree_init(&t, 1 << 20);
+
+  const size_t seg_leaves[] = {
+    1, (t.leaf_count >> 1) - 1, 0, t.leaf_count >> 1
+  };
+  const size_t seg_cnt = sizeof(seg_leaves) / sizeof(size_t);
+
+  cl_uchar* out = (cl_uchar*)malloc(t.size);
+  check_mem_alloc(out);
+
+  merklize_iov_t iov[seg_cnt];
+  for (size_t i = 0, off = 0; i < seg_cnt; i++) {
+    const size_t seg_size = seg_leaves[i] << 5;
+
+    cl_uchar* seg = (cl_uchar*)malloc(seg_size + 1);
+    check_mem_alloc(seg);
+    memcpy(seg, t.in + off, seg_size);
+
+    iov[i].ptr = seg;
+    iov[i].leaf_count = seg_leaves[i];
+    off += seg_size;
+  }
+
+  arena_t arena;
+  arena_init(&arena, ctx, cq, t.size << 2);
+
+  const merklize_opts_t opts[] = { { .arena = NULL }, { .arena = &arena } };
+
+  for (size_t i = 0; i < 2; i++) {
+    memset(out, 0, t.size);
+
+    cl_ulong ts[3];
+    status = merklize_iov(ctx,
+                          cq,
+                          merklize_krnl,
+                          iov,
+                          seg_cnt,
+                          t.leaf_count,
+                          out,
+                          t.size,
+                          wg_size,
+                          ts,
+                          opts + i);
+    check_for_error_and_return(status);
+
+    assert(test_tree_check(&t, out));
+  }
+
+  arena_free(&arena);
+
+  for (size_t i = 0; i < seg_cnt; i++) {
+    free((void*)iov[i].ptr);
+  }
+
+  test_tree_free(&t);
+  free(out);
+
+  return status;
+}
+
+// Records level callbacks of `test_merklize_stream( ... )`
+typedef struct
+{
+  const cl_uchar* out;
+  const cl_uchar* expected;
+  size_t groups;
+  size_t levels;
+  size_t nodes;
+  size_t mismatches;
+  pthread_mutex_t lock;
+} stream_test_t;
+
+void
+stream_test_on_level(merklize_async_t* handle,
+                     size_t from,
+                     size_t to,
+                     size_t first,
+                     size_t count,
+                     void* user_data)
+{
+  stream_test_t* const st = (stream_test_t*)user_data;
+
+  // nodes of group must already be final, when it's announced
+  const int res =
+    memcmp(st->out + (first << 5), st->expected + (first << 5), count << 5);
+
+  pthread_mutex_lock(&st->lock);
+  st->groups++;
+  st->levels += to - from + 1;
+  st->nodes += count;
+  st->mismatches += res != 0;
+  pthread_mutex_unlock(&st->lock);
+}
+
+// Tests that streaming levels back in groups, both directly & through arena's
+// staging buffers, announces every intermediate node exactly once, after it's
+// on host, while producing same intermediate nodes as merklizing on host
+cl_int
+test_merklize_stream(cl_context ctx,
+                     cl_command_queue cq,
+                     cl_kernel merklize_krnl,
+                     size_t wg_size)
+{
+  const size_t stream_levels = 4;
+  const size_t levels = 20; // log2(N)
+
+  cl_int status;
+
+  test_tree_t t;
+  test_tree_init(&t, (size_t)1 << levels);
+
+  cl_uchar* out = (cl_uchar*)malloc(t.size);
+  check_mem_alloc(out);
+
+  arena_t arena;
+  arena_init(&arena, ctx, cq, t.size << 2);
+
+  for (size_t i = 0; i < 2; i++) {
+    memset(out, 0, t.size);
+
+    stream_test_t st = { .out = out, .expected = t.expected };
+    pthread_mutex_init(&st.lock, NULL);
+
+    const merklize_opts_t opts = { .arena = i == 0 ? NULL : &arena,
+                                   .stream_levels = stream_levels,
+                                   .on_level = stream_test_on_level,
+                                   .level_data = &st };
+
+    cl_ulong ts[3];
+    status = merklize(ctx,
+                      cq,
+                      merklize_krnl,
+                      t.in,
+                      t.size,
+                      t.leaf_count,
+                      out,
+                      t.size,
+                      wg_size,
+                      ts,
+                      &opts);
+    check_for_error_and_return(status);
+
+    assert(st.groups == (levels + stream_levels - 1) / stream_levels);
+    assert(st.levels == levels);
+    assert(st.nodes == t.leaf_count - 1);
+    assert(st.mismatches == 0);
+    assert(test_tree_check(&t, out));
+
+    pthread_mutex_destroy(&st.lock);
+  }
+
+  arena_free(&arena);
+
+  test_tree_free(&t);
+  free(out);
+
+  return status;
+}
+
+// Tests that merklizing trees using buffers of arena, produces same
+// intermediate nodes as merklizing them on host, while second build reuses
+// all buffers acquired by first one
+cl_int
+test_merklize_arena(cl_context ctx,
+                    cl_command_queue cq,
+                    cl_kernel merklize_krnl,
+                    size_t wg_size)
+{
+  const size_t leaf_count = 1 << 20;
+  const size_t size = leaf_count << 5;
+
+  cl_int status;
+
+  cl_uchar* out = (cl_uchar*)malloc(size);
+  check_mem_alloc(out);
+
+  arena_t arena;
+  arena_init(&arena, ctx, cq, size << 2);
+
+  const merklize_opts_t opts = { .arena = &arena };
+
+  for (size_t i = 0; i < 2; i++) {
+    test_tree_t t;
+    test_tree_init(&t, leaf_count);
+
+    cl_ulong ts[3];
+    status = merklize(ctx,
+                      cq,
+                      merklize_krnl,
+                      t.in,
+                      size,
+                      leaf_count,
+                      out,
+                      size,
+                      wg_size,
+                      ts,
+                      &opts);
+    check_for_error_and_return(status);
+
+    assert(test_tree_check(&t, out));
+
+    test_tree_free(&t);
+  }
+
+  assert(arena.misses == 4 && arena.hits == 4);
+  assert(arena.used_bytes == 0 && arena.idle_bytes == size << 2);
+
+  // peak demand of this window needs all of them
+  arena_trim(&arena);
+  assert(arena.idle_bytes == size << 2);
+  // while nothing was acquired since last trim
+  arena_trim(&arena);
+  assert(arena.idle_bytes == 0);
+
+  arena_free(&arena);
+
+  free(out);
+
+  return status;
+}
+
+// Tests that batch updating sparse merkle tree, having 2 ^ 64 leaves, produces
+// same root, when touched parents are hashed on device & on host, and that
+// inclusion proof of updated leaf verifies against that root
+cl_int
+test_smt(cl_context ctx, cl_command_queue cq, cl_kernel merklize_krnl)
+{
+  const size_t key_cnt = 1 << 12;
+
+  cl_int status;
+
+  cl_ulong* keys = (cl_ulong*)malloc(sizeof(cl_ulong) * key_cnt);
+  check_mem_alloc(keys);
+  cl_uchar* values = (cl_uchar*)malloc(key_cnt << 5);
+  check_mem_alloc(values);
+  cl_uchar* siblings = (cl_uchar*)malloc(64 << 5);
+  check_mem_alloc(siblings);
+
+  random_input((cl_uchar*)keys, sizeof(cl_ulong) * key_cnt);
+  random_input(values, key_cnt << 5);
+
+  smt_t smt_0, smt_1;
+  smt_init(&smt_0, 64);
+  smt_init(&smt_1, 64);
+
+  // all levels hashed on device
+  const smt_device_t dev = {
+    .ctx = ctx, .cq = cq, .krnl = merklize_krnl, .min_pairs = 1
+  };
+
+  status = smt_update(&smt_0, keys, values, key_cnt, &dev);
+  check_for_error_and_return(status);
+  status = smt_update(&smt_1, keys, values, key_cnt, NULL);
+  check_for_error_and_return(status);
+
+  cl_uchar root_0[32], root_1[32];
+  smt_root(&smt_0, root_0);
+  smt_root(&smt_1, root_1);
+
+  assert(memcmp(root_0, root_1, 32) == 0);
+
+  smt_proof(&smt_0, *keys, siblings);
+  assert(smt_verify(root_0, 64, *keys, values, siblings));
+
+  smt_free(&smt_0);
+  smt_free(&smt_1);
+
+  free(keys);
+  free(values);
+  free(siblings);
+
+  return status;
+}
+
+// Tests that tree merklized on device, straight into tree file, can be
+// reloaded with same root as merklizing it on host, and that leaf updates are
+// reflected in proofs served from reloaded file
+cl_int
+test_tree_file(cl_context ctx,
+               cl_command_queue cq,
+               cl_kernel merklize_krnl,
+               size_t wg_size)
+{
+  const char* path = "test.tree";
+  const size_t leaf_count = 1 << 20;
+  const size_t size = leaf_count << 5;
+
+  cl_int status;
+
+  cl_uchar* in = (cl_uchar*)malloc(size);
+  check_mem_alloc(in);
+  cl_uchar* out = (cl_uchar*)malloc(size);
+  check_mem_alloc(out);
+  cl_uchar* proof = (cl_uchar*)malloc(20 << 5);
+  check_mem_alloc(proof);
+
+  random_input(in, size);
+  merklize_host(in, size, leaf_count, out, size, 0);
+
+  int res;
+
+  tree_file_t tf;
+  res = tree_file_create(path, leaf_count, &tf);
+  assert(res == 0);
+  memcpy(tf.nodes + size, in, size);
+
+  cl_ulong ts[3];
+  status = tree_file_merklize(&tf, ctx, cq, merklize_krnl, wg_size, ts, NULL);
+  check_for_error_and_return(status);
+
+  tree_file_close(&tf);
+
+  res = tree_file_open(path, 1, &tf);
+  assert(res == 0);
+  assert(memcmp(tree_file_root(&tf), out + 32, 32) == 0);
+
+  // updating last leaf
+  const size_t idx = leaf_count - 1;
+  cl_uchar leaf[32];
+  random_input(leaf, 32);
+
+  res = tree_file_update(&tf, &idx, leaf, 1);
+  assert(res == 0);
+  tree_file_close(&tf);
+
+  res = tree_file_open(path, 0, &tf);
+  assert(res == 0);
+  tree_file_proof(&tf, idx, proof);
+  assert(merkle_proof_verify(tree_file_root(&tf), 20, idx, leaf, proof));
+  assert(memcmp(tree_file_root(&tf), out + 32, 32) != 0);
+
+  tree_file_close(&tf);
+  unlink(path);
+
+  free(in);
+  free(out);
+  free(proof);
+
+  return status;
+}
+
+// Tests that tree merklized on device, in subtree blocked layout, straight
+// into tree file, holds same nodes as heap layout tree merklized on host, and
+// that proofs/ updates served from reloaded file translate node indices
+cl_int
+test_merklize_blocked(cl_context ctx,
+                      cl_command_queue cq,
+                      cl_kernel blocked_krnl,
+                      size_t wg_size)
+{
+  const char* path = "test.blocked.tree";
+  const size_t leaf_count = 1 << 20;
+  const size_t size = leaf_count << 5;
+  const size_t block_log = 7; // 4 KB blocks
+
+  cl_int status;
+  int res;
+
+  cl_uchar* in = (cl_uchar*)malloc(size);
+  check_mem_alloc(in);
+  cl_uchar* heap = (cl_uchar*)malloc(size << 1);
+  check_mem_alloc(heap);
+  cl_uchar* proof = (cl_uchar*)malloc(20 << 5);
+  check_mem_alloc(proof);
+
+  random_input(in, size);
+  memcpy(heap + size, in, size);
+  merklize_host(in, size, leaf_count, heap, size, 0);
+
+  tree_file_t tf;
+  res = tree_file_create_blocked(path, leaf_count, block_log, &tf);
+  assert(res == 0);
+  blocked_set_leaves(tf.nodes, in, leaf_count, block_log);
+
+  cl_ulong ts[3];
+  status = tree_file_merklize(&tf, ctx, cq, blocked_krnl, wg_size, ts, NULL);
+  check_for_error_and_return(status);
+
+  // same as converting heap layout tree, node by node
+  const size_t t_size = (size_t)tf.hdr->data_size;
+  cl_uchar* blocked = (cl_uchar*)calloc(t_size, 1);
+  check_mem_alloc(blocked);
+
+  blocked_from_heap(heap, leaf_count, block_log, blocked);
+  res = memcmp(tf.nodes, blocked, t_size);
+  assert(res == 0);
+  res = memcmp(tree_file_root(&tf), heap + 32, 32);
+  assert(res == 0);
+
+  tree_file_close(&tf);
+
+  res = tree_file_open(path, 1, &tf);
+  assert(res == 0);
+
+  // updating first leaf
+  const size_t idx = 0;
+  cl_uchar leaf[32];
+  random_input(leaf, 32);
+
+  res = tree_file_update(&tf, &idx, leaf, 1);
+  assert(res == 0);
+
+  tree_file_proof(&tf, idx, proof);
+  res = merkle_proof_verify(tree_file_root(&tf), 20, idx, leaf, proof);
+  assert(res);
+
+  // updated tree is same as rebuilding it on host, in heap layout
+  memcpy(heap + size, leaf, 32);
+  merklize_host(heap + size, size, leaf_count, heap, size, 0);
+  blocked_from_heap(heap, leaf_count, block_log, blocked);
+
+  res = memcmp(tf.nodes, blocked, t_size);
+  assert(res == 0);
+
+  tree_file_close(&tf);
+  unlink(path);
+
+  free(in);
+  free(heap);
+  free(blocked);
+  free(proof);
+
+  return status;
+}
+
+// Tests that merklizing successive snapshots of N leaves, using memoized
+// subtree roots, only recomputes changed subtrees & still produces same
+// intermediate nodes as merklizing them on host
+cl_int
+test_merklize_memo(cl_context ctx,
+                   cl_command_queue cq,
+                   cl_kernel merklize_krnl,
+                   size_t wg_size)
+{
+  const size_t leaf_count = 1 << 20;
+  const size_t size = leaf_count << 5;
+  const size_t height = 14; // so 64 subtrees
+
+  cl_int status;
+
+  cl_uchar* in = (cl_uchar*)malloc(size);
+  check_mem_alloc(in);
+  cl_uchar* out_0 = (cl_uchar*)malloc(size);
+  check_mem_alloc(out_0);
+  cl_uchar* out_1 = (cl_uchar*)malloc(size);
+  check_mem_alloc(out_1);
+
+  memo_cache_t cache;
+  memo_init(&cache, height, 1 << 20);
+
+  random_input(in, size);
+
+  size_t reused;
+  cl_ulong ts[3];
+
+  cl_uchar last_leaf[32];
+  memcpy(last_leaf, in + size - 32, 32);
+
+  for (size_t snapshot = 0; snapshot < 3; snapshot++) {
+    // second snapshot changes one leaf of last subtree, while third one
+    // reverts it, so that its cached root ( of first snapshot ) doesn't match
+    // what previous build holds, below that root
+    if (snapshot == 1) {
+      random_input(in + size - 32, 32);
+    } else if (snapshot == 2) {
+      memcpy(in + size - 32, last_leaf, 32);
+    }
+
+    status = merklize_memo(&cache,
+                           ctx,
+                           cq,
+                           merklize_krnl,
+                           in,
+                           size,
+                           leaf_count,
+                           out_0,
+                           size,
+                           snapshot == 0 ? NULL : out_0,
+                           wg_size,
+                           &reused,
+                           ts);
+    check_for_error_and_return(status);
+
+    merklize_host(in, size, leaf_count, out_1, size, 0);
+
+    assert(reused == (snapshot == 0 ? 0 : (leaf_count >> height) - 1));
+    assert(memcmp(out_0 + 32, out_1 + 32, size - 32) == 0);
+  }
+
+  memo_free(&cache);
+
+  free(in);
+  free(out_0);
+  free(out_1);
+
+  return status;
+}
+
+// Tests that walking two trees top-down, on host & on device, finds exactly
+// those leaves where they differ
+cl_int
+test_merkle_diff(cl_context ctx, cl_command_queue cq, cl_kernel diff_krnl)
+{
+  const size_t leaf_count = 1 << 16;
+  const size_t size = leaf_count << 5;
+  const size_t diffs[] = { 0, 1, 2, 4242, leaf_count - 1 };
+  const size_t diff_cnt = sizeof(diffs) / sizeof(size_t);
+
+  cl_int status;
+
+  // trees in layout of `merklize_inplace( ... )`
+  cl_uchar* tree_a = (cl_uchar*)malloc(size << 1);
+  check_mem_alloc(tree_a);
+  cl_uchar* tree_b = (cl_uchar*)malloc(size << 1);
+  check_mem_alloc(tree_b);
+  size_t* out = (size_t*)malloc(sizeof(size_t) * diff_cnt);
+  check_mem_alloc(out);
+
+  random_input(tree_a + size, size);
+  memcpy(tree_b + size, tree_a + size, size);
+
+  for (size_t i = 0; i < diff_cnt; i++) {
+    *(tree_b + size + (diffs[i] << 5)) ^= 1;
+  }
+
+  merklize_host(tree_a + size, size, leaf_count, tree_a, size, 0);
+  merklize_host(tree_b + size, size, leaf_count, tree_b, size, 0);
+
+  size_t cnt = merkle_diff(
+    tree_a, tree_a + size, tree_b, tree_b + size, leaf_count, out, diff_cnt);
+
+  assert(cnt == diff_cnt);
+  assert(memcmp(out, diffs, sizeof(diffs)) == 0);
+
+  cl_mem buf_a = clCreateBuffer(ctx,
+                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                size << 1,
+                                tree_a,
+                                &status);
+  check_for_error_and_return(status);
+  cl_mem buf_b = clCreateBuffer(ctx,
+                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                size << 1,
+                                tree_b,
+                                &status);
+  check_for_error_and_return(status);
+
+  memset(out, 0, sizeof(size_t) * diff_cnt);
+  status = merkle_diff_device(
+    ctx, cq, diff_krnl, buf_a, buf_b, leaf_count, out, diff_cnt, &cnt);
+  check_for_error_and_return(status);
+
+  assert(cnt == diff_cnt);
+  assert(memcmp(out, diffs, sizeof(diffs)) == 0);
+
+  clReleaseMemObject(buf_a);
+  clReleaseMemObject(buf_b);
+
+  free(tree_a);
+  free(tree_b);
+  free(out);
+
+  return status;
+}
+
+// Tests that root of leaf range, computed from already built tree & computed
+// on device from leaves alone, are same, for aligned & unaligned ranges
+cl_int
+test_range_root(cl_context ctx, cl_command_queue cq, cl_kernel merklize_krnl)
+{
+  const size_t leaf_count = 1 << 16;
+  const size_t size = leaf_count << 5;
+  const size_t ranges[][2] = {
+    { 0, 1 }, { 0, 1 << 16 }, { 1 << 10, 1 << 11 }, { 3, 60001 }, { 17, 18 }
+  };
+
+  cl_int status = CL_SUCCESS;
+
+  cl_uchar* in = (cl_uchar*)malloc(size);
+  check_mem_alloc(in);
+  cl_uchar* out = (cl_uchar*)malloc(size);
+  check_mem_alloc(out);
+
+  random_input(in, size);
+  merklize_host(in, size, leaf_count, out, size, 0);
+
+  for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+    cl_uchar root_0[32], root_1[32];
+
+    range_root(out, in, leaf_count, ranges[i][0], ranges[i][1], root_0);
+    status = range_root_device(ctx,
+                               cq,
+                               merklize_krnl,
+                               in,
+                               leaf_count,
+                               ranges[i][0],
+                               ranges[i][1],
+                               root_1);
+    check_for_error_and_return(status);
+
+    assert(memcmp(root_0, root_1, 32) == 0);
+  }
+
+  free(in);
+  free(out);
+
+  return status;
+}
+
+void*
+test_service_run(void* arg)
+{
+  service_run((service_t*)arg);
+  return NULL;
+}
+
+// Tests that merklize requests, pipelined on same connection to service, are
+// batched ( into single dispatch ) & responded with same roots as merklizing
+// them on host, while proofs served verify & updates produce same root as
+// rebuilding tree on host
+cl_int
+test_service(cl_context ctx,
+             cl_command_queue cq,
+             cl_kernel merklize_krnl,
+             size_t wg_size)
+{
+  const size_t req_cnt = 4;
+  const size_t leaf_count = 1 << 10;
+  const size_t size = leaf_count << 5;
+
+  // socket lives in its own fresh directory, so that it neither collides with
+  // other runs nor depends on working directory being writable
+  char dir[] = "/tmp/merklize-test-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    return CL_INVALID_VALUE;
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "%s/service.sock", dir);
+
+  service_t srv;
+  if (service_init(&srv, ctx, cq, merklize_krnl, wg_size, path) != 0) {
+    rmdir(dir);
+    return CL_INVALID_VALUE;
+  }
+  // long enough that all pipelined requests make it to same batch
+  srv.batch_ns = 50000000ul;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, test_service_run, &srv) != 0) {
+    service_close(&srv);
+    rmdir(dir);
+    return CL_OUT_OF_HOST_MEMORY;
+  }
+
+  int res;
+
+  const int fd = service_connect(path);
+  assert(fd >= 0);
+
+  cl_uchar* in = (cl_uchar*)malloc(size * req_cnt);
+  check_mem_alloc(in);
+  cl_uchar* out = (cl_uchar*)malloc(size);
+  check_mem_alloc(out);
+
+  random_input(in, size * req_cnt);
+
+  for (size_t i = 0; i < req_cnt; i++) {
+    service_hdr_t hdr = { .op = SERVICE_MERKLIZE, .tag = i, .arg = leaf_count };
+
+    res = service_send(fd, &hdr, in + i * size, size);
+    assert(res == 0);
+  }
+
+  cl_ulong trees[4];
+
+  for (size_t i = 0; i < req_cnt; i++) {
+    service_hdr_t resp;
+    cl_uchar* root;
+
+    res = service_recv(fd, &resp, &root, SIZE_MAX);
+    assert(res == 0);
+    assert(resp.status == SERVICE_OK && resp.tag < req_cnt);
+
+    merklize_host(in + resp.tag * size, size, leaf_count, out, size, 0);
+    assert(memcmp(root, out + 32, 32) == 0);
+
+    trees[resp.tag] = resp.tree;
+    free(root);
+  }
+
+  service_hdr_t resp;
+  cl_uchar* payload;
+
+  // proof of some leaf of last tree
+  const size_t idx = leaf_count - 3;
+  const cl_uchar* last = in + (req_cnt - 1) * size;
+
+  res = service_call(
+    fd, SERVICE_PROOF, trees[req_cnt - 1], idx, NULL, 0, &resp, &payload);
+  assert(res == SERVICE_OK);
+
+  merklize_host(last, size, leaf_count, out, size, 0);
+  assert(memcmp(payload, last + (idx << 5), 32) == 0);
+  assert(merkle_proof_verify(out + 32, resp.arg, idx, payload, payload + 32));
+  free(payload);
+
+  // updating one leaf of first tree
+  cl_uchar update[40];
+  const cl_ulong u_idx = 7;
+  memcpy(update, &u_idx, sizeof(u_idx));
+  random_input(update + 8, 32);
+  memcpy(in + (u_idx << 5), update + 8, 32);
+
+  res = service_call(fd,
+                     SERVICE_UPDATE,
+                     trees[0],
+                     1,
+                     update,
+                     sizeof(update),
+                     &resp,
+                     &payload);
+  assert(res == SERVICE_OK);
+
+  merklize_host(in, size, leaf_count, out, size, 0);
+  assert(memcmp(payload, out + 32, 32) == 0);
+  free(payload);
+
+  res = service_call(fd, SERVICE_STATS, 0, 0, NULL, 0, &resp, &payload);
+  assert(res == SERVICE_OK);
+
+  const service_stats_t* stats = (const service_stats_t*)payload;
+  assert(stats->requests[SERVICE_MERKLIZE] == req_cnt);
+  assert(stats->trees == req_cnt);
+  assert(stats->dispatches == 1 && stats->batched == req_cnt);
+  free(payload);
+
+  res = service_call(
+    fd, SERVICE_RELEASE, trees[0], 0, NULL, 0, &resp, &payload);
+  assert(res == SERVICE_OK);
+
+  res = service_call(fd, SERVICE_ROOT, trees[0], 0, NULL, 0, &resp, &payload);
+  assert(res == SERVICE_ENOENT);
+
+  close(fd);
+
+  atomic_store(&srv.stop, 1);
+  pthread_join(thread, NULL);
+  service_close(&srv);
+  rmdir(dir);
+
+  free(in);
+  free(out);
+
+  return CL_SUCCESS;
+}
@@ -0,0 +1,265 @@
+#pragma once
+#include "utils.h"
+
+// Timeline of OpenCL commands enqueued during tree construction, where each
+// command's QUEUED/ SUBMIT/ START/ END timestamps ( in nanoseconds, on device
+// clock ) are recorded, so that it can be figured out which levels of merkle
+// tree are launch-bound & which are bandwidth-bound, and how long commands
+// wait in queue before getting executed
+//
+// Commands are recorded after their completion, so ensure that queue has
+// profiling enabled
+typedef struct
+{
+  const char* name; // e.g. "write", "kernel", "read"
+  cl_long level;    // height of tree level being produced ( leaves at 0 ),
+                    // negative when command isn't specific to some level
+  size_t tree;      // which tree build this command belongs to
+  cl_ulong queued;
+  cl_ulong submit;
+  cl_ulong start;
+  cl_ulong end;
+} trace_cmd_t;
+
+typedef struct
+{
+  trace_cmd_t* cmds;
+  size_t count;
+  size_t cap;
+  size_t trees; // # -of tree builds recorded so far
+} trace_t;
+
+void
+trace_init(trace_t* const trace)
+{
+  memset(trace, 0, sizeof(trace_t));
+}
+
+void
+trace_free(trace_t* const trace)
+{
+  free(trace->cmds);
+  memset(trace, 0, sizeof(trace_t));
+}
+
+// Marks beginning of a new tree build, all commands recorded till next call
+// to this function are attributed to returned tree identifier
+size_t
+trace_begin_tree(trace_t* const trace)
+{
+  return trace->trees++;
+}
+
+// Reads all four profiling timestamps of ( already completed ) command
+// associated with this event & appends it to timeline
+cl_int
+trace_record(trace_t* const trace,
+             cl_event evt,
+             const char* name,
+             cl_long level)
+{
+  cl_int status;
+
+  trace_cmd_t cmd = { .name = name,
+                      .level = level,
+                      .tree = trace->trees == 0 ? 0 : trace->trees - 1 };
+
+  status = clGetEventProfilingInfo(
+    evt, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &cmd.queued, NULL);
+  check_for_error_and_return(status);
+
+  status = clGetEventProfilingInfo(
+    evt, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &cmd.submit, NULL);
+  check_for_error_and_return(status);
+
+  status = clGetEventProfilingInfo(
+    evt, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &cmd.start, NULL);
+  check_for_error_and_return(status);
+
+  status = clGetEventProfilingInfo(
+    evt, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &cmd.end, NULL);
+  check_for_error_and_return(status);
+
+  if (trace->count == trace->cap) {
+    trace->cap = trace->cap == 0 ? 64 : trace->cap << 1;
+    trace->cmds =
+      (trace_cmd_t*)realloc(trace->cmds, sizeof(trace_cmd_t) * trace->cap);
+    check_mem_alloc(trace->cmds);
+  }
+
+  *(trace->cmds + trace->count++) = cmd;
+  return CL_SUCCESS;
+}
+
+// Earliest QUEUED timestamp of timeline, which is used as time origin while
+// exporting it
+cl_ulong
+trace_origin(const trace_t* trace)
+{
+  cl_ulong origin = trace->count > 0 ? trace->cmds->queued : 0;
+
+  for (size_t i = 1; i < trace->count; i++) {
+    const cl_ulong q = (trace->cmds + i)->queued;
+    origin = q < origin ? q : origin;
+  }
+
+  return origin;
+}
+
+// Exports recorded timeline in Chrome trace event format ( JSON ), which can
+// be opened in chrome://tracing or https://ui.perfetto.dev
+//
+// Each tree build is shown as a separate process, with two tracks
+//
+// - "device" : START -> END of each command i.e. its execution
+// - "queue"  : QUEUED -> START of each command i.e. how long it waited, before
+//              it got executed; SUBMIT is attached as argument
+//
+// See
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+void
+trace_export_chrome(const trace_t* trace, FILE* const fd)
+{
+  const cl_ulong origin = trace_origin(trace);
+
+  fprintf(fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  for (size_t t = 0; t < trace->trees; t++) {
+    fprintf(fd,
+            "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%zu,"
+            "\"args\":{\"name\":\"tree %zu\"}},"
+            "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%zu,\"tid\":0,"
+            "\"args\":{\"name\":\"device\"}},"
+            "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%zu,\"tid\":1,"
+            "\"args\":{\"name\":\"queue\"}}",
+            t == 0 ? "" : ",",
+            t,
+            t,
+            t,
+            t);
+  }
+
+  for (size_t i = 0; i < trace->count; i++) {
+    const trace_cmd_t* cmd = trace->cmds + i;
+
+    // chrome trace timestamps are in microseconds
+    const double queued = (double)(cmd->queued - origin) * 1e-3;
+    const double submit = (double)(cmd->submit - origin) * 1e-3;
+    const double start = (double)(cmd->start - origin) * 1e-3;
+    const double end = (double)(cmd->end - origin) * 1e-3;
+
+    fprintf(fd,
+            ",\n{\"name\":\"%s\",\"cat\":\"level %ld\",\"ph\":\"X\","
+            "\"pid\":%zu,\"tid\":0,\"ts\":%.3lf,\"dur\":%.3lf,"
+            "\"args\":{\"level\":%ld}}",
+            cmd->name,
+            (long)cmd->level,
+            cmd->tree,
+            start,
+            end - start,
+            (long)cmd->level);
+
+    fprintf(fd,
+            ",\n{\"name\":\"%s (wait)\",\"cat\":\"level %ld\",\"ph\":\"X\","
+            "\"pid\":%zu,\"tid\":1,\"ts\":%.3lf,\"dur\":%.3lf,"
+            "\"args\":{\"level\":%ld,\"submit_us\":%.3lf}}",
+            cmd->name,
+            (long)cmd->level,
+            cmd->tree,
+            queued,
+            start - queued,
+            (long)cmd->level,
+            submit);
+  }
+
+  fprintf(fd, "\n]}\n");
+}
+
+// Writes per-level summary table of recorded timeline, where for each tree
+// level ( summed over all recorded tree builds ) following are reported, all in
+// microseconds
+//
+// - exec   : START -> END, sum of command execution times
+// - queued : QUEUED -> SUBMIT, time spent in host side queue
+// - submit : SUBMIT -> START, time spent waiting on device, after submission
+// - gap    : previous level's END -> this level's START, i.e. dispatch gap
+//            between two dependent kernels ( only for kernel commands )
+//
+// Commands not specific to any level ( e.g. leaf upload/ readback ) are
+// reported in rows marked with `-`
+void
+trace_level_summary(const trace_t* trace, FILE* const fd)
+{
+  cl_long max_level = -1;
+  for (size_t i = 0; i < trace->count; i++) {
+    const cl_long l = (trace->cmds + i)->level;
+    max_level = l > max_level ? l : max_level;
+  }
+
+  fprintf(fd,
+          "%8s %-8s %6s %14s %14s %14s %14s\n",
+          "level",
+          "command",
+          "count",
+          "exec(us)",
+          "queued(us)",
+          "submit(us)",
+          "gap(us)");
+
+  const char* names[] = { "write", "kernel", "read" };
+
+  for (cl_long l = -1; l <= max_level; l++) {
+    for (size_t n = 0; n < sizeof(names) / sizeof(char*); n++) {
+      size_t count = 0;
+      double exec = 0., queued = 0., submit = 0., gap = 0.;
+
+      for (size_t i = 0; i < trace->count; i++) {
+        const trace_cmd_t* cmd = trace->cmds + i;
+        const cl_long l_ = cmd->level < 0 ? -1 : cmd->level;
+
+        if (l_ != l || strcmp(cmd->name, names[n]) != 0) {
+          continue;
+        }
+
+        count++;
+        exec += (double)(cmd->end - cmd->start) * 1e-3;
+        queued += (double)(cmd->submit - cmd->queued) * 1e-3;
+        submit += (double)(cmd->start - cmd->submit) * 1e-3;
+
+        if (strcmp(cmd->name, "kernel") != 0 || l <= 1) {
+          continue;
+        }
+
+        // kernel producing previous level, in same tree build
+        for (size_t j = 0; j < trace->count; j++) {
+          const trace_cmd_t* prev = trace->cmds + j;
+
+          if (prev->tree == cmd->tree && prev->level == l - 1 &&
+              strcmp(prev->name, "kernel") == 0 && prev->end <= cmd->start) {
+            gap += (double)(cmd->start - prev->end) * 1e-3;
+            break;
+          }
+        }
+      }
+
+      if (count == 0) {
+        continue;
+      }
+
+      if (l < 0) {
+        fprintf(fd, "%8s ", "-");
+      } else {
+        fprintf(fd, "%8ld ", (long)l);
+      }
+
+      fprintf(fd,
+              "%-8s %6zu %14.3lf %14.3lf %14.3lf %14.3lf\n",
+              names[n],
+              count,
+              exec,
+              queued,
+              submit,
+              gap);
+    }
+  }
+}
@@ -0,0 +1,517 @@
+#pragma once
+#include "blocked.h"
+#include "host_merklize.h"
+#include "merklize.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Persistent, mmap-able on-disk format of merkle tree, so that roots & proofs
+// can be served right after restart, without rehashing whole tree
+//
+// File starts with one page sized header, followed by page aligned node
+// storage, which is either exactly in same heap layout as
+// `merklize_inplace( ... )` works on, i.e. 2N nodes of 32 -bytes each, where
+// root is at node index 1, children of node i at 2i & 2i + 1 & leaves at
+// [N, 2N); so nodes are stored level by level, root first; or in subtree
+// blocked layout ( see blocked.h ), recorded in header as non-zero block_log,
+// where a leaf's path to root touches far fewer pages. All APIs below take
+// nodes/ leaves by their heap index, translating them to storage slots.
+//
+// Tree is built by merklizing directly into mapped file & is reloaded using a
+// single mmap, after validating its header. Updating few leaves only rewrites
+// pages holding nodes on their paths to root.
+
+#define TREE_FILE_MAGIC "MKLBLAKE"
+#define TREE_FILE_VERSION 2
+
+// How nodes of tree are hashed, recorded in header so that future modes can
+// be told apart
+enum tree_hash_mode
+{
+  // parent = blake3( left child || right child ), same as `merklize` kernel
+  TREE_HASH_BLAKE3_2TO1 = 1,
+};
+
+typedef struct
+{
+  char magic[8];         // TREE_FILE_MAGIC, not NULL terminated
+  cl_uint version;       // TREE_FILE_VERSION
+  cl_uint byte_order;    // 0x01020304, as written by host
+  cl_uint arity;         // 2 i.e. binary merkle tree
+  cl_uint hash_mode;     // see `enum tree_hash_mode`
+  cl_ulong leaf_count;   // N, power of 2
+  cl_ulong data_offset;  // where node storage begins, page aligned
+  cl_ulong data_size;    // `blocked_slots( ... )` * 32 -bytes, 2N * 32 in heap
+  cl_ulong block_log;    // 0 for heap layout, see blocked.h
+  cl_uchar root[32];     // copy of node 1, valid once sealed
+  cl_ulong sealed;       // is `root` valid i.e. was tree built completely ?
+  cl_uchar checksum[32]; // blake3 of all preceding header bytes
+} tree_file_header_t;
+
+// Tree file, opened & mapped in memory
+typedef struct
+{
+  int fd;
+  int writable;
+  size_t page;             // page size of host
+  size_t map_size;         // header page + node storage
+  cl_uchar* map;           // whole file
+  tree_file_header_t* hdr; // at beginning of `map`
+  cl_uchar* nodes;         // node storage, at `map + data_offset`
+  size_t leaf_count;
+  size_t height;    // log2( N )
+  size_t block_log; // 0 for heap layout
+} tree_file_t;
+
+// Computes checksum of header, over all fields preceding it
+void
+tree_file_checksum(const tree_file_header_t* hdr, cl_uchar* const checksum)
+{
+  blake3_hash_host(
+    (const cl_uchar*)hdr, offsetof(tree_file_header_t, checksum), checksum);
+}
+
+// Maps first `size` -bytes of already opened file, shared with page cache, so
+// that writes to mapping end up in file
+int
+tree_file_map(tree_file_t* const tf, size_t size)
+{
+  const int prot = PROT_READ | (tf->writable ? PROT_WRITE : 0);
+
+  void* map = mmap(NULL, size, prot, MAP_SHARED, tf->fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  tf->map = (cl_uchar*)map;
+  tf->map_size = size;
+  tf->hdr = (tree_file_header_t*)map;
+
+  return 0;
+}
+
+// Storage of node, given by its heap index
+cl_uchar*
+tree_file_node(const tree_file_t* tf, size_t node)
+{
+  return tf->nodes + (blocked_index(node, tf->height, tf->block_log) << 5);
+}
+
+// Creates ( or truncates ) tree file for N leaf nodes, in blocked layout with
+// given block_log ( 0 for heap layout ), & maps it in memory, so that caller
+// can write N leaves, each of 32 -bytes, using `blocked_set_leaves( ... )` on
+// `tf->nodes` ( or at `tf->nodes + N * 32`, in heap layout ) & then merklize
+// it using `tree_file_merklize( ... )`
+//
+// Returns 0 on success, otherwise -1, with `errno` set
+int
+tree_file_create_blocked(const char* path,
+                         size_t leaf_count,
+                         size_t block_log,
+                         tree_file_t* const tf)
+{
+  assert(leaf_count >= 2);
+  assert((leaf_count & (leaf_count - 1)) == 0);
+  static_assert(sizeof(tree_file_header_t) <= 1024, "header too large");
+
+  memset(tf, 0, sizeof(tree_file_t));
+
+  tf->writable = 1;
+  tf->page = (size_t)sysconf(_SC_PAGESIZE);
+  tf->leaf_count = leaf_count;
+  tf->height = blocked_height(leaf_count);
+  tf->block_log = block_log > tf->height ? 0 : block_log;
+
+  const size_t data_offset = tf->page;
+  const size_t data_size = blocked_slots(tf->height, tf->block_log) << 5;
+
+  tf->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (tf->fd < 0) {
+    return -1;
+  }
+
+  if (ftruncate(tf->fd, (off_t)(data_offset + data_size)) != 0 ||
+      tree_file_map(tf, data_offset + data_size) != 0) {
+    close(tf->fd);
+    return -1;
+  }
+
+  tf->nodes = tf->map + data_offset;
+
+  tree_file_header_t* const hdr = tf->hdr;
+  memcpy(hdr->magic, TREE_FILE_MAGIC, sizeof(hdr->magic));
+  hdr->version = TREE_FILE_VERSION;
+  hdr->byte_order = 0x01020304;
+  hdr->arity = 2;
+  hdr->hash_mode = TREE_HASH_BLAKE3_2TO1;
+  hdr->leaf_count = leaf_count;
+  hdr->data_offset = data_offset;
+  hdr->data_size = data_size;
+  hdr->block_log = tf->block_log;
+  hdr->sealed = 0;
+  tree_file_checksum(hdr, hdr->checksum);
+
+  return 0;
+}
+
+// Same as `tree_file_create_blocked( ... )`, in heap layout
+int
+tree_file_create(const char* path, size_t leaf_count, tree_file_t* const tf)
+{
+  return tree_file_create_blocked(path, leaf_count, 0, tf);
+}
+
+// Records root of tree in header, marks it as sealed & flushes whole file to
+// disk, making it loadable using `tree_file_open( ... )`
+int
+tree_file_seal(tree_file_t* const tf)
+{
+  tree_file_header_t* const hdr = tf->hdr;
+
+  memcpy(hdr->root, tree_file_node(tf, 1), 32);
+  hdr->sealed = 1;
+  tree_file_checksum(hdr, hdr->checksum);
+
+  return msync(tf->map, tf->map_size, MS_SYNC);
+}
+
+// Merklizes leaves already written in mapped tree file, on device, using
+// `merklize_inplace( ... )`, so that intermediate nodes are read back straight
+// into file mapping ( i.e. page cache ), without any intermediate copy; and
+// then seals it
+//
+// File in blocked layout is merklized using `merklize_blocked( ... )`, in
+// which case `krnl` must be `merklize_blocked` kernel, not `merklize`
+//
+// See `merklize_inplace( ... )` for meaning of `wg_size`, `ts` & `opts`
+cl_int
+tree_file_merklize(tree_file_t* const tf,
+                   cl_context ctx,
+                   cl_command_queue cq,
+                   cl_kernel krnl,
+                   size_t wg_size,
+                   cl_ulong* const ts,
+                   const merklize_opts_t* opts)
+{
+  cl_int status;
+
+  if (tf->block_log != 0) {
+    status = merklize_blocked(ctx,
+                              cq,
+                              krnl,
+                              tf->nodes,
+                              (size_t)tf->hdr->data_size,
+                              tf->leaf_count,
+                              tf->block_log,
+                              wg_size,
+                              ts,
+                              opts);
+  } else {
+    status = merklize_inplace(ctx,
+                              cq,
+                              krnl,
+                              tf->nodes,
+                              tf->leaf_count << 6,
+                              tf->leaf_count,
+                              wg_size,
+                              ts,
+                              opts);
+  }
+  check_for_error_and_return(status);
+
+  if (tree_file_seal(tf) != 0) {
+    return CL_INVALID_VALUE;
+  }
+
+  return CL_SUCCESS;
+}
+
+// Same as `tree_file_merklize( ... )`, but tree is merklized on host, see
+// `merklize_host( ... )`; file in blocked layout is merklized on calling
+// thread, see `merklize_blocked_host( ... )`
+int
+tree_file_merklize_host(tree_file_t* const tf, size_t worker_cnt)
+{
+  if (tf->block_log != 0) {
+    merklize_blocked_host(tf->nodes, tf->leaf_count, tf->block_log);
+    return tree_file_seal(tf);
+  }
+
+  const size_t size = tf->leaf_count << 5;
+
+  // leaves & intermediate nodes are disjoint halves of node storage
+  merklize_host(
+    tf->nodes + size, size, tf->leaf_count, tf->nodes, size, worker_cnt);
+
+  return tree_file_seal(tf);
+}
+
+// Opens sealed tree file & maps it in memory, validating its header, so that
+// root/ proofs can be served right away, without any rehashing
+//
+// When `writable` is set, leaves can be later updated using
+// `tree_file_update( ... )`
+//
+// Returns 0 on success, otherwise -1, with `errno` set; EINVAL denotes
+// malformed/ unsupported/ unsealed file
+int
+tree_file_open(const char* path, int writable, tree_file_t* const tf)
+{
+  memset(tf, 0, sizeof(tree_file_t));
+
+  tf->writable = writable;
+  tf->page = (size_t)sysconf(_SC_PAGESIZE);
+
+  tf->fd = open(path, writable ? O_RDWR : O_RDONLY);
+  if (tf->fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(tf->fd, &st) != 0) {
+    close(tf->fd);
+    return -1;
+  }
+
+  const size_t file_size = (size_t)st.st_size;
+  if (file_size < sizeof(tree_file_header_t) ||
+      tree_file_map(tf, file_size) != 0) {
+    close(tf->fd);
+    errno = file_size < sizeof(tree_file_header_t) ? EINVAL : errno;
+    return -1;
+  }
+
+  const tree_file_header_t* hdr = tf->hdr;
+
+  cl_uchar checksum[32];
+  tree_file_checksum(hdr, checksum);
+
+  const cl_ulong n = hdr->leaf_count;
+  const size_t height = n >= 2 ? blocked_height((size_t)n) : 0;
+  const int valid =
+    memcmp(hdr->magic, TREE_FILE_MAGIC, sizeof(hdr->magic)) == 0 &&
+    hdr->version == TREE_FILE_VERSION && hdr->byte_order == 0x01020304 &&
+    hdr->arity == 2 && hdr->hash_mode == TREE_HASH_BLAKE3_2TO1 &&
+    memcmp(hdr->checksum, checksum, 32) == 0 && hdr->sealed == 1 && n >= 2 &&
+    (n & (n - 1)) == 0 && hdr->block_log <= height &&
+    hdr->data_size == blocked_slots(height, (size_t)hdr->block_log) << 5 &&
+    hdr->data_offset % tf->page == 0 &&
+    hdr->data_offset + hdr->data_size == file_size;
+
+  if (!valid) {
+    munmap(tf->map, tf->map_size);
+    close(tf->fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tf->nodes = tf->map + hdr->data_offset;
+  tf->leaf_count = (size_t)n;
+  tf->height = height;
+  tf->block_log = (size_t)hdr->block_log;
+
+  return 0;
+}
+
+void
+tree_file_close(tree_file_t* const tf)
+{
+  munmap(tf->map, tf->map_size);
+  close(tf->fd);
+  memset(tf, 0, sizeof(tree_file_t));
+}
+
+// Root of tree, which lives at node index 1
+const cl_uchar*
+tree_file_root(const tree_file_t* tf)
+{
+  return tree_file_node(tf, 1);
+}
+
+// Writes log2( N ) -many sibling hashes ( 32 -bytes each ), on path from leaf
+// at given index to root, bottom-up
+void
+tree_file_proof(const tree_file_t* tf, size_t leaf_idx, cl_uchar* const proof)
+{
+  assert(leaf_idx < tf->leaf_count);
+
+  size_t node = tf->leaf_count + leaf_idx;
+  for (size_t h = 0; h < tf->height; h++, node >>= 1) {
+    memcpy(proof + (h << 5), tree_file_node(tf, node ^ 1), 32);
+  }
+}
+
+// Recomputes root of binary merkle tree of given height, from leaf at given
+// index & its sibling hashes, returning truth value of whether it matches
+// given root
+int
+merkle_proof_verify(const cl_uchar* root,
+                    size_t height,
+                    size_t leaf_idx,
+                    const cl_uchar* leaf,
+                    const cl_uchar* proof)
+{
+  cl_uchar msg[64];
+  cl_uchar node[32];
+
+  memcpy(node, leaf, 32);
+
+  for (size_t h = 0; h < height; h++, leaf_idx >>= 1) {
+    const int is_right = (leaf_idx & 1) == 1;
+
+    memcpy(msg + (is_right ? 32 : 0), node, 32);
+    memcpy(msg + (is_right ? 0 : 32), proof + (h << 5), 32);
+
+    blake3_hash_pair_host(msg, node);
+  }
+
+  return memcmp(node, root, 32) == 0;
+}
+
+// Flushes pages holding given nodes ( sorted by heap index, all at same level,
+// so that their storage slots are sorted too, in either layout ) to disk,
+// coalescing runs of contiguous pages into single `msync( ... )` call
+int
+tree_file_sync_nodes(const tree_file_t* tf, const size_t* nodes, size_t cnt)
+{
+  const size_t base = (size_t)(tf->nodes - tf->map);
+
+  size_t run_from = 0, run_to = 0; // [from, to) in pages
+  int res = 0;
+
+  for (size_t i = 0; i <= cnt; i++) {
+    size_t page = 0;
+    if (i < cnt) {
+      const size_t slot =
+        blocked_index(*(nodes + i), tf->height, tf->block_log);
+      page = (base + (slot << 5)) / tf->page;
+
+      // nodes are 32 -bytes wide & aligned, so they never cross pages
+      if (run_to > run_from && page >= run_from && page <= run_to) {
+        run_to = page + 1 > run_to ? page + 1 : run_to;
+        continue;
+      }
+    }
+
+    if (run_to > run_from) {
+      res |= msync(tf->map + run_from * tf->page,
+                   (run_to - run_from) * tf->page,
+                   MS_SYNC);
+    }
+
+    run_from = page;
+    run_to = page + 1;
+  }
+
+  return res;
+}
+
+// Sets `cnt` -many leaves, where i-th leaf index is idx[i] & its 32 -bytes
+// value lives at leaves + 32 * i, rehashing only nodes on their paths to root,
+// on host, level by level; only pages holding touched nodes & header page are
+// then written back to disk
+//
+// File is unsealed on disk, before any node is touched, and sealed again once
+// all touched nodes are written back, so that crash midway leaves behind a
+// file which `tree_file_open( ... )` refuses, instead of one whose nodes
+// don't match its root
+//
+// Returns 0 on success, otherwise -1, with `errno` set
+int
+tree_file_update(tree_file_t* const tf,
+                 const size_t* idx,
+                 const cl_uchar* leaves,
+                 size_t cnt)
+{
+  assert(tf->writable);
+
+  if (cnt == 0) {
+    return 0;
+  }
+
+  tree_file_header_t* const hdr = tf->hdr;
+
+  hdr->sealed = 0;
+  tree_file_checksum(hdr, hdr->checksum);
+
+  if (msync(tf->map, tf->page, MS_SYNC) != 0) {
+    return -1;
+  }
+
+  // heap indices of nodes touched at current level, kept sorted & unique
+  size_t* touched = (size_t*)malloc(sizeof(size_t) * cnt);
+  check_mem_alloc(touched);
+
+  for (size_t i = 0; i < cnt; i++) {
+    assert(*(idx + i) < tf->leaf_count);
+
+    const size_t node = tf->leaf_count + *(idx + i);
+    memcpy(tree_file_node(tf, node), leaves + (i << 5), 32);
+
+    *(touched + i) = node;
+  }
+
+  // insertion sort, batches are expected to be small & mostly sorted
+  for (size_t i = 1; i < cnt; i++) {
+    const size_t v = *(touched + i);
+
+    size_t j = i;
+    for (; j > 0 && *(touched + j - 1) > v; j--) {
+      *(touched + j) = *(touched + j - 1);
+    }
+    *(touched + j) = v;
+  }
+
+  size_t t_cnt = 0;
+  for (size_t i = 0; i < cnt; i++) {
+    if (t_cnt == 0 || *(touched + t_cnt - 1) != *(touched + i)) {
+      *(touched + t_cnt++) = *(touched + i);
+    }
+  }
+
+  int res = tree_file_sync_nodes(tf, touched, t_cnt);
+
+  // children may live in different blocks, so they're gathered first
+  cl_uchar msg[64];
+
+  for (size_t h = 0; h < tf->height; h++) {
+    // parents of touched nodes remain sorted & unique, written in place
+    size_t p_cnt = 0;
+    for (size_t i = 0; i < t_cnt; i++) {
+      const size_t p = *(touched + i) >> 1;
+
+      if (p_cnt == 0 || *(touched + p_cnt - 1) != p) {
+        *(touched + p_cnt++) = p;
+      }
+    }
+    t_cnt = p_cnt;
+
+    for (size_t i = 0; i < t_cnt; i++) {
+      const size_t p = *(touched + i);
+      memcpy(msg, tree_file_node(tf, p << 1), 32);
+      memcpy(msg + 32, tree_file_node(tf, (p << 1) | 1), 32);
+
+      blake3_hash_pair_host(msg, tree_file_node(tf, p));
+    }
+
+    res |= tree_file_sync_nodes(tf, touched, t_cnt);
+  }
+
+  free(touched);
+
+  // header page is written back last, so file is sealed only once all
+  // touched nodes reached disk
+  if (res != 0) {
+    return -1;
+  }
+
+  memcpy(hdr->root, tree_file_node(tf, 1), 32);
+  hdr->sealed = 1;
+  tree_file_checksum(hdr, hdr->checksum);
+
+  res |= msync(tf->map, tf->page, MS_SYNC);
+
+  return res == 0 ? 0 : -1;
+}
@@ -3,6 +3,12 @@
 // Taken from
 // https://github.com/itzmeanjan/vectorized-rescue-prime/blob/614500d/utils.c
 
+// POSIX/ GNU extensions ( e.g. monotonic clock, threads, mmap ) are used by
+// few host side routines, which must be requested before any system header
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define CL_TARGET_OPENCL_VERSION 220
 #include <CL/cl.h>
 #include <assert.h>
@@ -93,6 +99,115 @@ find_device(cl_device_id* device_id)
   return CL_DEVICE_NOT_FOUND;
 }
 
+// Collects all CPU/ GPU devices accessible from current host, across all
+// platforms, instead of just first one ( see `find_device( ... )` )
+//
+// On success, `*devices` points to heap allocation holding `*count` -many
+// device identifiers, which must be freed by caller
+cl_int
+find_devices(cl_device_id** devices, cl_uint* const count)
+{
+  *devices = NULL;
+  *count = 0;
+
+  cl_int status;
+
+  cl_uint num_platforms;
+  status = clGetPlatformIDs(0, NULL, &num_platforms);
+  check_for_error_and_return(status);
+
+  if (num_platforms == 0) {
+    return CL_DEVICE_NOT_FOUND;
+  }
+
+  cl_platform_id* platforms =
+    (cl_platform_id*)malloc(sizeof(cl_platform_id) * num_platforms);
+  check_mem_alloc(platforms);
+
+  status = clGetPlatformIDs(num_platforms, platforms, NULL);
+  if (status != CL_SUCCESS) {
+    free(platforms);
+    return status;
+  }
+
+  cl_device_type dev_type = CL_DEVICE_TYPE_CPU | CL_DEVICE_TYPE_GPU;
+
+  for (cl_uint i = 0; i < num_platforms; i++) {
+    cl_uint num_devices;
+    status = clGetDeviceIDs(*(platforms + i), dev_type, 0, NULL, &num_devices);
+    check_for_error_and_continue(status);
+
+    if (num_devices == 0) {
+      continue;
+    }
+
+    cl_device_id* devices_ = (cl_device_id*)realloc(
+      *devices, sizeof(cl_device_id) * (*count + num_devices));
+    check_mem_alloc(devices_);
+    *devices = devices_;
+
+    status = clGetDeviceIDs(
+      *(platforms + i), dev_type, num_devices, *devices + *count, NULL);
+    check_for_error_and_continue(status);
+
+    *count += num_devices;
+  }
+
+  free(platforms);
+
+  return *count > 0 ? CL_SUCCESS : CL_DEVICE_NOT_FOUND;
+}
+
+// Partitions given device into sub-devices, one per NUMA node, using
+// `clCreateSubDevices` with CL_DEVICE_AFFINITY_DOMAIN_NUMA
+//
+// On success, `*sub_devices` points to heap allocation holding `*count` -many
+// sub-device identifiers, which must be freed by caller ( after releasing each
+// of them using `clReleaseDevice` )
+//
+// Devices which can't be partitioned this way ( e.g. most GPUs or single
+// socket hosts ) make this function return error, in that case just use
+// device itself
+cl_int
+create_numa_sub_devices(cl_device_id dev_id,
+                        cl_device_id** sub_devices,
+                        cl_uint* const count)
+{
+  *sub_devices = NULL;
+  *count = 0;
+
+  cl_int status;
+
+  const cl_device_partition_property props[] = {
+    CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+    CL_DEVICE_AFFINITY_DOMAIN_NUMA,
+    0
+  };
+
+  cl_uint num_sub_devices = 0;
+  status = clCreateSubDevices(dev_id, props, 0, NULL, &num_sub_devices);
+  check_for_error_and_return(status);
+
+  if (num_sub_devices == 0) {
+    return CL_DEVICE_NOT_FOUND;
+  }
+
+  *sub_devices =
+    (cl_device_id*)malloc(sizeof(cl_device_id) * num_sub_devices);
+  check_mem_alloc(*sub_devices);
+
+  status =
+    clCreateSubDevices(dev_id, props, num_sub_devices, *sub_devices, NULL);
+  if (status != CL_SUCCESS) {
+    free(*sub_devices);
+    *sub_devices = NULL;
+    return status;
+  }
+
+  *count = num_sub_devices;
+  return CL_SUCCESS;
+}
+
 // Given a source kernel file, builds OpenCL program with it
 cl_int
 build_kernel_from_source(cl_context ctx,
@@ -257,6 +372,16 @@ words_to_le_bytes(const cl_uint* msg_words,
   }
 }
 
+// On little endian hosts, 4 contiguous little endian bytes already are the
+// `cl_uint` they encode, so `words_{from,to}_le_bytes( ... )` can be skipped
+// and byte arrays can be handed over to device, as is
+int
+host_is_little_endian()
+{
+  const cl_uint one = 1;
+  return *(const cl_uchar*)&one == 1;
+}
+
 // Ensure that OpenCL queue has profiling enabled, other wise this function
 // should fail
 //
@@ -19,21 +19,27 @@ constant const uint CHUNK_END = 1 << 1;
 constant const uint PARENT = 1 << 2;
 constant const uint ROOT = 1 << 3;
 
+// Address space where 64 -bytes message words live while being compressed
+//
+// Message words are always compressed in private memory, so that input nodes
+// are left untouched. Only when GLOBAL_MSG is defined ( and input/ output are
+// taken as `uint *` ), message words are compressed right where they're in
+// global memory; note, `permute( ... )` writes back to input buffer in that
+// case, so it's only useful for benchmarking
+#if defined(GLOBAL_MSG) &&                                                     \
+  !(defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES))
+#define MSG_SPACE global
+#else
+#define MSG_SPACE private
+#endif
+
 // Permutes input message words using a same-sized temporary array ( 64 -bytes
 // ), as per permutation index provided to kernel in constant memory
 //
 // See
 // https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs#L67-L73
 void
-permute(
-
-#if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
-  private uint* const msg
-#else
-  global uint* const msg
-#endif
-
-)
+permute(MSG_SPACE uint* const msg)
 {
 private
   uint permuted[16];
@@ -65,6 +71,67 @@ private
   }
 }
 
+#if defined(SCALAR_ROUND)
+
+// BLAKE3 quarter-round, mixing two message words into four state words, with
+// only scalar operations
+//
+// See
+// https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs#L42-L52
+#ifndef TO_IL
+inline
+#endif
+
+  void
+  g(private uint* const state,
+    size_t a,
+    size_t b,
+    size_t c,
+    size_t d,
+    uint mx,
+    uint my)
+{
+  // note, `rotate` is left rotation, so rotating right by n bits is same as
+  // rotating left by ( 32 - n ) bits
+  state[a] = state[a] + state[b] + mx;
+  state[d] = rotate(state[d] ^ state[a], 16u);
+  state[c] = state[c] + state[d];
+  state[b] = rotate(state[b] ^ state[c], 20u);
+  state[a] = state[a] + state[b] + my;
+  state[d] = rotate(state[d] ^ state[a], 24u);
+  state[c] = state[c] + state[d];
+  state[b] = rotate(state[b] ^ state[c], 25u);
+}
+
+// Same as vectorised `blake3_round( ... )` below, but state is processed as
+// 16 scalar words, which is what BLAKE3 reference implementation does; only
+// compiled in when SCALAR_ROUND is defined, for comparing vector width 1 with
+// vector width 4
+//
+// See
+// https://github.com/BLAKE3-team/BLAKE3/blob/da4c792d8094f35c05c41c9aeb5dfe4aa67ca1ac/reference_impl/reference_impl.rs#L54-L65
+#ifndef TO_IL
+inline
+#endif
+
+  void
+  blake3_round_scalar(private uint* const state, MSG_SPACE const uint* msg)
+{
+  // column-wise mixing
+  g(state, 0, 4, 8, 12, msg[0], msg[1]);
+  g(state, 1, 5, 9, 13, msg[2], msg[3]);
+  g(state, 2, 6, 10, 14, msg[4], msg[5]);
+  g(state, 3, 7, 11, 15, msg[6], msg[7]);
+
+  // diagonal mixing
+  g(state, 0, 5, 10, 15, msg[8], msg[9]);
+  g(state, 1, 6, 11, 12, msg[10], msg[11]);
+  g(state, 2, 7, 8, 13, msg[12], msg[13]);
+  g(state, 3, 4, 9, 14, msg[14], msg[15]);
+}
+
+#endif
+
 // A mixing round of blake3, where 64 -bytes input message is mixed with
 // hash state ( both column-wise & diagonally )
 //
@@ -82,16 +149,11 @@ inline
 #endif
 
   void
-  blake3_round(private uint4* const state,
-
-#if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
-               private const uint* msg
-#else
-             global const uint* msg
-#endif
-
-  )
+  blake3_round(private uint4* const state, MSG_SPACE const uint* msg)
 {
+#if defined(SCALAR_ROUND)
+  blake3_round_scalar((private uint*)state, msg);
+#else
   const uint4 mx = (uint4)(msg[0], msg[2], msg[4], msg[6]);
   const uint4 my = (uint4)(msg[1], msg[3], msg[5], msg[7]);
   const uint4 mz = (uint4)(msg[8], msg[10], msg[12], msg[14]);
@@ -131,6 +193,7 @@ inline
   state[1] = state[1].wxyz;
   state[2] = state[2].zwxy;
   state[3] = state[3].yzwx;
+#endif
 }
 
 // Given input message of 64 -bytes, this function should be producing
@@ -151,12 +214,7 @@ inline
 void
 compress(
 
-#if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
-  private uint* const msg,
-#else
-  global uint* const msg,
-#endif
-
+  MSG_SPACE uint* const msg,
   ulong counter,
   uint block_len,
   uint flags,
@@ -285,18 +343,12 @@ words_to_le_bytes(private const uint* msg_words, global uchar* const output)
 // 64 -bytes message. As this is only chunk with only block inside itself
 // both CHUNK_START, CHUNK_START are required. Note, ROOT flag is also set
 // because BLAKE3 merkle tree has only one node, which is obviously root node !
-#if defined(EXPOSE_BLAKE3_HASH)
-kernel
-#else
-
 #ifndef TO_IL
 inline
-#endif
-
 #endif
 
   void
-  hash(
+  blake3_hash(
 
 #if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
     global const uchar* input,
@@ -318,11 +370,76 @@ private
   words_from_le_bytes(input, msg_words);
   compress(msg_words, 0, BLOCK_LEN, CHUNK_START | CHUNK_END | ROOT, out_cv);
   words_to_le_bytes(out_cv, output);
-#else
+#elif defined(GLOBAL_MSG)
   compress(input, 0, BLOCK_LEN, CHUNK_START | CHUNK_END | ROOT, output);
+#else
+private
+  uint msg_words[16];
+
+  // input message is left untouched, only its private copy gets permuted
+  vstore4(vload4(0, input), 0, msg_words);
+  vstore4(vload4(1, input), 1, msg_words);
+  vstore4(vload4(2, input), 2, msg_words);
+  vstore4(vload4(3, input), 3, msg_words);
+
+  compress(msg_words, 0, BLOCK_LEN, CHUNK_START | CHUNK_END | ROOT, output);
+#endif
+}
+
+#if defined(EXPOSE_BLAKE3_HASH)
+
+// Single work-item kernel, computing 2-to-1 blake3 hash of 64 -bytes input
+//
+// Just wrapper on `blake3_hash( ... )` function above
+kernel void
+hash(
+
+#if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
+  global const uchar* input,
+  global uchar* const output
+#else
+  global uint* const input,
+  global uint* const output
 #endif
+
+)
+{
+  blake3_hash(input, output);
 }
 
+// Each work-item of this kernel computes 2-to-1 blake3 hash of one among many
+// independent 64 -bytes messages, placed contiguously in `input`, writing
+// 32 -bytes digests contiguously to `output`
+//
+// There's no dependency among work-items, so this is used for measuring
+// throughput of compression function alone, without any tree dispatch overhead
+kernel void
+hash_many(
+
+#if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
+  global const uchar* input,
+  global uchar* const output
+#else
+  global uint* const input,
+  global uint* const output
+#endif
+
+)
+{
+private
+  const size_t idx = get_global_id(0);
+
+#if defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)
+  // idx << 6 => because input being hashed is 64 -bytes wide
+  // idx << 5 => because output of blake3 hash is 32 -bytes wide
+  blake3_hash(input + (idx << 6), output + (idx << 5));
+#else
+  blake3_hash(input + (idx << 4), output + (idx << 3));
+#endif
+}
+
+#endif
+
 // Each work-item of this kernel computes 2-to-1 blake3 hash, where 64 -bytes
 // input is read from global memory and 32 -bytes output digest is written to
 // global memory
@@ -350,7 +467,105 @@ private
 
   // idx << 4 => because input being hashed is 64 -bytes wide
   // idx << 3 => because output of blake3 hash is 32 -bytes wide
-  hash(input + *i_offset + (idx << 4), output + *o_offset + (idx << 3));
+  blake3_hash(input + *i_offset + (idx << 4),
+              output + *o_offset + (idx << 3));
 }
 
 #endif
+
+// Storage slot of node, given by its heap index ( root at 1, children of node
+// i at 2i & 2i + 1 ), in subtree blocked layout of tree of given height, where
+// levels are grouped in bands of `block_log` levels & each band is a sequence
+// of subtrees, each in its own heap order
+//
+// Must stay in sync with `blocked_index( ... )` in include/blocked.h, which
+// also documents the layout
+ulong
+blocked_index(const ulong node, const uint height, const uint block_log)
+{
+  const uint depth = 63 - (uint)clz(node);
+  const uint start = (depth / block_log) * block_log;
+  const uint h = min(block_log, height + 1 - start);
+
+  ulong offset = 0;
+  for (uint j = block_log; j <= start; j += block_log) {
+    offset += 1ul << j;
+  }
+
+  const uint shift = depth - start;
+  const ulong block = (node >> shift) - (1ul << start);
+  const ulong local = (1ul << shift) | (node & ((1ul << shift) - 1ul));
+
+  return offset + (block << h) + local;
+}
+
+// Each work-item of this kernel computes one node at given depth ( root at 0
+// ), of tree kept in subtree blocked layout, in place
+//
+// Two children may live in different blocks, so they're gathered in private
+// memory, before being compressed, while digest is written straight to its
+// slot; so there's no conversion from heap layout, after tree is built
+#if !(defined(LE_BYTES_TO_WORDS) && defined(WORDS_TO_LE_BYTES)) &&             \
+  !defined(GLOBAL_MSG)
+
+kernel void
+merklize_blocked(global uint* const tree,
+                 const uint depth,
+                 const uint height,
+                 const uint block_log)
+{
+private
+  const ulong node = (1ul << depth) + get_global_id(0);
+private
+  uint msg_words[16];
+
+  vstore8(vload8(blocked_index(node << 1, height, block_log), tree),
+          0,
+          msg_words);
+  vstore8(vload8(blocked_index((node << 1) | 1, height, block_log), tree),
+          1,
+          msg_words);
+
+  compress(msg_words,
+           0,
+           BLOCK_LEN,
+           CHUNK_START | CHUNK_END | ROOT,
+           tree + (blocked_index(node, height, block_log) << 3));
+}
+
+#endif
+
+// Each work-item of this kernel takes one node of frontier i.e. a node which
+// differs between two merkle trees ( having same number of leaves ), and
+// compares both of its children across two trees, appending differing ones
+// to next frontier, using atomic counter for compacting them
+//
+// Both trees are expected in heap layout, as produced by
+// `merklize_inplace( ... )` on host side, i.e. 2N nodes ( each 8 `uint`s ),
+// root at node index 1 & children of node i at 2i & 2i + 1, so that frontier
+// holds node indices & walking it down, level by level, ends at indices of
+// differing leaves, in [N, 2N)
+//
+// Note, comparison is for equality only, so there's no need to interpret
+// nodes as little endian bytes
+kernel void
+diff_frontier(global const uint* restrict tree_a,
+              global const uint* restrict tree_b,
+              global const ulong* restrict frontier,
+              global ulong* const restrict next,
+              global uint* const restrict next_cnt)
+{
+private
+  const size_t idx = get_global_id(0);
+private
+  const ulong node = frontier[idx];
+
+  for (ulong child = node << 1; child <= ((node << 1) | 1); child++) {
+    const uint8 a = vload8(child, tree_a);
+    const uint8 b = vload8(child, tree_b);
+
+    if (any(a != b)) {
+      next[atomic_inc(next_cnt)] = child;
+    }
+  }
+}
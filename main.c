@@ -15,7 +15,7 @@
 // host to device & device to host data transfer cost
 #define avg_bench_time(itr_cnt, ts)                                            \
   for (size_t i = 0; i < itr_cnt; i++) {                                       \
-    cl_ulong* ts_ = (cl_ulong*)malloc(sizeof(cl_ulong) * 3);                   \
+    cl_ulong ts_[3] = { 0 };                                                   \
     status = bench_merklize(ctx, c_queue, krnl_2, leaf_count, wg_size, ts_);   \
     *(ts + 0) += *(ts_ + 0);                                                   \
     *(ts + 1) += *(ts_ + 1);                                                   \
@@ -147,15 +147,97 @@ main(int argc, char** argv)
   cl_kernel krnl_2 = clCreateKernel(*prgm_2, "merklize", &status);
   show_message_and_exit(status, "failed to create `merklize` kernel !\n");
 
+  cl_kernel krnl_3 = clCreateKernel(*prgm_2, "diff_frontier", &status);
+  show_message_and_exit(status, "failed to create `diff_frontier` kernel !\n");
+
+  cl_kernel krnl_4 = clCreateKernel(*prgm_2, "merklize_blocked", &status);
+  show_message_and_exit(status,
+                        "failed to create `merklize_blocked` kernel !\n");
+
   status = test_hash_0(ctx, c_queue, krnl_0);
   status = test_hash_1(ctx, c_queue, krnl_1);
 
   printf("\npassed blake3 hash test !\n");
-  printf("\nBenchmarking Binary Merklization using BLAKE3\n\n");
 
   size_t wg_size = 0;
   preferred_work_group_size_multiple(krnl_2, dev_id, &wg_size);
 
+  status = test_merklize_multi(dev_id);
+  show_message_and_exit(status, "failed to merklize on multiple devices !\n");
+
+  printf("passed multi-device merklization test !\n");
+
+  status = test_merklize_host();
+  show_message_and_exit(status, "failed to merklize on host !\n");
+
+  printf("passed host merklization test !\n");
+
+  status = test_merklize_inplace(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to merklize in place !\n");
+
+  printf("passed in-place merklization test !\n");
+
+  status = test_merklize_async(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to merklize asynchronously !\n");
+
+  printf("passed asynchronous merklization test !\n");
+
+  status = test_merklize_iov(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to merklize gathered segments !\n");
+
+  printf("passed scatter/ gather merklization test !\n");
+
+  status = test_merklize_stream(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to stream tree levels back !\n");
+
+  printf("passed streaming readback merklization test !\n");
+
+  status = test_merklize_arena(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to merklize using buffer arena !\n");
+
+  printf("passed buffer arena merklization test !\n");
+
+  status = test_merklize_metrics(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to record merklization metrics !\n");
+
+  printf("passed merklization metrics test !\n");
+
+  status = test_smt(ctx, c_queue, krnl_2);
+  show_message_and_exit(status, "failed to update sparse merkle tree !\n");
+
+  printf("passed sparse merkle tree test !\n");
+
+  status = test_tree_file(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to build tree file !\n");
+
+  printf("passed tree file test !\n");
+
+  status = test_merklize_blocked(ctx, c_queue, krnl_4, wg_size);
+  show_message_and_exit(status, "failed to merklize in blocked layout !\n");
+
+  printf("passed blocked layout merklization test !\n");
+
+  status = test_merklize_memo(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to merklize with memoization !\n");
+
+  printf("passed memoized merklization test !\n");
+
+  status = test_merkle_diff(ctx, c_queue, krnl_3);
+  show_message_and_exit(status, "failed to diff merkle trees !\n");
+
+  printf("passed merkle diff test !\n");
+
+  status = test_range_root(ctx, c_queue, krnl_2);
+  show_message_and_exit(status, "failed to compute range root !\n");
+
+  printf("passed range root test !\n");
+
+  status = test_service(ctx, c_queue, krnl_2, wg_size);
+  show_message_and_exit(status, "failed to merklize using service !\n");
+
+  printf("passed merklization service test !\n");
+  printf("\nBenchmarking Binary Merklization using BLAKE3\n\n");
+
   const size_t itr_cnt = 1 << 3;
 
   for (size_t i = 20; i <= 25; i++) {
@@ -187,6 +269,8 @@ main(int argc, char** argv)
   clReleaseKernel(krnl_0);
   clReleaseKernel(krnl_1);
   clReleaseKernel(krnl_2);
+  clReleaseKernel(krnl_3);
+  clReleaseKernel(krnl_4);
   clReleaseProgram(*prgm_0);
   clReleaseProgram(*prgm_1);
   clReleaseProgram(*prgm_2);
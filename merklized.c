@@ -0,0 +1,139 @@
+// Long-running local merklization service, see include/service.h for protocol
+//
+// Usage:
+//
+//  ./merklized [--socket PATH] [--max-log N] [--batch-log N] [--batch-us N]
+//              [--batch-mb N]
+//
+// Runs till SIGINT/ SIGTERM is received, then all counters are written to
+// stderr
+
+#include "service.h"
+#include <signal.h>
+
+#define show_message_and_exit(status, msg)                                     \
+  if (status != CL_SUCCESS) {                                                  \
+    fprintf(stderr, msg);                                                      \
+    return EXIT_FAILURE;                                                       \
+  }
+
+service_t srv;
+
+void
+stop_service(int sig)
+{
+  atomic_store(&srv.stop, 1);
+}
+
+int
+main(int argc, char** argv)
+{
+  const char* path = "/tmp/merklized.sock";
+  size_t max_log = 27;
+  size_t batch_log = 16;
+  size_t batch_us = 1000;
+  size_t batch_mb = 64;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (val == NULL) {
+      fprintf(stderr, "missing value for %s !\n", arg);
+      return EXIT_FAILURE;
+    }
+
+    if (strcmp(arg, "--socket") == 0) {
+      path = val;
+    } else if (strcmp(arg, "--max-log") == 0) {
+      max_log = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--batch-log") == 0) {
+      batch_log = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--batch-us") == 0) {
+      batch_us = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--batch-mb") == 0) {
+      batch_mb = strtoull(val, NULL, 10);
+    } else {
+      fprintf(stderr, "unknown argument %s !\n", arg);
+      return EXIT_FAILURE;
+    }
+
+    i++;
+  }
+
+  if (max_log < 1 || max_log > 40 || batch_log > max_log) {
+    fprintf(stderr, "invalid tree size limits !\n");
+    return EXIT_FAILURE;
+  }
+
+  cl_int status;
+
+  cl_device_id dev_id;
+  status = find_device(&dev_id);
+  show_message_and_exit(status, "failed to find device !\n");
+
+  cl_context ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &status);
+  show_message_and_exit(status, "failed to create context !\n");
+
+  // see main.c, for why these queue properties are required
+  cl_queue_properties props[] = { CL_QUEUE_PROPERTIES,
+                                  CL_QUEUE_PROFILING_ENABLE |
+                                    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                  0 };
+  cl_command_queue c_queue =
+    clCreateCommandQueueWithProperties(ctx, dev_id, props, &status);
+  show_message_and_exit(status, "failed to create command queue !\n");
+
+  cl_program prgm;
+  status = build_kernel_from_source(
+    ctx, dev_id, "kernel.cl", ocl_kernel_flag_2, &prgm);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "failed to compile kernel !\n");
+
+    show_build_log(dev_id, prgm);
+    return EXIT_FAILURE;
+  }
+
+  cl_kernel krnl = clCreateKernel(prgm, "merklize", &status);
+  show_message_and_exit(status, "failed to create `merklize` kernel !\n");
+
+  size_t wg_size = 0;
+  preferred_work_group_size_multiple(krnl, dev_id, &wg_size);
+
+  // preferred multiple is not guaranteed to be power of 2
+  size_t wg = 1;
+  while (wg < wg_size) {
+    wg <<= 1;
+  }
+
+  if (service_init(&srv, ctx, c_queue, krnl, wg, path) != 0) {
+    perror("failed to listen on socket");
+    return EXIT_FAILURE;
+  }
+
+  srv.max_log = max_log;
+  srv.batch_log = batch_log;
+  srv.batch_ns = (cl_ulong)batch_us * 1000ul;
+  srv.batch_bytes = batch_mb << 20;
+
+  signal(SIGINT, stop_service);
+  signal(SIGTERM, stop_service);
+
+  fprintf(stderr, "serving on %s\n", path);
+
+  service_run(&srv);
+
+  service_stats_t stats = srv.stats;
+  stats.uptime = service_now_ns() - srv.started;
+  service_stats_print(&stats, stderr);
+
+  service_close(&srv);
+
+  clReleaseKernel(krnl);
+  clReleaseProgram(prgm);
+  clReleaseCommandQueue(c_queue);
+  clReleaseContext(ctx);
+  clReleaseDevice(dev_id);
+
+  return EXIT_SUCCESS;
+}
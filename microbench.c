@@ -0,0 +1,278 @@
+// Microbenchmark of BLAKE3 compression function alone
+//
+// Each compile time variant of `hash_many` kernel ( see kernel.cl ) is
+// dispatched over millions of independent 64 -bytes messages, so that there's
+// no tree level dependency/ dispatch overhead involved, and throughput is
+// reported as compressions per second & cycles per byte
+//
+// Variants differ in
+//
+// - input/ output as `uchar *` ( converted to words on device ) or `uint *`
+// - message words being compressed in global memory or in private memory
+// - BLAKE3 round operating on 4 -lane vectors or on scalar words
+//
+// Usage:
+//
+//  ./microbench [--log-count N] [--iters N] [--warmup N] [--wg N]
+
+#include "bench.h"
+
+#define show_message_and_exit(status, msg)                                     \
+  if (status != CL_SUCCESS) {                                                  \
+    printf(msg);                                                               \
+    return EXIT_FAILURE;                                                       \
+  }
+
+typedef struct
+{
+  const char* name;
+  const char* flags; // online compilation flags
+  int uchar_io;      // input/ output taken as `uchar *` ?
+} hash_variant_t;
+
+const hash_variant_t hash_variants[] = {
+  { "uchar-io/private-msg/vec4", ocl_kernel_flag_0, 1 },
+  { "uchar-io/private-msg/scalar",
+    "-w -DLE_BYTES_TO_WORDS -DWORDS_TO_LE_BYTES -DEXPOSE_BLAKE3_HASH "
+    "-DSCALAR_ROUND",
+    1 },
+  { "uint-io/global-msg/vec4", "-w -DEXPOSE_BLAKE3_HASH -DGLOBAL_MSG", 0 },
+  { "uint-io/global-msg/scalar",
+    "-w -DEXPOSE_BLAKE3_HASH -DGLOBAL_MSG -DSCALAR_ROUND",
+    0 },
+  { "uint-io/private-msg/vec4", ocl_kernel_flag_1, 0 },
+  { "uint-io/private-msg/scalar", "-w -DEXPOSE_BLAKE3_HASH -DSCALAR_ROUND", 0 },
+};
+const size_t hash_variant_cnt = sizeof(hash_variants) / sizeof(hash_variant_t);
+
+// BLAKE3 digest of 64 -bytes message { 0, 1, ... 63 }, same as what's used in
+// test.h
+const cl_uchar known_digest[32] = { 78,  237, 113, 65,  234, 74,  92,  212,
+                                    183, 136, 96,  107, 210, 63,  70,  226,
+                                    18,  175, 156, 172, 235, 172, 220, 125,
+                                    31,  76,  109, 199, 242, 81,  27,  152 };
+
+// Dispatches `hash_many` kernel once over `count` -many messages, returning
+// kernel execution time ( in nanoseconds ) by setting `ts`
+cl_int
+dispatch_hash_many(cl_command_queue cq,
+                   cl_kernel krnl,
+                   size_t count,
+                   size_t wg_size,
+                   cl_ulong* const ts)
+{
+  cl_int status;
+
+  size_t glb_work_items[] = { count };
+  size_t loc_work_items[] = { wg_size };
+
+  cl_event evt;
+  status = clEnqueueNDRangeKernel(cq,
+                                  krnl,
+                                  1,
+                                  NULL,
+                                  glb_work_items,
+                                  wg_size == 0 ? NULL : loc_work_items,
+                                  0,
+                                  NULL,
+                                  &evt);
+  check_for_error_and_return(status);
+
+  status = clWaitForEvents(1, &evt);
+  if (status == CL_SUCCESS) {
+    status = time_event(evt, ts);
+  }
+
+  clReleaseEvent(evt);
+  return status;
+}
+
+int
+main(int argc, char** argv)
+{
+  size_t log_count = 22;
+  size_t iters = 8;
+  size_t warmup = 1;
+  size_t wg_size = 0; // 0 => let runtime decide
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const size_t val = strtoull(argv[i + 1], NULL, 10);
+
+    if (strcmp(argv[i], "--log-count") == 0) {
+      log_count = val;
+    } else if (strcmp(argv[i], "--iters") == 0) {
+      iters = val;
+    } else if (strcmp(argv[i], "--warmup") == 0) {
+      warmup = val;
+    } else if (strcmp(argv[i], "--wg") == 0) {
+      wg_size = val;
+    } else {
+      fprintf(stderr, "unknown argument %s !\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (iters == 0) {
+    fprintf(stderr, "invalid iteration count !\n");
+    return EXIT_FAILURE;
+  }
+
+  const size_t count = (size_t)1 << log_count; // # -of messages
+  const size_t i_size = count << 6;
+  const size_t o_size = count << 5;
+
+  cl_int status;
+
+  cl_device_id dev_id;
+  status = find_device(&dev_id);
+  show_message_and_exit(status, "failed to find device !\n");
+
+  cl_uint clock_mhz = 0;
+  cl_uint compute_units = 0;
+  clGetDeviceInfo(dev_id,
+                  CL_DEVICE_MAX_CLOCK_FREQUENCY,
+                  sizeof(cl_uint),
+                  &clock_mhz,
+                  NULL);
+  clGetDeviceInfo(dev_id,
+                  CL_DEVICE_MAX_COMPUTE_UNITS,
+                  sizeof(cl_uint),
+                  &compute_units,
+                  NULL);
+
+  cl_context ctx = clCreateContext(NULL, 1, &dev_id, NULL, NULL, &status);
+  show_message_and_exit(status, "failed to create context !\n");
+
+  cl_queue_properties props[] = { CL_QUEUE_PROPERTIES,
+                                  CL_QUEUE_PROFILING_ENABLE,
+                                  0 };
+  cl_command_queue c_queue =
+    clCreateCommandQueueWithProperties(ctx, dev_id, props, &status);
+  show_message_and_exit(status, "failed to create command queue !\n");
+
+  // random messages, where first one is known, so that output of each variant
+  // can be checked before it's timed
+  cl_uchar* i_bytes = (cl_uchar*)malloc(i_size);
+  check_mem_alloc(i_bytes);
+  cl_uint* i_words = (cl_uint*)malloc(i_size);
+  check_mem_alloc(i_words);
+  cl_uchar* o_bytes = (cl_uchar*)malloc(o_size);
+  check_mem_alloc(o_bytes);
+  cl_uint* o_words = (cl_uint*)malloc(o_size);
+  check_mem_alloc(o_words);
+  cl_ulong* samples = (cl_ulong*)malloc(sizeof(cl_ulong) * iters);
+  check_mem_alloc(samples);
+
+  random_input(i_bytes, i_size);
+  static_input_0(i_bytes, 64);
+  words_from_le_bytes(i_bytes, i_size, i_words, i_size >> 2);
+
+  cl_mem i_buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, i_size, NULL, &status);
+  show_message_and_exit(status, "failed to allocate input buffer !\n");
+  cl_mem o_buf = clCreateBuffer(ctx, CL_MEM_WRITE_ONLY, o_size, NULL, &status);
+  show_message_and_exit(status, "failed to allocate output buffer !\n");
+
+  printf("variant,messages,iters,min_ns,median_ns,p99_ns,mcompress_per_s,"
+         "cycles_per_byte\n");
+
+  for (size_t v = 0; v < hash_variant_cnt; v++) {
+    const hash_variant_t* var = hash_variants + v;
+
+    cl_program prgm;
+    status =
+      build_kernel_from_source(ctx, dev_id, "kernel.cl", var->flags, &prgm);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "failed to compile kernel !\n");
+
+      show_build_log(dev_id, prgm);
+      return EXIT_FAILURE;
+    }
+
+    cl_kernel krnl = clCreateKernel(prgm, "hash_many", &status);
+    show_message_and_exit(status, "failed to create `hash_many` kernel !\n");
+
+    clSetKernelArg(krnl, 0, sizeof(cl_mem), &i_buf);
+    clSetKernelArg(krnl, 1, sizeof(cl_mem), &o_buf);
+
+    // global message variants permute input in place, so input is rewritten
+    // before checking output of each variant
+    status = clEnqueueWriteBuffer(c_queue,
+                                  i_buf,
+                                  CL_TRUE,
+                                  0,
+                                  i_size,
+                                  var->uchar_io ? (void*)i_bytes
+                                                : (void*)i_words,
+                                  0,
+                                  NULL,
+                                  NULL);
+    show_message_and_exit(status, "failed to write input !\n");
+
+    cl_ulong ts = 0;
+    status = dispatch_hash_many(c_queue, krnl, count, wg_size, &ts);
+    show_message_and_exit(status, "failed to dispatch kernel !\n");
+
+    if (var->uchar_io) {
+      status = clEnqueueReadBuffer(
+        c_queue, o_buf, CL_TRUE, 0, 32, o_bytes, 0, NULL, NULL);
+    } else {
+      status = clEnqueueReadBuffer(
+        c_queue, o_buf, CL_TRUE, 0, 32, o_words, 0, NULL, NULL);
+      words_to_le_bytes(o_words, 8, o_bytes, 32);
+    }
+    show_message_and_exit(status, "failed to read output !\n");
+
+    if (memcmp(o_bytes, known_digest, 32) != 0) {
+      fprintf(stderr, "%s: computed wrong digest !\n", var->name);
+      return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < warmup; i++) {
+      status = dispatch_hash_many(c_queue, krnl, count, wg_size, &ts);
+      show_message_and_exit(status, "failed to dispatch kernel !\n");
+    }
+
+    for (size_t i = 0; i < iters; i++) {
+      status = dispatch_hash_many(c_queue, krnl, count, wg_size, samples + i);
+      show_message_and_exit(status, "failed to dispatch kernel !\n");
+    }
+
+    bench_stats_t st;
+    bench_stats(samples, iters, &st);
+
+    // compressions per second, using median kernel execution time
+    const double cps = (double)count / (st.median * 1e-9);
+    // cycles per byte, per compute unit, at maximum clock frequency; so that
+    // it can be compared with single core cycles/ byte figures of CPUs
+    const double cpb = (st.median * 1e-9) * (double)clock_mhz * 1e6 *
+                       (double)compute_units / (double)i_size;
+
+    printf("%s,%zu,%zu,%.0lf,%.1lf,%.0lf,%.3lf,%.3lf\n",
+           var->name,
+           count,
+           iters,
+           st.min,
+           st.median,
+           st.p99,
+           cps * 1e-6,
+           cpb);
+    fflush(stdout);
+
+    clReleaseKernel(krnl);
+    clReleaseProgram(prgm);
+  }
+
+  clReleaseMemObject(i_buf);
+  clReleaseMemObject(o_buf);
+  clReleaseCommandQueue(c_queue);
+  clReleaseContext(ctx);
+  clReleaseDevice(dev_id);
+
+  free(i_bytes);
+  free(i_words);
+  free(o_bytes);
+  free(o_words);
+  free(samples);
+
+  return EXIT_SUCCESS;
+}
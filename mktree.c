@@ -0,0 +1,626 @@
+// Merklizes real data, read from a file or a directory tree
+//
+// Usage:
+//
+//  ./mktree [--leaves chunks|records] [--backend cl|cpu] [--workers N]
+//           [--tree FILE] [--proof IDX] PATH
+//
+// When PATH is a file, its leaves are either its 32 -bytes records ( file size
+// must be multiple of 32 ), or BLAKE3 digests of its 1024 -bytes chunks ( last
+// one may be shorter; empty file has one leaf, digest of empty chunk ). Note,
+// chunk leaves are each chunk hashed on its own, so root isn't BLAKE3 of
+// whole file.
+//
+// When PATH is a directory, all regular files under it are merklized, as
+// above, and directory tree is built over leaves
+//
+// blake3( blake3( relative path ) || root of file )
+//
+// one per file, in ascending byte order of relative paths; so renaming/
+// moving a file changes directory root. Each relative path is hashed as one
+// BLAKE3 chunk, so it can be at most 1024 bytes long.
+//
+// Leaf count of each tree is padded to next power of 2 ( at least 2 ), using
+// zero leaves.
+//
+// Root of file/ directory tree is written to stdout, as hex. With --tree,
+// whole tree is also written as tree file ( see include/tree_file.h ), while
+// with --proof, leaf at given index & its siblings on path to root, bottom-up,
+// are written to stdout, one per line. Throughput of reading & hashing is
+// reported on stderr.
+//
+// Files are read by --workers -many threads ( 0 => # -of online CPUs ), where
+// large single file is split into ranges read concurrently, while files of
+// directory are read concurrently, one per thread. With --backend cl, file
+// trees having at least 2 ^ 16 leaves & directory tree are merklized on
+// OpenCL device, while smaller file trees are merklized on host, by reading
+// threads themselves ( files of directory ) or once all ranges are read
+// ( single file ).
+
+#include "bench.h"
+#include "tree_file.h"
+#include <ftw.h>
+
+#define show_message_and_exit(status, msg)                                     \
+  if (status != CL_SUCCESS) {                                                  \
+    fprintf(stderr, msg);                                                      \
+    return EXIT_FAILURE;                                                       \
+  }
+
+#define CHUNK_LEN 1024
+#define DEVICE_MIN_LOG 16
+
+enum leaf_mode
+{
+  LEAF_CHUNKS = 0,
+  LEAF_RECORDS = 1
+};
+
+typedef struct
+{
+  char* path;
+  const char* rel; // relative to directory being merklized
+  size_t size;     // in bytes
+  size_t leaf_count;
+  cl_uchar* tree; // 2N nodes, padded leaf count N
+  size_t tree_leaves;
+  cl_uchar root[32];
+  int rooted; // is root computed ?
+  int failed;
+} input_file_t;
+
+// State shared by reading threads
+typedef struct
+{
+  enum leaf_mode mode;
+  input_file_t* files;
+  size_t file_cnt;
+  size_t range; // leaves per range, when a single file is split
+  atomic_size_t next;
+  size_t host_max; // file trees upto these many leaves are built by readers
+} ingest_t;
+
+// Padded leaf count of tree, holding `n` leaves
+size_t
+tree_leaf_count(size_t n)
+{
+  size_t m = 2;
+  while (m < n) {
+    m <<= 1;
+  }
+  return m;
+}
+
+// # -of leaves of file of given size, or 0 when it can't be split into leaves
+size_t
+file_leaf_count(size_t size, enum leaf_mode mode)
+{
+  if (mode == LEAF_RECORDS) {
+    return (size & 31) == 0 ? size >> 5 : 0;
+  }
+  return size == 0 ? 1 : (size + CHUNK_LEN - 1) / CHUNK_LEN;
+}
+
+// Reads leaves [first, last) of file, in blocks of few MB, writing them at
+// `leaves`; returns 0 on success, otherwise -1
+int
+ingest_range(int fd,
+             const input_file_t* file,
+             enum leaf_mode mode,
+             size_t first,
+             size_t last,
+             cl_uchar* const leaves,
+             cl_uchar* const buf,
+             size_t buf_size)
+{
+  const size_t leaf_len = mode == LEAF_RECORDS ? 32 : CHUNK_LEN;
+  const size_t per_block = buf_size / leaf_len;
+
+  for (size_t l = first; l < last; l += per_block) {
+    const size_t cnt = last - l < per_block ? last - l : per_block;
+    const size_t off = l * leaf_len;
+    const size_t end = off + cnt * leaf_len;
+    const size_t len = (end < file->size ? end : file->size) - off;
+
+    // records are read straight into their place
+    cl_uchar* const dst = mode == LEAF_RECORDS ? leaves + (l << 5) : buf;
+
+    for (size_t done = 0; done < len;) {
+      const ssize_t n = pread(fd, dst + done, len - done, off + done);
+      if (n <= 0) {
+        return -1;
+      }
+      done += (size_t)n;
+    }
+
+    if (mode == LEAF_CHUNKS) {
+      for (size_t i = 0; i < cnt; i++) {
+        const size_t c_off = i * CHUNK_LEN;
+        const size_t c_len = len - c_off < CHUNK_LEN ? len - c_off : CHUNK_LEN;
+
+        blake3_hash_host(buf + c_off, c_len, leaves + ((l + i) << 5));
+      }
+    }
+  }
+
+  return 0;
+}
+
+void*
+ingest_worker(void* arg)
+{
+  ingest_t* const ing = (ingest_t*)arg;
+
+  const size_t buf_size = (size_t)4 << 20;
+  cl_uchar* buf = (cl_uchar*)malloc(buf_size);
+  check_mem_alloc(buf);
+
+  if (ing->file_cnt == 1) {
+    // single file, split into ranges of leaves
+    input_file_t* const file = ing->files;
+    const int fd = open(file->path, O_RDONLY);
+
+    for (;;) {
+      const size_t first = atomic_fetch_add(&ing->next, ing->range);
+      if (first >= file->leaf_count) {
+        break;
+      }
+
+      const size_t last = first + ing->range < file->leaf_count
+                            ? first + ing->range
+                            : file->leaf_count;
+
+      if (fd < 0 || ingest_range(fd,
+                                 file,
+                                 ing->mode,
+                                 first,
+                                 last,
+                                 file->tree + (file->tree_leaves << 5),
+                                 buf,
+                                 buf_size) != 0) {
+        file->failed = 1;
+      }
+    }
+
+    if (fd >= 0) {
+      close(fd);
+    }
+  } else {
+    // many files, each one read by a single thread
+    for (;;) {
+      const size_t i = atomic_fetch_add(&ing->next, 1);
+      if (i >= ing->file_cnt) {
+        break;
+      }
+
+      input_file_t* const file = ing->files + i;
+      const int fd = open(file->path, O_RDONLY);
+
+      if (fd < 0 || ingest_range(fd,
+                                 file,
+                                 ing->mode,
+                                 0,
+                                 file->leaf_count,
+                                 file->tree + (file->tree_leaves << 5),
+                                 buf,
+                                 buf_size) != 0) {
+        file->failed = 1;
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+
+      // small trees are cheaper to merklize right here, on host, bottom-up
+      if (!file->failed && file->tree_leaves <= ing->host_max) {
+        for (size_t j = file->tree_leaves - 1; j > 0; j--) {
+          blake3_hash_pair_host(file->tree + (j << 6), file->tree + (j << 5));
+        }
+
+        memcpy(file->root, file->tree + 32, 32);
+        file->rooted = 1;
+      }
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Files found while walking directory, `nftw( ... )` takes no user data
+input_file_t* walk_files = NULL;
+size_t walk_cnt = 0;
+size_t walk_cap = 0;
+size_t walk_prefix = 0; // length of directory path, followed by '/'
+
+int
+walk_visit(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  if (type != FTW_F || !S_ISREG(st->st_mode)) {
+    return 0;
+  }
+
+  if (walk_cnt == walk_cap) {
+    walk_cap = walk_cap == 0 ? 64 : walk_cap << 1;
+    walk_files =
+      (input_file_t*)realloc(walk_files, sizeof(input_file_t) * walk_cap);
+    check_mem_alloc(walk_files);
+  }
+
+  input_file_t* const file = walk_files + walk_cnt++;
+  memset(file, 0, sizeof(input_file_t));
+
+  file->path = strdup(path);
+  file->rel = file->path + walk_prefix;
+  file->size = (size_t)st->st_size;
+
+  return 0;
+}
+
+int
+file_rel_cmp(const void* a, const void* b)
+{
+  return strcmp(((const input_file_t*)a)->rel, ((const input_file_t*)b)->rel);
+}
+
+void
+print_hex(const cl_uchar* bytes, FILE* fd)
+{
+  for (size_t i = 0; i < 32; i++) {
+    fprintf(fd, "%02x", bytes[i]);
+  }
+  fprintf(fd, "\n");
+}
+
+// OpenCL resources, only acquired with --backend cl
+typedef struct
+{
+  cl_device_id dev_id;
+  cl_context ctx;
+  cl_command_queue cq;
+  cl_program prgm;
+  cl_kernel krnl;
+} backend_t;
+
+// Merklizes tree of N leaves, living at [N, 2N) of `tree`, in place, on
+// chosen backend
+cl_int
+build_tree(const backend_t* cl, cl_uchar* const tree, size_t n)
+{
+  if (cl == NULL) {
+    merklize_host(tree + (n << 5), n << 5, n, tree, n << 5, 0);
+    return CL_SUCCESS;
+  }
+
+  cl_ulong ts[3];
+  return merklize_inplace(
+    cl->ctx, cl->cq, cl->krnl, tree, n << 6, n, 0, ts, NULL);
+}
+
+int
+main(int argc, char** argv)
+{
+  enum leaf_mode mode = LEAF_CHUNKS;
+  int use_cl = 1;
+  size_t workers = 0;
+  const char* tree_path = NULL;
+  long long proof_idx = -1;
+  const char* path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+
+    if (strncmp(arg, "--", 2) != 0) {
+      path = arg;
+      continue;
+    }
+
+    const char* val = i + 1 < argc ? argv[++i] : NULL;
+    if (val == NULL) {
+      fprintf(stderr, "missing value for %s !\n", arg);
+      return EXIT_FAILURE;
+    }
+
+    if (strcmp(arg, "--leaves") == 0) {
+      if (strcmp(val, "records") == 0) {
+        mode = LEAF_RECORDS;
+      } else if (strcmp(val, "chunks") == 0) {
+        mode = LEAF_CHUNKS;
+      } else {
+        fprintf(stderr, "unknown leaf mode %s !\n", val);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--backend") == 0) {
+      if (strcmp(val, "cl") == 0) {
+        use_cl = 1;
+      } else if (strcmp(val, "cpu") == 0) {
+        use_cl = 0;
+      } else {
+        fprintf(stderr, "unknown backend %s !\n", val);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--workers") == 0) {
+      workers = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--tree") == 0) {
+      tree_path = val;
+    } else if (strcmp(arg, "--proof") == 0) {
+      proof_idx = strtoll(val, NULL, 10);
+    } else {
+      fprintf(stderr, "unknown argument %s !\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (path == NULL) {
+    fprintf(stderr, "missing file/ directory to merklize !\n");
+    return EXIT_FAILURE;
+  }
+
+  if (workers == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? (size_t)cpus : 1;
+  }
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  const int is_dir = S_ISDIR(st.st_mode);
+
+  if (is_dir) {
+    walk_prefix = strlen(path) + (path[strlen(path) - 1] == '/' ? 0 : 1);
+    if (nftw(path, walk_visit, 64, FTW_PHYS) != 0) {
+      perror(path);
+      return EXIT_FAILURE;
+    }
+
+    qsort(walk_files, walk_cnt, sizeof(input_file_t), file_rel_cmp);
+  } else {
+    walk_visit(path, &st, FTW_F, NULL);
+  }
+
+  if (walk_cnt == 0) {
+    fprintf(stderr, "no regular files found under %s !\n", path);
+    return EXIT_FAILURE;
+  }
+
+  size_t bytes = 0;
+
+  for (size_t i = 0; i < walk_cnt; i++) {
+    input_file_t* const file = walk_files + i;
+
+    file->leaf_count = file_leaf_count(file->size, mode);
+    if (file->leaf_count == 0) {
+      fprintf(stderr, "size of %s isn't multiple of 32 !\n", file->path);
+      return EXIT_FAILURE;
+    }
+
+    // padding leaves stay zero
+    file->tree_leaves = tree_leaf_count(file->leaf_count);
+    file->tree = (cl_uchar*)host_tree_alloc(file->tree_leaves << 6);
+    check_mem_alloc(file->tree);
+
+    bytes += file->size;
+  }
+
+  backend_t cl_;
+  backend_t* cl = NULL;
+
+  if (use_cl) {
+    cl_int status;
+
+    status = find_device(&cl_.dev_id);
+    show_message_and_exit(status, "failed to find device !\n");
+
+    cl_.ctx = clCreateContext(NULL, 1, &cl_.dev_id, NULL, NULL, &status);
+    show_message_and_exit(status, "failed to create context !\n");
+
+    // see main.c, for why these queue properties are required
+    cl_queue_properties props[] = { CL_QUEUE_PROPERTIES,
+                                    CL_QUEUE_PROFILING_ENABLE |
+                                      CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                    0 };
+    cl_.cq =
+      clCreateCommandQueueWithProperties(cl_.ctx, cl_.dev_id, props, &status);
+    show_message_and_exit(status, "failed to create command queue !\n");
+
+    status = build_kernel_from_source(
+      cl_.ctx, cl_.dev_id, "kernel.cl", ocl_kernel_flag_2, &cl_.prgm);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "failed to compile kernel !\n");
+
+      show_build_log(cl_.dev_id, cl_.prgm);
+      return EXIT_FAILURE;
+    }
+
+    cl_.krnl = clCreateKernel(cl_.prgm, "merklize", &status);
+    show_message_and_exit(status, "failed to create `merklize` kernel !\n");
+
+    cl = &cl_;
+  }
+
+  // reading ( & chunk hashing ) leaves of all files
+  ingest_t ing = { .mode = mode,
+                   .files = walk_files,
+                   .file_cnt = walk_cnt,
+                   .range = (size_t)1 << 16,
+                   .host_max = use_cl ? ((size_t)1 << DEVICE_MIN_LOG) - 1
+                                      : SIZE_MAX };
+  atomic_init(&ing.next, 0);
+
+  const cl_ulong t0 = bench_now_ns();
+
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * workers);
+  check_mem_alloc(threads);
+
+  // readers take files off a shared cursor, so fewer of them, than asked
+  // for, still read all files
+  size_t started = 0;
+  while (started < workers &&
+         pthread_create(threads + started, NULL, ingest_worker, &ing) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    fprintf(stderr, "failed to start reader threads !\n");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+
+  const cl_ulong t1 = bench_now_ns();
+
+  for (size_t i = 0; i < walk_cnt; i++) {
+    input_file_t* const file = walk_files + i;
+
+    if (file->failed) {
+      fprintf(stderr, "failed to read %s !\n", file->path);
+      return EXIT_FAILURE;
+    }
+    if (file->rooted) {
+      continue;
+    }
+
+    // single file tree goes to tree file, when asked for
+    if (!is_dir && tree_path != NULL) {
+      break;
+    }
+
+    // single file, read in ranges, is only merklized here, so small tree of
+    // it stays on host, same as ones of files of directory
+    const cl_int status =
+      build_tree(file->tree_leaves <= ing.host_max ? NULL : cl,
+                 file->tree,
+                 file->tree_leaves);
+    show_message_and_exit(status, "failed to merklize file !\n");
+
+    memcpy(file->root, file->tree + 32, 32);
+    file->rooted = 1;
+  }
+
+  // leaves of top level tree, which is either tree of single file or of
+  // directory
+  size_t n = walk_files->tree_leaves;
+  const cl_uchar* leaves = walk_files->tree + (n << 5);
+  cl_uchar* dir_leaves = NULL;
+
+  if (is_dir) {
+    n = tree_leaf_count(walk_cnt);
+    dir_leaves = (cl_uchar*)calloc(n, 32);
+    check_mem_alloc(dir_leaves);
+
+    for (size_t i = 0; i < walk_cnt; i++) {
+      const input_file_t* file = walk_files + i;
+      const size_t rel_len = strlen(file->rel);
+
+      if (rel_len > CHUNK_LEN) {
+        fprintf(stderr,
+                "path %s is longer than %d bytes !\n",
+                file->rel,
+                CHUNK_LEN);
+        return EXIT_FAILURE;
+      }
+
+      cl_uchar msg[64];
+      blake3_hash_host((const cl_uchar*)file->rel, rel_len, msg);
+      memcpy(msg + 32, file->root, 32);
+      blake3_hash_pair_host(msg, dir_leaves + (i << 5));
+    }
+
+    leaves = dir_leaves;
+  }
+
+  // top level tree, 2N nodes
+  tree_file_t tf;
+  cl_uchar* top = NULL;
+
+  if (tree_path != NULL) {
+    if (tree_file_create(tree_path, n, &tf) != 0) {
+      perror(tree_path);
+      return EXIT_FAILURE;
+    }
+
+    memcpy(tf.nodes + (n << 5), leaves, n << 5);
+
+    // tree of small single file is merklized on host, see above
+    if (cl != NULL && (is_dir || n > ing.host_max)) {
+      cl_ulong ts[3];
+      const cl_int status =
+        tree_file_merklize(&tf, cl->ctx, cl->cq, cl->krnl, 0, ts, NULL);
+      show_message_and_exit(status, "failed to merklize tree file !\n");
+    } else if (tree_file_merklize_host(&tf, 0) != 0) {
+      perror(tree_path);
+      return EXIT_FAILURE;
+    }
+
+    top = tf.nodes;
+  } else if (is_dir) {
+    top = (cl_uchar*)host_tree_alloc(n << 6);
+    check_mem_alloc(top);
+
+    memcpy(top + (n << 5), leaves, n << 5);
+
+    const cl_int status = build_tree(cl, top, n);
+    show_message_and_exit(status, "failed to merklize directory !\n");
+  } else {
+    top = walk_files->tree;
+  }
+
+  const cl_ulong t2 = bench_now_ns();
+
+  print_hex(top + 32, stdout);
+
+  if (proof_idx >= 0) {
+    if ((size_t)proof_idx >= n) {
+      fprintf(stderr, "leaf index %lld is out of range !\n", proof_idx);
+      return EXIT_FAILURE;
+    }
+
+    size_t node = n + (size_t)proof_idx;
+    print_hex(top + (node << 5), stdout);
+
+    for (; node > 1; node >>= 1) {
+      print_hex(top + ((node ^ 1) << 5), stdout);
+    }
+  }
+
+  fprintf(stderr,
+          "%zu file(s), %zu bytes, read in %.4lf ms ( %.4lf GB/s ), "
+          "merklized in %.4lf ms, on %s\n",
+          walk_cnt,
+          bytes,
+          (double)(t1 - t0) * 1e-6,
+          bench_gbps(bytes, (double)(t1 - t0)),
+          (double)(t2 - t1) * 1e-6,
+          use_cl ? "device" : "host");
+
+  if (tree_path != NULL) {
+    tree_file_close(&tf);
+  } else if (is_dir) {
+    host_tree_free(top, n << 6);
+  }
+
+  for (size_t i = 0; i < walk_cnt; i++) {
+    input_file_t* const file = walk_files + i;
+
+    host_tree_free(file->tree, file->tree_leaves << 6);
+    free(file->path);
+  }
+
+  free(walk_files);
+  free(dir_leaves);
+
+  if (cl != NULL) {
+    clReleaseKernel(cl->krnl);
+    clReleaseProgram(cl->prgm);
+    clReleaseCommandQueue(cl->cq);
+    clReleaseContext(cl->ctx);
+    clReleaseDevice(cl->dev_id);
+  }
+
+  return EXIT_SUCCESS;
+}